@@ -3,23 +3,48 @@
 #include "event.h"
 #include "imwrite.h"
 #include "incident.h"
+#include "persist.h"
+#include "velocitylog.h"
+#include "countlog.h"
+#include "tsdb.h"
+#include "od.h"
+#include "los.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <math.h>
 #include <syslog.h>
 #include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Crossing results for one track, bit i set when lane i of a line was crossed
+typedef struct
+{
+    unsigned int crossed[MAX_COUNTING_LINES];
+    unsigned int down[MAX_COUNTING_LINES];
+} CrossingHit;
+
+// Incident rules configured for a line
+typedef struct
+{
+    bool wrongway;
+    bool truckright;
+    int overspeed;
+    bool overspeed_received;
+    LimitSpeedData limitspeed;
+    bool limitspeed_received;
+} LineRules;
 
 CountingSystem *counting_system = NULL;
 
 // Add this global variable to track the last reset day
 static int last_reset_day = -1;
 
-// Global variable to track the last backup time
-static time_t last_backup_time = 0;
-static int backup_interval_seconds = 1; // Default 1 minutes (60 seconds)
-
 int daily_vehicle_count[DAILY_ARRAY_SIZE] = {0};
 int weekly_vehicle_count[WEEKLY_ARRAY_SIZE] = {0};
 
@@ -30,75 +55,115 @@ double average_speed[1] = {0};
 double daily_average_speed[DAILY_ARRAY_SIZE] = {0};
 double weekly_average_speed[WEEKLY_ARRAY_SIZE] = {0};
 
-// bool firstTime = true;
+// Speed sums behind the hourly and daily averages, every counted object has a speed
+// so the matching counts are daily_vehicle_count and today's weekly_vehicle_count
+static double daily_speed_sum[DAILY_ARRAY_SIZE] = {0};
+static double today_speed_sum = 0.0;
+
+// Local hour counts currently go to and the real time in microseconds it ends
+static int period_hour = 0;
+static gint64 period_hour_end = 0;
+
+// What the web interface reads, rebuilt on the main loop by the backup job so the FastCGI
+// thread never touches the counters, buckets and charts while they change
+static json_t *live_exports = NULL;
+static pthread_mutex_t live_exports_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Add these variables to track cleaning intervals
-static time_t last_velocity_clean_time = 0;
-static int velocity_clean_interval_seconds = 300; // Clean every 5 minutes instead of every backup
+// bool firstTime = true;
 
-static bool initialize_line_counters(MultiLaneLine *line, int num_lanes, int num_classes)
+// Incident settings exist for the first two lines only, further lines just count
+static void get_line_rules(int line_id, LineRules *rules)
 {
-    line->up_counts = (int *)calloc(num_classes * num_lanes, sizeof(int));
-    line->down_counts = (int *)calloc(num_classes * num_lanes, sizeof(int));
-    line->timestamps = (gint64 *)calloc(num_lanes, sizeof(gint64));
+    memset(rules, 0, sizeof(LineRules));
 
-    if (!line->up_counts || !line->down_counts || !line->timestamps)
+    if (line_id == LINE_1)
     {
-        free(line->up_counts);
-        free(line->down_counts);
-        free(line->timestamps);
-        return false;
+        rules->wrongway = first_wrongway;
+        rules->truckright = first_truckright;
+        rules->overspeed = first_overspeed;
+        rules->overspeed_received = first_overspeed_received;
+        rules->limitspeed = first_limitspeed;
+        rules->limitspeed_received = first_limitspeed_received;
+    }
+    else if (line_id == LINE_2)
+    {
+        rules->wrongway = second_wrongway;
+        rules->truckright = second_truckright;
+        rules->overspeed = second_overspeed;
+        rules->overspeed_received = second_overspeed_received;
+        rules->limitspeed = second_limitspeed;
+        rules->limitspeed_received = second_limitspeed_received;
     }
-    return true;
 }
 
-bool is_segment_crossed(Point *p1, Point *p2, LinePoint *seg_start, LinePoint *seg_end, int *lane_id_out)
+// Cheap reject for movements that cannot reach the line at all
+static bool movement_near_line(const MultiLaneLine *line, const Point *p1, const Point *p2)
 {
-    // Parameter lane_id_out is used for future extension but not used now
-    (void)lane_id_out; // Suppress unused parameter warning
+    const LineGeometry *geo = &line->geometry;
+    return fmaxf(p1->x, p2->x) >= geo->min_x && fminf(p1->x, p2->x) <= geo->max_x &&
+           fmaxf(p1->y, p2->y) >= geo->min_y && fminf(p1->y, p2->y) <= geo->max_y;
+}
 
-    float s1_x = seg_end->x - seg_start->x;
-    float s1_y = seg_end->y - seg_start->y;
-    float s2_x = p2->x - p1->x;
-    float s2_y = p2->y - p1->y;
+// Test the track's latest movement against every line, returns true on any hit
+static bool find_crossings(CountingSystem *system, TrackedObject *obj, CrossingHit *hit)
+{
+    memset(hit, 0, sizeof(CrossingHit));
 
-    float denominator = (-s2_x * s1_y + s1_x * s2_y);
-    const float small_value = 1e-6f;
-    if (fabsf(denominator) < small_value)
-        return false; // Lines are parallel
+    // Counted tracks are still tested, the lines they cross next are their destination
+    if (obj->trajectory_count < 2)
+        return false;
+
+    Point *prev = &obj->trajectory[obj->trajectory_count - 2];
+    Point *curr = &obj->trajectory[obj->trajectory_count - 1];
+
+    bool any = false;
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        if (line->num_lanes == 0 || !movement_near_line(line, prev, curr))
+            continue;
+
+        hit->crossed[line_id] = test_line_crossings(line, prev, curr, &hit->down[line_id]);
+        any = any || hit->crossed[line_id];
+    }
+    return any;
+}
 
-    float s = (-s1_y * (seg_start->x - p1->x) + s1_x * (seg_start->y - p1->y)) / denominator;
-    float t = (s2_x * (seg_start->y - p1->y) - s2_y * (seg_start->x - p1->x)) / denominator;
+static float get_class_pcu(int class_id)
+{
+    return class_id < NUM_VEHICLE_TYPES ? pcu_values[class_id] : 1.0f;
+}
 
-    return (s >= 0 && s <= 1 && t >= 0 && t <= 1);
+// Change one counter by delta and every total it is part of
+static void add_count(CountingSystem *system, int line_id, int class_id, int lane, int dir, int delta)
+{
+    system->counts[COUNT_INDEX(system, line_id, class_id, lane, dir)] += delta;
+    system->class_totals[class_id] += delta;
+    system->lane_totals[line_id][lane] += delta;
+    system->line_totals[line_id] += delta;
+    system->total += delta;
+    system->total_pcu += delta * get_class_pcu(class_id);
 }
 
-int get_crossing_direction(Point *p1, Point *p2, LinePoint *seg_start, LinePoint *seg_end)
+static void clear_count_totals(CountingSystem *system)
 {
-    float cross_product = (seg_end->x - seg_start->x) * (p2->y - p1->y) -
-                          (seg_end->y - seg_start->y) * (p2->x - p1->x);
-    return (cross_product > 0) ? 1 : -1; // 1 for down, -1 for up
+    memset(system->class_totals, 0, sizeof(int) * system->num_classes);
+    memset(system->lane_totals, 0, sizeof(system->lane_totals));
+    memset(system->line_totals, 0, sizeof(system->line_totals));
+    system->total = 0;
+    system->total_pcu = 0.0;
 }
 
 // Function to reset all counters in the system
 void reset_all_counters(CountingSystem *system)
 {
-    if (!system)
+    if (!system || !system->counts)
         return;
 
-    // Reset first line counters
-    if (system->line1.up_counts && system->line1.down_counts)
-    {
-        memset(system->line1.up_counts, 0, system->num_classes * system->line1.num_lanes * sizeof(int));
-        memset(system->line1.down_counts, 0, system->num_classes * system->line1.num_lanes * sizeof(int));
-    }
-
-    // Reset second line counters if enabled
-    if (system->use_second_line && system->line2.up_counts && system->line2.down_counts)
-    {
-        memset(system->line2.up_counts, 0, system->num_classes * system->line2.num_lanes * sizeof(int));
-        memset(system->line2.down_counts, 0, system->num_classes * system->line2.num_lanes * sizeof(int));
-    }
+    memset(system->counts, 0, sizeof(int) * COUNT_INDEX(system, MAX_COUNTING_LINES, 0, 0, 0));
+    clear_count_totals(system);
+    system->snapshot_due = true;
+    reset_od_matrix();
 
     // Note: We don't reset the velocity buffer here since we want to keep historical velocity data
 
@@ -134,10 +199,6 @@ bool check_midnight_reset(CountingSystem *system)
         const char *vehicle_pcu_filename = "/usr/local/packages/enixma_analytic/localdata/vehicle_pcu.json";
         save_vehicle_pcu_data(system, vehicle_pcu_filename);
 
-        // Clean velocity records older than 24 hours (86400000000 microseconds)
-        // This keeps a day's worth of data across the midnight boundary for continuity
-        clean_velocity_buffer(system, 86400000000);
-
         // Clear the daily vehicle count array
         memset(daily_vehicle_count, 0, sizeof(daily_vehicle_count));
         shift_array_left(weekly_vehicle_count, WEEKLY_ARRAY_SIZE);
@@ -148,874 +209,1260 @@ bool check_midnight_reset(CountingSystem *system)
         memset(daily_average_speed, 0, sizeof(daily_average_speed));
         shift_array_left_double(weekly_average_speed, WEEKLY_ARRAY_SIZE);
 
+        memset(daily_speed_sum, 0, sizeof(daily_speed_sum));
+        today_speed_sum = 0.0;
+
         // Reset all counters
         reset_all_counters(system);
 
         // Update the last reset day
         last_reset_day = current_day;
 
-        // Reset velocity clean timer to prevent immediate cleaning after reset
-        last_velocity_clean_time = now;
-
         return true;
     }
 
     return false;
 }
 
-CountingSystem *init_counting_system(int num_classes, int num_lanes, LinePoint *points)
+static gint64 current_speed_minute(void)
 {
-    if (num_lanes > MAX_LANES || !points || num_lanes <= 0)
-        return NULL;
-
-    // Initialize last_reset_day when the system is first created
-    time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
-    last_reset_day = local_time->tm_mday;
-
-    // Initialize the last backup time and velocity clean time
-    last_backup_time = now;
-    last_velocity_clean_time = now;
-
-    CountingSystem *system = (CountingSystem *)malloc(sizeof(CountingSystem));
-    if (!system)
-        return NULL;
+    return g_get_real_time() / ((gint64)SPEED_BUCKET_SECONDS * G_USEC_PER_SEC);
+}
 
-    // Rest of initialization code remains the same
-    system->num_classes = num_classes;
-    system->use_second_line = false;
+static int get_speed_bin(double velocity)
+{
+    int bin = (int)(velocity / SPEED_HISTOGRAM_BIN_KMH);
+    if (bin < 0)
+        return 0;
+    if (bin >= SPEED_HISTOGRAM_BINS)
+        return SPEED_HISTOGRAM_BINS - 1;
+    return bin;
+}
 
-    // Initialize direction flags to false (count up by default)
-    system->line1_direction = false;
-    system->line2_direction = false;
+static void add_to_aggregate(SpeedAggregate *aggregate, double velocity)
+{
+    aggregate->sum += velocity;
+    aggregate->count++;
+    aggregate->bins[get_speed_bin(velocity)]++;
+}
 
-    // Initialize first line
-    system->line1.num_lanes = num_lanes;
-    system->line1.num_points = num_lanes + 1;
+// Speed below which the given percentage of objects fall, interpolated inside the bin
+static float get_aggregate_percentile(const SpeedAggregate *aggregate, float percentile)
+{
+    if (aggregate->count <= 0)
+        return 0.0f;
 
-    if (!initialize_line_counters(&system->line1, num_lanes, num_classes))
+    float target = aggregate->count * percentile / 100.0f;
+    int below = 0;
+    for (int b = 0; b < SPEED_HISTOGRAM_BINS; b++)
     {
-        free(system);
-        return NULL;
+        int in_bin = aggregate->bins[b];
+        if (in_bin > 0 && below + in_bin >= target)
+        {
+            float fraction = (target - below) / in_bin;
+            return (b + fraction) * SPEED_HISTOGRAM_BIN_KMH;
+        }
+        below += in_bin;
     }
+    return SPEED_HISTOGRAM_BINS * SPEED_HISTOGRAM_BIN_KMH;
+}
 
-    for (int i = 0; i < system->line1.num_points; i++)
+static void merge_aggregate(SpeedAggregate *total, const SpeedAggregate *part)
+{
+    total->sum += part->sum;
+    total->count += part->count;
+    for (int b = 0; b < SPEED_HISTOGRAM_BINS; b++)
     {
-        system->line1.points[i] = points[i];
+        total->bins[b] += part->bins[b];
     }
-
-    // Initialize second line structures but don't enable it
-    system->line2.num_lanes = 0;
-    system->line2.num_points = 0;
-    system->line2.up_counts = NULL;
-    system->line2.down_counts = NULL;
-    system->line2.timestamps = NULL;
-
-    // Initialize velocity buffer
-    system->velocity_buffer_count = 0;
-    system->velocity_buffer_index = 0;
-
-    return system;
 }
 
-void update_line_points(CountingSystem *system, LineId line_id, LinePoint *points, int num_points)
+static void subtract_aggregate(SpeedAggregate *total, const SpeedAggregate *part)
 {
-    if (!system || !points || num_points > MAX_SEGMENTS || num_points <= 1)
+    total->count -= part->count;
+    total->sum -= part->sum;
+    for (int b = 0; b < SPEED_HISTOGRAM_BINS; b++)
     {
-        return;
+        total->bins[b] -= part->bins[b];
     }
 
-    MultiLaneLine *line = (line_id == LINE_1) ? &system->line1 : &system->line2;
+    // Avoid leaving rounding residue behind once the window is empty
+    if (total->count <= 0)
+        memset(total, 0, sizeof(SpeedAggregate));
+}
 
-    // For second line, initialize if not already done
-    if (line_id == LINE_2 && !system->use_second_line)
+static void remove_bucket_from_totals(CountingSystem *system, const SpeedBucket *bucket)
+{
+    subtract_aggregate(&system->speed_totals.total, &bucket->total);
+    for (int c = 0; c < MAX_SPEED_CLASSES; c++)
     {
-        if (!initialize_line_counters(line, num_points - 1, system->num_classes))
-        {
-            return;
-        }
-        system->use_second_line = true;
+        subtract_aggregate(&system->speed_totals.classes[c], &bucket->classes[c]);
     }
-
-    line->num_points = num_points;
-    line->num_lanes = num_points - 1;
-
-    for (int i = 0; i < num_points; i++)
+    for (int l = 0; l < MAX_COUNTING_LINES; l++)
     {
-        line->points[i] = points[i];
+        for (int lane = 0; lane < MAX_LANES; lane++)
+        {
+            subtract_aggregate(&system->speed_totals.lanes[l][lane], &bucket->lanes[l][lane]);
+        }
     }
 }
 
-bool resize_line_lanes(CountingSystem *system, LineId line_id, int new_lane_count)
+static void add_bucket_to_totals(CountingSystem *system, const SpeedBucket *bucket)
 {
-    if (!system || new_lane_count <= 0 || new_lane_count > MAX_LANES)
+    SpeedBucket *totals = &system->speed_totals;
+    merge_aggregate(&totals->total, &bucket->total);
+    for (int c = 0; c < MAX_SPEED_CLASSES; c++)
     {
-        return false;
+        merge_aggregate(&totals->classes[c], &bucket->classes[c]);
     }
-
-    MultiLaneLine *line = (line_id == LINE_1) ? &system->line1 : &system->line2;
-
-    // If second line isn't initialized and we're trying to resize it, initialize it
-    if (line_id == LINE_2 && !system->use_second_line)
+    for (int l = 0; l < MAX_COUNTING_LINES; l++)
     {
-        if (!initialize_line_counters(line, new_lane_count, system->num_classes))
+        for (int lane = 0; lane < MAX_LANES; lane++)
         {
-            return false;
+            merge_aggregate(&totals->lanes[l][lane], &bucket->lanes[l][lane]);
         }
-        system->use_second_line = true;
-        line->num_lanes = new_lane_count;
-        line->num_points = new_lane_count + 1;
-        return true;
     }
+}
 
-    // Allocate new arrays
-    int *new_up_counts = (int *)calloc(system->num_classes * new_lane_count, sizeof(int));
-    int *new_down_counts = (int *)calloc(system->num_classes * new_lane_count, sizeof(int));
-    gint64 *new_timestamps = (gint64 *)calloc(new_lane_count, sizeof(gint64));
+static void clear_speed_bucket(SpeedBucket *bucket, gint64 minute)
+{
+    memset(bucket, 0, sizeof(SpeedBucket));
+    bucket->minute = minute;
+}
 
-    if (!new_up_counts || !new_down_counts || !new_timestamps)
+static void reset_speed_buckets(CountingSystem *system)
+{
+    for (int i = 0; i < SPEED_BUCKET_COUNT; i++)
     {
-        free(new_up_counts);
-        free(new_down_counts);
-        free(new_timestamps);
-        return false;
+        clear_speed_bucket(&system->speed_buckets[i], -1);
     }
+    clear_speed_bucket(&system->speed_totals, -1);
+    system->speed_minute = current_speed_minute();
+}
 
-    // Copy existing data
-    int min_lanes = (new_lane_count < line->num_lanes) ? new_lane_count : line->num_lanes;
+// Move the window forward to minute, taking every bucket that falls out of it off the totals
+static void advance_speed_buckets(CountingSystem *system, gint64 minute)
+{
+    if (minute <= system->speed_minute)
+        return;
 
-    for (int class_idx = 0; class_idx < system->num_classes; class_idx++)
-    {
-        for (int lane = 0; lane < min_lanes; lane++)
-        {
-            int old_idx = class_idx * line->num_lanes + lane;
-            int new_idx = class_idx * new_lane_count + lane;
-            new_up_counts[new_idx] = line->up_counts[old_idx];
-            new_down_counts[new_idx] = line->down_counts[old_idx];
-        }
-    }
+    gint64 steps = minute - system->speed_minute;
+    if (steps > SPEED_BUCKET_COUNT)
+        steps = SPEED_BUCKET_COUNT;
 
-    // Copy timestamps
-    for (int i = 0; i < min_lanes; i++)
+    for (gint64 k = steps - 1; k >= 0; k--)
     {
-        new_timestamps[i] = line->timestamps[i];
-    }
-
-    // Free old arrays
-    free(line->up_counts);
-    free(line->down_counts);
-    free(line->timestamps);
+        gint64 slot_minute = minute - k;
+        SpeedBucket *bucket = &system->speed_buckets[slot_minute % SPEED_BUCKET_COUNT];
 
-    // Update with new arrays
-    line->up_counts = new_up_counts;
-    line->down_counts = new_down_counts;
-    line->timestamps = new_timestamps;
-    line->num_lanes = new_lane_count;
-    line->num_points = new_lane_count + 1;
+        if (bucket->minute >= 0)
+            remove_bucket_from_totals(system, bucket);
+        clear_speed_bucket(bucket, slot_minute);
+    }
 
-    return true;
+    system->speed_minute = minute;
 }
 
-void update_counting(CountingSystem *system, TrackedObject *obj)
+// Fold one speed into the bucket of the given minute and into the running totals
+static void add_speed_to_buckets(CountingSystem *system, gint64 minute, float velocity,
+                                 int class_id, int line_id, int lane, int second)
 {
-    if (!system || !obj || obj->trajectory_count < 2 || obj->counted)
-    {
-        return;
-    }
+    advance_speed_buckets(system, minute);
 
-    Point *prev = &obj->trajectory[obj->trajectory_count - 2];
-    Point *curr = &obj->trajectory[obj->trajectory_count - 1];
-    int class_id = obj->class_id;
+    // Samples older than the window no longer count
+    if (minute <= system->speed_minute - SPEED_BUCKET_COUNT)
+        return;
 
-    // Check first line
-    for (int i = 0; i < system->line1.num_lanes; i++)
-    {
-        int lane_id;
-        if (is_segment_crossed(prev, curr, &system->line1.points[i],
-                               &system->line1.points[i + 1], &lane_id))
-        {
-            system->line1.timestamps[i] = g_get_monotonic_time();
-            int direction = get_crossing_direction(prev, curr,
-                                                   &system->line1.points[i], &system->line1.points[i + 1]);
+    SpeedBucket *bucket = &system->speed_buckets[minute % SPEED_BUCKET_COUNT];
+    SpeedBucket *totals = &system->speed_totals;
 
-            if (class_id >= 0 && class_id < system->num_classes)
-            {
-                int idx = class_id * system->line1.num_lanes + i;
-
-                // If line1_direction is true, we want to count DOWN objects only
-                // If line1_direction is false, we want to count UP objects only
-                bool is_desired_direction = (direction > 0 && system->line1_direction) ||
-                                            (direction < 0 && !system->line1_direction);
-
-                int type = 0;
-                if (direction > 0)
-                { // Moving DOWN
-                    if (system->line1_direction)
-                    { // We want DOWN
-                        system->line1.down_counts[idx]++;
-                        // syslog(LOG_INFO, "Line 1 Lane %d - Class %d object %d moving DOWN. Count: %d",
-                        //        i + 1, class_id, obj->track_id, system->line1.down_counts[idx]);
-                        obj->counted = true;
-
-                        // Add velocity record for this object
-                        update_velocity(obj, frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
-                        add_velocity_record(system, obj->speed_kmh, class_id);
-                        send_event_counting(app_data_counting, context.label.labels[class_id], obj->speed_kmh, 1, i + 1, "down");
-
-                        // Condition 1: Speed > 120 km/h (any lane, any class)
-                        if (obj->speed_kmh > first_overspeed && first_overspeed_received)
-                        {
-                            type = 8;
-                            // syslog(LOG_INFO, "High speed detected: %f km/h, Line 1 Lane %d - Class %d object %d",
-                            //        obj->speed_kmh, i + 1, class_id, obj->track_id);
-                        }
-
-                        // Check if system has more than one lane before applying lane-specific conditions
-                        if (system->line1.num_lanes > 1)
-                        {
-                            // Condition 2: Truck in right lane
-                            if (((class_id == 2 || class_id == 6) && i == 0) && first_truckright)
-                            {
-                                type = 7;
-                                // syslog(LOG_INFO, "Line 1 Lane 1 - Class %d object %d moving DOWN. Count: %d",
-                                //        class_id, obj->track_id, system->line1.down_counts[idx]);
-                            }
-
-                            // Condition 3: (Speed < 90 OR Speed > 120) in right lane
-                            if (((obj->speed_kmh < first_limitspeed.min || obj->speed_kmh > first_limitspeed.max) && i == 0) && first_limitspeed_received)
-                            {
-                                type = 9;
-                                // syslog(LOG_INFO, "Abnormal speed in Lane 1: %f km/h, Class %d object %d",
-                                //        obj->speed_kmh, class_id, obj->track_id);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (first_wrongway)
-                        {
-                            type = 6;
-                            // syslog(LOG_INFO, "Line 1 Lane %d - Class %d object %d moving DOWN but we're counting UP. Ignoring.",
-                            //        i + 1, class_id, obj->track_id);
-                        }
-                    }
-                }
-                else
-                { // Moving UP
-                    if (!system->line1_direction)
-                    { // We want UP
-                        system->line1.up_counts[idx]++;
-                        // syslog(LOG_INFO, "Line 1 Lane %d - Class %d object %d moving UP. Count: %d",
-                        //        i + 1, class_id, obj->track_id, system->line1.up_counts[idx]);
-                        obj->counted = true;
-
-                        // Add velocity record for this object
-                        update_velocity(obj, frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
-                        add_velocity_record(system, obj->speed_kmh, class_id);
-                        send_event_counting(app_data_counting, context.label.labels[class_id], obj->speed_kmh, 1, i + 1, "up");
-
-                        // Condition 1: Speed > 120 km/h (any lane, any class)
-                        if (obj->speed_kmh > first_overspeed && first_overspeed_received)
-                        {
-                            type = 8;
-                            // syslog(LOG_INFO, "High speed detected: %f km/h, Line 1 Lane %d - Class %d object %d",
-                            //        obj->speed_kmh, i + 1, class_id, obj->track_id);
-                        }
-
-                        // Check if system has more than one lane before applying lane-specific conditions
-                        if (system->line1.num_lanes > 1)
-                        {
-                            // Condition 2: Truck in right lane
-                            if (((class_id == 2 || class_id == 6) && i == system->line1.num_lanes - 1) && first_truckright)
-                            {
-                                type = 7;
-                                // syslog(LOG_INFO, "Line 1 Lane %d - Class %d object %d moving DOWN. Count: %d",
-                                //        system->line1.num_lanes, class_id, obj->track_id, system->line1.down_counts[idx]);
-                            }
-
-                            // Condition 3: (Speed < 90 OR Speed > 120) in right lane
-                            if (((obj->speed_kmh < first_limitspeed.min || obj->speed_kmh > first_limitspeed.max) && i == system->line1.num_lanes - 1) && first_limitspeed_received)
-                            {
-                                type = 9;
-                                // syslog(LOG_INFO, "Abnormal speed in Lane %d: %f km/h, Class %d object %d",
-                                //        system->line1.num_lanes, obj->speed_kmh, class_id, obj->track_id);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (first_wrongway)
-                        {
-                            type = 6;
-                            // syslog(LOG_INFO, "Line 1 Lane %d - Class %d object %d moving UP but we're counting DOWN. Ignoring.",
-                            //        i + 1, class_id, obj->track_id);
-                        }
-                    }
-                }
+    // Restored samples can land in a slot the window has not passed through yet
+    if (bucket->minute != minute)
+        clear_speed_bucket(bucket, minute);
 
-                if (type > 0)
-                {
-                    char filename[64]; // Pre-allocated buffer with sufficient size
-                    time_t timestamp = time(NULL);
-
-                    int written = snprintf(filename, sizeof(filename), "%ld-%i", (long)timestamp, type);
-
-                    if (written < 0 || (size_t)written >= sizeof(filename))
-                    {
-                        syslog(LOG_ERR, "Failed to create filename (buffer too small or format error)");
-                    }
-                    else
-                    {
-                        // syslog(LOG_INFO, "Writing image to filename: %s", filename);
-                        // syslog(LOG_INFO, "Line 1 Event: %s - Class %s speed %.2f km.h",
-                        //        incident_types[type], context.label.labels[obj->class_id], obj->speed_kmh);
-
-                        imwrite(filename, context.addresses.ppOutputAddrHD);
-                        send_event_incidents(app_data_incidents, context.label.labels[obj->class_id], incident_types[type], 1, obj->speed_kmh, filename);
-                    }
-                }
+    add_to_aggregate(&bucket->total, velocity);
+    add_to_aggregate(&totals->total, velocity);
 
-                if (is_desired_direction)
-                {
-                    obj->counted = true;
-                    return;
-                }
-            }
-        }
+    if (class_id >= 0 && class_id < MAX_SPEED_CLASSES)
+    {
+        add_to_aggregate(&bucket->classes[class_id], velocity);
+        add_to_aggregate(&totals->classes[class_id], velocity);
     }
 
-    // Check second line if enabled
-    if (system->use_second_line && !obj->counted)
+    if (line_id >= 0 && line_id < MAX_COUNTING_LINES && lane >= 0 && lane < MAX_LANES)
     {
-        for (int i = 0; i < system->line2.num_lanes; i++)
-        {
-            int lane_id_out;
-            if (is_segment_crossed(prev, curr, &system->line2.points[i],
-                                   &system->line2.points[i + 1], &lane_id_out))
-            {
-                system->line2.timestamps[i] = g_get_monotonic_time();
-                int direction = get_crossing_direction(prev, curr,
-                                                       &system->line2.points[i], &system->line2.points[i + 1]);
+        add_to_aggregate(&bucket->lanes[line_id][lane], velocity);
+        add_to_aggregate(&totals->lanes[line_id][lane], velocity);
+    }
 
-                if (class_id >= 0 && class_id < system->num_classes)
-                {
-                    int idx = class_id * system->line2.num_lanes + i;
-
-                    // If line2_direction is true, we want to count DOWN objects only
-                    // If line2_direction is false, we want to count UP objects only
-                    bool is_desired_direction = (direction > 0 && system->line2_direction) ||
-                                                (direction < 0 && !system->line2_direction);
-
-                    int type = 0;
-                    if (direction > 0)
-                    {
-                        // Moving DOWN
-                        if (system->line2_direction)
-                        { // We want DOWN
-                            system->line2.down_counts[idx]++;
-                            // syslog(LOG_INFO, "Line 2 Lane %d - Class %d object %d moving DOWN. Count: %d",
-                            //        i, class_id, obj->track_id, system->line2.down_counts[idx]);
-                            obj->counted = true;
-
-                            // Add velocity record for this object
-                            update_velocity(obj, frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
-                            add_velocity_record(system, obj->speed_kmh, class_id);
-                            send_event_counting(app_data_counting, context.label.labels[class_id], obj->speed_kmh, 2, i + 1, "down");
-
-                            // Condition 1: Speed > 120 km/h (any lane, any class)
-                            if (obj->speed_kmh > second_overspeed && second_overspeed_received)
-                            {
-                                type = 8;
-                                // syslog(LOG_INFO, "High speed detected: %f km/h, Line 2 Lane %d - Class %d object %d",
-                                //        obj->speed_kmh, i + 1, class_id, obj->track_id);
-                            }
-
-                            // Check if system has more than one lane before applying lane-specific conditions
-                            if (system->line2.num_lanes > 1)
-                            {
-                                // Condition 2: Truck in right lane
-                                if (((class_id == 2 || class_id == 6) && i == 0) && second_truckright)
-                                {
-                                    type = 7;
-                                    // syslog(LOG_INFO, "Line 2 Lane 1 - Class %d object %d moving DOWN. Count: %d",
-                                    //        class_id, obj->track_id, system->line2.down_counts[idx]);
-                                }
-
-                                // Condition 3: (Speed < 90 OR Speed > 120) in right lane
-                                if (((obj->speed_kmh < second_limitspeed.min || obj->speed_kmh > second_limitspeed.max) && i == 0) && second_limitspeed_received)
-                                {
-                                    type = 9;
-                                    // syslog(LOG_INFO, "Abnormal speed in Lane 1: %f km/h, Class %d object %d",
-                                    //        obj->speed_kmh, class_id, obj->track_id);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            if (second_wrongway)
-                            {
-                                type = 6;
-                                // syslog(LOG_INFO, "Line 2 Lane %d - Class %d object %d moving DOWN but we're counting UP. Ignoring.",
-                                //        i, class_id, obj->track_id);
-                            }
-                        }
-                    }
-                    else
-                    { // Moving UP
-                        if (!system->line2_direction)
-                        { // We want UP
-                            system->line2.up_counts[idx]++;
-                            // syslog(LOG_INFO, "Line 2 Lane %d - Class %d object %d moving UP. Count: %d",
-                            //        i, class_id, obj->track_id, system->line2.up_counts[idx]);
-                            obj->counted = true;
-
-                            // Add velocity record for this object
-                            update_velocity(obj, frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
-                            add_velocity_record(system, obj->speed_kmh, class_id);
-                            send_event_counting(app_data_counting, context.label.labels[class_id], obj->speed_kmh, 2, i + 1, "up");
-
-                            // Condition 1: Speed > 120 km/h (any lane, any class)
-                            if (obj->speed_kmh > second_overspeed && second_overspeed_received)
-                            {
-                                type = 8;
-                                // syslog(LOG_INFO, "High speed detected: %f km/h, Line 2 Lane %d - Class %d object %d",
-                                //        obj->speed_kmh, i + 1, class_id, obj->track_id);
-                            }
-
-                            // Check if system has more than one lane before applying lane-specific conditions
-                            if (system->line2.num_lanes > 1)
-                            {
-                                // Condition 2: Truck in right lane
-                                if (((class_id == 2 || class_id == 6) && i == system->line2.num_lanes - 1) && second_truckright)
-                                {
-                                    type = 7;
-                                    // syslog(LOG_INFO, "Line 2 Lane %d - Class %d object %d moving DOWN. Count: %d",
-                                    //        system->line2.num_lanes, class_id, obj->track_id, system->line2.down_counts[idx]);
-                                }
-
-                                // Condition 3: (Speed < 90 OR Speed > 120) in right lane
-                                if (((obj->speed_kmh < second_limitspeed.min || obj->speed_kmh > second_limitspeed.max) && i == system->line2.num_lanes - 1) && second_limitspeed_received)
-                                {
-                                    type = 9;
-                                    // syslog(LOG_INFO, "Abnormal speed in Lane %d: %f km/h, Class %d object %d",
-                                    //        system->line2.num_lanes, obj->speed_kmh, class_id, obj->track_id);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            if (second_wrongway)
-                            {
-                                type = 6;
-                                // syslog(LOG_INFO, "Line 2 Lane %d - Class %d object %d moving UP but we're counting DOWN. Ignoring.",
-                                //        i, class_id, obj->track_id);
-                            }
-                        }
-                    }
-
-                    if (type > 0)
-                    {
-                        char filename[64]; // Pre-allocated buffer with sufficient size
-                        time_t timestamp = time(NULL);
-
-                        int written = snprintf(filename, sizeof(filename), "%ld-%i", (long)timestamp, type);
-
-                        if (written < 0 || (size_t)written >= sizeof(filename))
-                        {
-                            syslog(LOG_ERR, "Failed to create filename (buffer too small or format error)");
-                        }
-                        else
-                        {
-                            // syslog(LOG_INFO, "Writing image to filename: %s", filename);
-                            // syslog(LOG_INFO, "Line 2 Event: %s - Class %s speed %.2f km.h",
-                            //        incident_types[type], context.label.labels[obj->class_id], obj->speed_kmh);
-
-                            imwrite(filename, context.addresses.ppOutputAddrHD);
-                            send_event_incidents(app_data_incidents, context.label.labels[obj->class_id], incident_types[type], 2, obj->speed_kmh, filename);
-                        }
-                    }
-
-                    if (is_desired_direction)
-                    {
-                        obj->counted = true;
-                        return;
-                    }
-                }
-            }
-        }
+    // Reservoir sample, every speed of the minute is kept with equal probability
+    int slot = bucket->total.count - 1;
+    if (slot >= SPEED_BUCKET_SAMPLES)
+        slot = g_random_int_range(0, bucket->total.count);
+
+    if (slot < SPEED_BUCKET_SAMPLES)
+    {
+        VelocitySample *sample = &bucket->samples[slot];
+        sample->velocity = velocity;
+        sample->second = (guint8)second;
+        sample->class_id = (gint8)class_id;
+        sample->line_id = (gint8)line_id;
+        sample->lane = (gint8)lane;
+        if (slot >= bucket->num_samples)
+            bucket->num_samples = slot + 1;
     }
 }
 
-void get_lane_counts(CountingSystem *system, LineId line_id, int class_id, int lane_id,
-                     int *up_count, int *down_count)
+CountingSystem *init_counting_system(int num_classes, int num_lanes, LinePoint *points)
 {
-    MultiLaneLine *line = (line_id == LINE_1) ? &system->line1 : &system->line2;
+    if (num_lanes > MAX_LANES || !points || num_lanes <= 0)
+        return NULL;
+
+    // Initialize last_reset_day when the system is first created
+    time_t now = time(NULL);
+    struct tm *local_time = localtime(&now);
+    last_reset_day = local_time->tm_mday;
+
+    CountingSystem *system = (CountingSystem *)calloc(1, sizeof(CountingSystem));
+    if (!system)
+        return NULL;
 
-    if (!system || class_id >= system->num_classes ||
-        lane_id >= line->num_lanes ||
-        (line_id == LINE_2 && !system->use_second_line))
+    system->num_classes = num_classes;
+
+    // One packed table holds the counters of every line, so lines never reallocate
+    system->counts = (int *)calloc(COUNT_INDEX(system, MAX_COUNTING_LINES, 0, 0, 0), sizeof(int));
+    system->class_totals = (int *)calloc(num_classes > 0 ? num_classes : 1, sizeof(int));
+    if (!system->counts || !system->class_totals)
     {
-        *up_count = 0;
-        *down_count = 0;
-        return;
+        free(system->counts);
+        free(system->class_totals);
+        free(system);
+        return NULL;
+    }
+
+    // Lines start unconfigured and count up, the first line is always present
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
+    {
+        update_line_geometry(&system->lines[line_id]);
     }
+    update_line_points(system, LINE_1, points, num_lanes + 1);
 
-    int idx = class_id * line->num_lanes + lane_id;
-    *up_count = line->up_counts[idx];
-    *down_count = line->down_counts[idx];
+    // Initialize velocity buckets
+    reset_speed_buckets(system);
+    system->metrics_start_us = g_get_monotonic_time();
+    system->snapshot_us = system->metrics_start_us;
+
+    return system;
 }
 
-void free_counting_system(CountingSystem *system)
+// Clear the counters of lanes from first_lane up, used when a line loses lanes
+static void clear_lane_counts(CountingSystem *system, int line_id, int first_lane)
 {
-    if (system)
+    for (int class_idx = 0; class_idx < system->num_classes; class_idx++)
     {
-        // Free first line resources
-        free(system->line1.up_counts);
-        free(system->line1.down_counts);
-        free(system->line1.timestamps);
-
-        // Free second line resources if initialized
-        if (system->use_second_line)
+        for (int lane = first_lane; lane < MAX_LANES; lane++)
         {
-            free(system->line2.up_counts);
-            free(system->line2.down_counts);
-            free(system->line2.timestamps);
+            for (int dir = COUNT_UP; dir <= COUNT_DOWN; dir++)
+                add_count(system, line_id, class_idx, lane, dir, -system->counts[COUNT_INDEX(system, line_id, class_idx, lane, dir)]);
         }
+    }
+    system->snapshot_due = true;
 
-        free(system);
+    for (int lane = first_lane; lane < MAX_LANES; lane++)
+    {
+        system->lines[line_id].timestamps[lane] = 0;
+        memset(&system->lines[line_id].metrics[lane], 0, sizeof(LaneMetrics));
     }
 }
 
-// Function to add a velocity record to the buffer
-void add_velocity_record(CountingSystem *system, float velocity, int class_id)
+// Mark a line as configured so it is tested, drawn and saved
+static void enable_line(CountingSystem *system, int line_id)
 {
-    if (!system)
+    if (line_id >= system->num_lines)
+        system->num_lines = line_id + 1;
+}
+
+void update_line_points(CountingSystem *system, int line_id, LinePoint *points, int num_points)
+{
+    if (!system || !points || num_points > MAX_SEGMENTS || num_points <= 1 ||
+        line_id < 0 || line_id >= MAX_COUNTING_LINES)
+    {
         return;
+    }
+
+    MultiLaneLine *line = &system->lines[line_id];
 
-    // Get current timestamp
-    gint64 current_time = g_get_monotonic_time(); // microseconds
+    if (num_points - 1 < line->num_lanes)
+        clear_lane_counts(system, line_id, num_points - 1);
+
+    line->num_points = num_points;
+    line->num_lanes = num_points - 1;
 
-    // If buffer is getting too full (e.g., more than 95% capacity),
-    // clean records older than 2 hours even if it's not time for regular cleaning
-    if (system->velocity_buffer_count > (HOURLY_VELOCITY_BUFFER_SIZE * 0.95))
+    for (int i = 0; i < num_points; i++)
     {
-        clean_velocity_buffer(system, 7200000000); // 2 hours in microseconds
-        // syslog(LOG_INFO, "Emergency velocity buffer cleaning due to near-capacity condition");
+        line->points[i] = points[i];
     }
 
-    // Add the record to the circular buffer
-    int idx = system->velocity_buffer_index;
-    system->velocity_buffer[idx].velocity = velocity;
-    system->velocity_buffer[idx].timestamp = current_time;
-    system->velocity_buffer[idx].class_id = class_id;
-
-    // Update buffer index and count
-    system->velocity_buffer_index = (system->velocity_buffer_index + 1) % HOURLY_VELOCITY_BUFFER_SIZE;
-    if (system->velocity_buffer_count < HOURLY_VELOCITY_BUFFER_SIZE)
-        system->velocity_buffer_count++;
+    enable_line(system, line_id);
+    update_line_geometry(line);
 }
 
-// Function to calculate average velocity over a time window
-float get_average_velocity(CountingSystem *system, int time_window_ms, int class_id)
+bool resize_line_lanes(CountingSystem *system, int line_id, int new_lane_count)
 {
-    if (!system || system->velocity_buffer_count == 0)
-        return 0.0f;
+    if (!system || new_lane_count <= 0 || new_lane_count > MAX_LANES ||
+        line_id < 0 || line_id >= MAX_COUNTING_LINES)
+    {
+        return false;
+    }
 
-    gint64 current_time = g_get_monotonic_time();
-    gint64 time_window_us = (gint64)time_window_ms * 1000; // Convert ms to microseconds
-    gint64 cutoff_time = current_time - time_window_us;
+    MultiLaneLine *line = &system->lines[line_id];
 
-    float sum_velocity = 0.0f;
-    int count = 0;
+    // Counters use a fixed lane stride, so resizing only drops the lanes that go away
+    if (new_lane_count < line->num_lanes)
+        clear_lane_counts(system, line_id, new_lane_count);
 
-    // Iterate through the buffer
-    for (int i = 0; i < system->velocity_buffer_count; i++)
-    {
-        int idx = (system->velocity_buffer_index - 1 - i + HOURLY_VELOCITY_BUFFER_SIZE) % HOURLY_VELOCITY_BUFFER_SIZE;
+    line->num_lanes = new_lane_count;
+    line->num_points = new_lane_count + 1;
+    enable_line(system, line_id);
+    update_line_geometry(line);
 
-        // Skip if record is outside the time window
-        if (system->velocity_buffer[idx].timestamp < cutoff_time)
-            continue;
+    return true;
+}
 
-        // Skip if not the requested class_id (or include all classes if class_id < 0)
-        if (class_id >= 0 && system->velocity_buffer[idx].class_id != class_id)
-            continue;
+bool is_line_enabled(CountingSystem *system, int line_id)
+{
+    return system && line_id >= 0 && line_id < system->num_lines && system->lines[line_id].num_lanes > 0;
+}
 
-        sum_velocity += system->velocity_buffer[idx].velocity;
-        count++;
-    }
+void set_line_direction(CountingSystem *system, int line_id, bool direction)
+{
+    if (!system || line_id < 0 || line_id >= MAX_COUNTING_LINES)
+        return;
 
-    return (count > 0) ? (sum_velocity / count) : 0.0f;
+    system->lines[line_id].direction = direction;
 }
 
-// Function to clean old velocity records from the buffer
-void clean_velocity_buffer(CountingSystem *system, gint64 max_age_us)
+// Point the hourly aggregates at the current hour, running the midnight rollover first
+// when the day changed. Costs one comparison until the hour is over, so counting calls
+// it too in case an object is counted before the scheduled hour job has run.
+void update_period_aggregates(CountingSystem *system)
 {
-    if (!system || system->velocity_buffer_count == 0)
+    gint64 now_us = g_get_real_time();
+    if (now_us < period_hour_end)
         return;
 
-    gint64 current_time = g_get_monotonic_time(); // Current time in microseconds
-    gint64 cutoff_time = current_time - max_age_us;
+    check_midnight_reset(system);
 
-    int read_idx = 0;
-    int write_idx = 0;
-    int records_removed = 0;
+    time_t now = (time_t)(now_us / G_USEC_PER_SEC);
+    struct tm local_time;
+    localtime_r(&now, &local_time);
 
-    // Temporary buffer to hold valid records
-    VelocityRecord temp_buffer[HOURLY_VELOCITY_BUFFER_SIZE];
+    period_hour = local_time.tm_hour;
+    period_hour_end = ((gint64)now - local_time.tm_min * 60 - local_time.tm_sec + 3600) * G_USEC_PER_SEC;
+}
 
-    // Iterate through all records and keep only the recent ones
-    for (int i = 0; i < system->velocity_buffer_count; i++)
-    {
-        read_idx = (system->velocity_buffer_index - system->velocity_buffer_count + i + HOURLY_VELOCITY_BUFFER_SIZE) % HOURLY_VELOCITY_BUFFER_SIZE;
+// Add one counted object to an hour of today, today as a whole and their average speeds
+static void add_to_period_hour(int hour, float pcu, float speed)
+{
+    daily_vehicle_count[hour]++;
+    daily_vehicle_pcu[hour] += pcu;
+    daily_speed_sum[hour] += speed;
+    daily_average_speed[hour] = daily_speed_sum[hour] / daily_vehicle_count[hour];
+
+    weekly_vehicle_count[WEEKLY_ARRAY_SIZE - 1]++;
+    weekly_vehicle_pcu[WEEKLY_ARRAY_SIZE - 1] += pcu;
+    today_speed_sum += speed;
+    weekly_average_speed[WEEKLY_ARRAY_SIZE - 1] = today_speed_sum / weekly_vehicle_count[WEEKLY_ARRAY_SIZE - 1];
+}
 
-        if (system->velocity_buffer[read_idx].timestamp >= cutoff_time)
-        {
-            // This record is recent enough, keep it
-            temp_buffer[write_idx++] = system->velocity_buffer[read_idx];
-        }
-        else
-        {
-            records_removed++;
-        }
-    }
+// Add one counted object to the current hour
+static void add_to_period_aggregates(CountingSystem *system, float pcu, float speed)
+{
+    update_period_aggregates(system);
+    add_to_period_hour(period_hour, pcu, speed);
+}
 
-    // If any records were removed, update the buffer
-    if (records_removed > 0)
+// Rebuild the speed sums from the hourly averages and counts loaded at startup
+void restore_period_aggregates(void)
+{
+    today_speed_sum = 0.0;
+    for (int i = 0; i < DAILY_ARRAY_SIZE; i++)
     {
-        // Copy valid records back to the buffer (at the beginning)
-        for (int i = 0; i < write_idx; i++)
-        {
-            system->velocity_buffer[i] = temp_buffer[i];
-        }
-
-        // Update buffer state
-        system->velocity_buffer_count = write_idx;
-        system->velocity_buffer_index = write_idx % HOURLY_VELOCITY_BUFFER_SIZE;
-
-        // syslog(LOG_INFO, "Cleaned velocity buffer: removed %d old records, kept %d recent records",
-        //        records_removed, write_idx);
+        daily_speed_sum[i] = daily_average_speed[i] * daily_vehicle_count[i];
+        today_speed_sum += daily_speed_sum[i];
     }
 }
 
-// Function to check if it's time for a periodic backup
-bool check_periodic_backup(CountingSystem *system)
+// Headway to the previous crossing of the lane, whichever way either went
+static void add_lane_crossing(LaneMetrics *metrics, gint64 previous_us, gint64 now_us)
 {
-    if (!system)
-        return false;
-
-    // Get current time
-    time_t now = time(NULL);
-
-    // If first run, initialize last_backup_time and last_velocity_clean_time
-    if (last_backup_time == 0)
+    metrics->volume++;
+    if (previous_us > 0)
     {
-        last_backup_time = now;
-        last_velocity_clean_time = now; // Initialize velocity cleaning timer
-        return false;
+        metrics->headway_sum += (now_us - previous_us) / (double)G_USEC_PER_SEC;
+        metrics->headway_count++;
     }
+}
 
-    // Check if enough time has passed for a backup
-    if (difftime(now, last_backup_time) >= backup_interval_seconds)
-    {
-        // Save the counting
-        const char *backup_filename = "/usr/local/packages/enixma_analytic/localdata/counts_backup.json";
-        save_counting_data(system, backup_filename);
+// Speed incident of a counted object: 9 for a speed outside the limits in the right lane,
+// 8 for overspeed in any lane, 0 for none. The right lane is the first lane for traffic
+// moving down and the last one moving up.
+static int get_speed_incident(const LineRules *rules, const MultiLaneLine *line, int lane, bool moving_down, float speed)
+{
+    // Condition 3: (Speed < 90 OR Speed > 120) in right lane
+    int right_lane = moving_down ? 0 : line->num_lanes - 1;
+    if (line->num_lanes > 1 && lane == right_lane && rules->limitspeed_received &&
+        (speed < rules->limitspeed.min || speed > rules->limitspeed.max))
+        return 9;
 
-        // Save the vehicle count data in the new format
-        const char *vehicle_counts_filename = "/usr/local/packages/enixma_analytic/localdata/vehicle_counts.json";
-        save_vehicle_count_data(system, vehicle_counts_filename);
+    // Condition 1: Speed > 120 km/h (any lane, any class)
+    if (speed > rules->overspeed && rules->overspeed_received)
+        return 8;
+
+    return 0;
+}
 
-        const char *vehicle_counts_daily_filename = "/usr/local/packages/enixma_analytic/localdata/daily_vehicle_count.json";
-        save_daily_vehicle_count_data(system, vehicle_counts_daily_filename);
+// Save the frame and send the incident event for an object on a line
+static void raise_line_incident(const TrackedObject *obj, int line_id, int type, float speed)
+{
+    char filename[64]; // Pre-allocated buffer with sufficient size
+    time_t timestamp = time(NULL);
 
-        const char *vehicle_counts_weekly_filename = "/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_count.json";
-        save_weekly_vehicle_count_data(system, vehicle_counts_weekly_filename);
+    int written = snprintf(filename, sizeof(filename), "%ld-%i", (long)timestamp, type);
 
-        // Save the vehicle pcu data in the new format
-        const char *vehicle_pcu_filename = "/usr/local/packages/enixma_analytic/localdata/vehicle_pcu.json";
-        save_vehicle_pcu_data(system, vehicle_pcu_filename);
+    if (written < 0 || (size_t)written >= sizeof(filename))
+    {
+        syslog(LOG_ERR, "Failed to create filename (buffer too small or format error)");
+        return;
+    }
 
-        const char *vehicle_pcu_daily_filename = "/usr/local/packages/enixma_analytic/localdata/daily_vehicle_pcu.json";
-        save_daily_vehicle_pcu_data(system, vehicle_pcu_daily_filename);
+    // syslog(LOG_INFO, "Line %d Event: %s - Class %s speed %.2f km.h",
+    //        line_id + 1, incident_types[type], context.label.labels[obj->class_id], obj->speed_kmh);
 
-        const char *vehicle_pcu_weekly_filename = "/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_pcu.json";
-        save_weekly_vehicle_pcu_data(system, vehicle_pcu_weekly_filename);
+    imwrite(filename, context.addresses.ppOutputAddrHD);
+    send_event_incidents(app_data_incidents, context.label.labels[obj->class_id], incident_types[type], line_id + 1, speed, filename);
+}
 
-        // Save velocity data
-        const char *average_speed_filename = "/usr/local/packages/enixma_analytic/localdata/average_speed.json";
-        save_average_speed_data(system, average_speed_filename);
+// Section speed is timed between the first two lines once their distance is set
+static bool is_section_line(CountingSystem *system, int line_id)
+{
+    return section_distance > 0 && (line_id == LINE_1 || line_id == LINE_2) &&
+           is_line_enabled(system, LINE_1) && is_line_enabled(system, LINE_2);
+}
 
-        const char *average_speed_daily_filename = "/usr/local/packages/enixma_analytic/localdata/daily_average_speed.json";
-        save_daily_average_speed_data(system, average_speed_daily_filename);
+// Everything a count feeds, once the speed it is counted at is known
+static void finish_count(CountingSystem *system, const TrackedObject *obj, int line_id, int lane,
+                         int class_id, bool moving_down, float speed)
+{
+    MultiLaneLine *line = &system->lines[line_id];
+    int dir = moving_down ? COUNT_DOWN : COUNT_UP;
+    float pcu = get_class_pcu(class_id);
 
-        const char *average_speed_weekly_filename = "/usr/local/packages/enixma_analytic/localdata/weekly_average_speed.json";
-        save_weekly_average_speed_data(system, average_speed_weekly_filename);
+    add_count(system, line_id, class_id, lane, dir, 1);
+    append_count_journal(g_get_real_time() / 1000, line_id, lane, class_id, dir, speed);
+    add_velocity_record(system, speed, class_id, line_id, lane);
+    add_to_period_aggregates(system, pcu, speed);
+    add_tsdb_count(class_id, line_id, lane, pcu, speed);
+    send_event_counting(app_data_counting, context.label.labels[class_id], speed, line_id + 1, lane + 1, moving_down ? "down" : "up");
 
-        // Clean velocity buffer hourly, not on every backup
-        // Only clean if it's been at least an hour since the last cleaning
-        if (difftime(now, last_velocity_clean_time) >= velocity_clean_interval_seconds)
-        {
-            // Clean velocity records older than 1 hour (3600000000 microseconds)
-            clean_velocity_buffer(system, 3600000000);
-            last_velocity_clean_time = now;
+    LineRules rules;
+    get_line_rules(line_id, &rules);
 
-            // syslog(LOG_INFO, "Performed scheduled velocity buffer cleaning");
-        }
+    // Conditions 1 and 3
+    int type = get_speed_incident(&rules, line, lane, moving_down, speed);
 
-        // Update the last backup time
-        last_backup_time = now;
-        return true;
+    // Condition 2: Truck in right lane, outranked only by a speed outside the limits there
+    int right_lane = moving_down ? 0 : line->num_lanes - 1;
+    if (type != 9 && line->num_lanes > 1 && (class_id == 2 || class_id == 6) && lane == right_lane && rules.truckright)
+    {
+        type = 7;
     }
 
-    return false;
+    if (type > 0)
+        raise_line_incident(obj, line_id, type, speed);
 }
 
-// Function to convert counting data to JSON format
-json_t *counting_data_to_json(CountingSystem *system)
+// Make a count still waiting for its section speed at the spot speed of its line. Called
+// when the section clock is abandoned: it ran out, the track ended or the application stops.
+void abandon_section_count(CountingSystem *system, TrackedObject *obj)
 {
-    if (!system)
-        return NULL;
+    if (!system || !obj || !obj->count_pending)
+        return;
 
-    json_t *root = json_object();
+    obj->count_pending = false;
+    obj->section_start_us = -1;
 
-    // Add system-wide properties
-    json_object_set_new(root, "num_classes", json_integer(system->num_classes));
-    json_object_set_new(root, "use_second_line", json_boolean(system->use_second_line));
-    json_object_set_new(root, "line1_direction", json_boolean(system->line1_direction));
-    json_object_set_new(root, "line2_direction", json_boolean(system->line2_direction));
+    // The lines may have been set up again meanwhile
+    if (!is_line_enabled(system, obj->pending_line) || obj->pending_lane >= system->lines[obj->pending_line].num_lanes ||
+        obj->pending_class < 0 || obj->pending_class >= system->num_classes)
+        return;
 
-    // Add velocity information
-    float avg_velocity = get_average_velocity(system, 3600000, -1); // Last hour, all classes
-    json_object_set_new(root, "average_velocity_kmh", json_real(avg_velocity));
+    finish_count(system, obj, obj->pending_line, obj->pending_lane, obj->pending_class, obj->pending_down, obj->spot_speed_kmh);
+}
 
-    // Create class-specific velocity averages
-    json_t *class_velocity = json_array();
+// Count the lanes found by find_crossings and raise the related incidents.
+// Lines are checked in order and a track is counted on one line at most.
+static void count_crossings(CountingSystem *system, TrackedObject *obj, const CrossingHit *hit)
+{
+    int class_id = obj->class_id;
+
+    for (int line_id = 0; line_id < system->num_lines && !obj->counted; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        if (!hit->crossed[line_id])
+            continue;
+
+        LineRules rules;
+        get_line_rules(line_id, &rules);
+
+        for (int i = 0; i < line->num_lanes; i++)
+        {
+            if (!(hit->crossed[line_id] & (1u << i)))
+                continue;
+
+            if (class_id < 0 || class_id >= system->num_classes)
+                continue;
+
+            // If direction is true, we want to count DOWN objects only
+            // If direction is false, we want to count UP objects only
+            bool moving_down = (hit->down[line_id] & (1u << i)) != 0;
+            bool is_desired_direction = moving_down == line->direction;
+
+            if (is_desired_direction)
+            {
+                // syslog(LOG_INFO, "Line %d Lane %d - Class %d object %d moving %s",
+                //        line_id + 1, i + 1, class_id, obj->track_id, moving_down ? "DOWN" : "UP");
+                obj->counted = true;
+                update_velocity(obj, frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
+
+                // In section mode the count waits for the section speed, the spot speed is kept
+                // in case the clock is abandoned before the other line
+                if (is_section_line(system, line_id) && obj->section_start_us >= 0)
+                {
+                    obj->count_pending = true;
+                    obj->pending_line = line_id;
+                    obj->pending_lane = i;
+                    obj->pending_class = class_id;
+                    obj->pending_down = moving_down;
+                    obj->spot_speed_kmh = obj->speed_kmh;
+                }
+                else
+                {
+                    finish_count(system, obj, line_id, i, class_id, moving_down, obj->speed_kmh);
+                }
+                return;
+            }
+
+            if (rules.wrongway)
+            {
+                // syslog(LOG_INFO, "Line %d Lane %d - Class %d object %d moving against the counting direction",
+                //        line_id + 1, i + 1, class_id, obj->track_id);
+                raise_line_incident(obj, line_id, 6, obj->speed_kmh);
+            }
+        }
+    }
+}
+
+// Volume and headway of every lane crossed, counted tracks and other directions included,
+// and the speed of the track once per line for the flow and speeds of the interval
+static void record_lane_crossings(CountingSystem *system, const TrackedObject *obj, const CrossingHit *hit)
+{
+    gint64 now_us = g_get_monotonic_time();
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        if (!hit->crossed[line_id])
+            continue;
+
+        for (int i = 0; i < line->num_lanes; i++)
+        {
+            if (!(hit->crossed[line_id] & (1u << i)))
+                continue;
+
+            add_lane_crossing(&line->metrics[i], line->timestamps[i], now_us);
+            line->timestamps[i] = now_us;
+        }
+
+        // A speed of 0 is a track without two samples yet, not a standing vehicle
+        if (obj->speed_kmh > 0.0f)
+            add_to_aggregate(&line->interval_speeds, obj->speed_kmh);
+    }
+}
+
+// Hand the first lane crossed on each line to the origin-destination join
+static void record_od_crossings(CountingSystem *system, const TrackedObject *obj, const CrossingHit *hit)
+{
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        for (int i = 0; i < system->lines[line_id].num_lanes; i++)
+        {
+            if (hit->crossed[line_id] & (1u << i))
+            {
+                record_od_crossing(obj->track_id, line_id, i, (hit->down[line_id] & (1u << i)) != 0);
+                break;
+            }
+        }
+    }
+}
+
+// Sub-frame time the newest movement of a track crossed a lane, interpolated
+// between the times of its two newest trajectory points
+static gint64 get_crossing_time(const MultiLaneLine *line, int lane, const TrackedObject *obj)
+{
+    const LineGeometry *geo = &line->geometry;
+    const Point *p1 = &obj->trajectory[obj->trajectory_count - 2];
+    const Point *p2 = &obj->trajectory[obj->trajectory_count - 1];
+
+    // Fraction of the movement before the lane segment, the same intersection as test_line_crossings
+    float denominator = geo->normal_x[lane] * (p2->x - p1->x) + geo->normal_y[lane] * (p2->y - p1->y);
+    float s = geo->normal_x[lane] * (geo->start_x[lane] - p1->x) + geo->normal_y[lane] * (geo->start_y[lane] - p1->y);
+    float fraction = fabsf(denominator) > 1e-6f ? fminf(fmaxf(s / denominator, 0.0f), 1.0f) : 1.0f;
+
+    gint64 span_us = obj->point_time_us[1] - obj->point_time_us[0];
+    return obj->point_time_us[0] + (gint64)(fraction * (double)span_us);
+}
+
+// Time-of-flight speed over the section between the first two lines. The first line
+// crossed starts the clock and the other one stops it, the count waiting on it is then
+// made at this speed instead of the spot speed.
+static void measure_section_speed(CountingSystem *system, TrackedObject *obj, const CrossingHit *hit)
+{
+    for (int line_id = LINE_1; line_id <= LINE_2 && obj->section_start_us >= 0; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        int lane = 0;
+        while (lane < line->num_lanes && !(hit->crossed[line_id] & (1u << lane)))
+            lane++;
+        if (lane == line->num_lanes)
+            continue;
+
+        gint64 crossing_us = get_crossing_time(line, lane, obj);
+
+        if (obj->section_start_us == 0)
+        {
+            obj->section_line = line_id;
+            obj->section_start_us = crossing_us;
+            continue;
+        }
+
+        // Crossing the start line again is jitter, the first crossing stands
+        if (obj->section_line == line_id)
+            continue;
+
+        gint64 elapsed_us = crossing_us - obj->section_start_us;
+        if (elapsed_us <= 0)
+        {
+            abandon_section_count(system, obj);
+            return;
+        }
+        obj->section_start_us = -1;
+
+        obj->speed_kmh = (float)(section_distance / ((double)elapsed_us / G_USEC_PER_SEC) * 3.6);
+
+        // Only a count made at the first line waits for this speed
+        if (obj->count_pending)
+        {
+            obj->count_pending = false;
+            finish_count(system, obj, obj->pending_line, obj->pending_lane, obj->pending_class, obj->pending_down, obj->speed_kmh);
+        }
+        return;
+    }
+}
+
+// Called whenever a track appends a trajectory point, only its newest segment is tested
+void update_counting(CountingSystem *system, TrackedObject *obj)
+{
+    if (!system || !obj)
+        return;
+
+    if (obj->count_pending && g_get_monotonic_time() - obj->section_start_us > (gint64)SECTION_TIMEOUT_SECONDS * G_USEC_PER_SEC)
+        abandon_section_count(system, obj);
+
+    CrossingHit hit;
+    if (!find_crossings(system, obj, &hit))
+        return;
+
+    record_lane_crossings(system, obj, &hit);
+    record_od_crossings(system, obj, &hit);
+    if (!obj->counted)
+        count_crossings(system, obj, &hit);
+    if (is_section_line(system, LINE_1))
+        measure_section_speed(system, obj, &hit);
+}
+
+// Whether lane segment i of a line passes through a box, clipped Liang-Barsky style
+static bool lane_in_box(const LineGeometry *geo, int i, const float *bbox)
+{
+    const float small_value = 1e-6f;
+    float p[4] = {-geo->dir_x[i], geo->dir_x[i], -geo->dir_y[i], geo->dir_y[i]};
+    float q[4] = {geo->start_x[i] - bbox[1], bbox[3] - geo->start_x[i],
+                  geo->start_y[i] - bbox[0], bbox[2] - geo->start_y[i]};
+    float t0 = 0.0f;
+    float t1 = 1.0f;
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (fabsf(p[k]) < small_value)
+        {
+            // Parallel to this edge, inside only when on the inner side of it
+            if (q[k] < 0)
+                return false;
+            continue;
+        }
+
+        float r = q[k] / p[k];
+        if (p[k] < 0)
+        {
+            if (r > t1)
+                return false;
+            t0 = fmaxf(t0, r);
+        }
+        else
+        {
+            if (r < t0)
+                return false;
+            t1 = fminf(t1, r);
+        }
+    }
+    return true;
+}
+
+// Lanes of a line covered by any box seen this frame, as a lane bitmask
+static unsigned int get_covered_lanes(const MultiLaneLine *line, const Tracker *tracker)
+{
+    const LineGeometry *geo = &line->geometry;
+    unsigned int all = line->num_lanes < 32 ? (1u << line->num_lanes) - 1 : ~0u;
+    unsigned int covered = 0;
+
+    for (int t = 0; t < tracker->count && covered != all; t++)
+    {
+        const TrackedObject *obj = &tracker->objects[t];
+        const float *bbox = obj->bbox;
+
+        // Coasting tracks only have a predicted box
+        if (obj->time_since_update > 0)
+            continue;
+        if (bbox[3] < geo->min_x || bbox[1] > geo->max_x || bbox[2] < geo->min_y || bbox[0] > geo->max_y)
+            continue;
+
+        for (int i = 0; i < line->num_lanes; i++)
+        {
+            if (!(covered & (1u << i)) && lane_in_box(geo, i, bbox))
+                covered |= 1u << i;
+        }
+    }
+    return covered;
+}
+
+// Called once per frame, adds the time each lane segment is covered by a track box
+// and the clear time between two covers. A NULL tracker means nothing is in view.
+void update_lane_occupancy(CountingSystem *system, const Tracker *tracker)
+{
+    if (!system)
+        return;
+
+    gint64 now_us = g_get_monotonic_time();
+
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        if (line->num_lanes == 0)
+            continue;
+
+        unsigned int covered = tracker ? get_covered_lanes(line, tracker) : 0;
+
+        for (int i = 0; i < line->num_lanes; i++)
+        {
+            LaneMetrics *metrics = &line->metrics[i];
+            bool is_covered = (covered & (1u << i)) != 0;
+
+            if (is_covered && metrics->covered_since_us == 0)
+            {
+                if (metrics->cleared_us > 0)
+                {
+                    metrics->gap_sum += (now_us - metrics->cleared_us) / (double)G_USEC_PER_SEC;
+                    metrics->gap_count++;
+                }
+                metrics->covered_since_us = now_us;
+            }
+            else if (!is_covered && metrics->covered_since_us > 0)
+            {
+                metrics->occupied_us += now_us - metrics->covered_since_us;
+                metrics->covered_since_us = 0;
+                metrics->cleared_us = now_us;
+            }
+        }
+    }
+}
+
+// Close the interval, keep its results for the JSON and publish one event per lane
+void close_lane_metrics(CountingSystem *system)
+{
+    if (!system)
+        return;
+
+    gint64 now_us = g_get_monotonic_time();
+    gint64 interval_us = now_us - system->metrics_start_us;
+    system->metrics_start_us = now_us;
+    if (interval_us <= 0)
+        return;
+
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        MultiLaneLine *line = &system->lines[line_id];
+        int volume = 0;
+
+        for (int i = 0; i < line->num_lanes; i++)
+        {
+            LaneMetrics *metrics = &line->metrics[i];
+            volume += metrics->volume;
+
+            // A cover still going on is split at the interval boundary
+            if (metrics->covered_since_us > 0)
+            {
+                metrics->occupied_us += now_us - metrics->covered_since_us;
+                metrics->covered_since_us = now_us;
+            }
+
+            metrics->last_volume = metrics->volume;
+            metrics->last_headway = metrics->headway_count > 0 ? (float)(metrics->headway_sum / metrics->headway_count) : 0.0f;
+            metrics->last_gap = metrics->gap_count > 0 ? (float)(metrics->gap_sum / metrics->gap_count) : 0.0f;
+            metrics->last_occupancy = (float)fmin(100.0, metrics->occupied_us * 100.0 / interval_us);
+
+            metrics->volume = 0;
+            metrics->headway_sum = 0.0;
+            metrics->headway_count = 0;
+            metrics->gap_sum = 0.0;
+            metrics->gap_count = 0;
+            metrics->occupied_us = 0;
+
+            send_event_lane_metrics(app_data_lane_metrics, line_id + 1, i + 1, metrics->last_volume,
+                                    metrics->last_headway, metrics->last_gap, metrics->last_occupancy);
+        }
+
+        // Flow and speeds of the whole line, for the level of service
+        LineTraffic *traffic = &line->traffic;
+        const SpeedAggregate *speeds = &line->interval_speeds;
+        traffic->flow = line->num_lanes > 0 ? (float)(volume * 3600.0 * G_USEC_PER_SEC / interval_us / line->num_lanes) : 0.0f;
+        traffic->speeds = speeds->count;
+        traffic->speed = speeds->count > 0 ? (float)(speeds->sum / speeds->count) : 0.0f;
+        traffic->v85 = get_aggregate_percentile(speeds, 85.0f);
+        memset(&line->interval_speeds, 0, sizeof(SpeedAggregate));
+    }
+}
+
+void get_lane_counts(CountingSystem *system, int line_id, int class_id, int lane_id,
+                     int *up_count, int *down_count)
+{
+    if (!is_line_enabled(system, line_id) || class_id < 0 || class_id >= system->num_classes ||
+        lane_id < 0 || lane_id >= system->lines[line_id].num_lanes)
+    {
+        *up_count = 0;
+        *down_count = 0;
+        return;
+    }
+
+    *up_count = system->counts[COUNT_INDEX(system, line_id, class_id, lane_id, COUNT_UP)];
+    *down_count = system->counts[COUNT_INDEX(system, line_id, class_id, lane_id, COUNT_DOWN)];
+}
+
+// Both directions over every lane of every line for one class
+int get_class_count(CountingSystem *system, int class_id)
+{
+    if (!system || class_id < 0 || class_id >= system->num_classes)
+        return 0;
+
+    return system->class_totals[class_id];
+}
+
+// Every class in both directions on one lane
+int get_lane_total(CountingSystem *system, int line_id, int lane_id)
+{
+    if (!is_line_enabled(system, line_id) || lane_id < 0 || lane_id >= system->lines[line_id].num_lanes)
+        return 0;
+
+    return system->lane_totals[line_id][lane_id];
+}
+
+// Weight the class totals again, for when pcu_values change
+void update_total_pcu(CountingSystem *system)
+{
+    if (!system)
+        return;
+
+    double total_pcu = 0.0;
     for (int i = 0; i < system->num_classes; i++)
     {
-        float class_avg = get_average_velocity(system, 3600000, i);
-        json_array_append_new(class_velocity, json_real(class_avg));
+        total_pcu += system->class_totals[i] * get_class_pcu(i);
     }
-    json_object_set_new(root, "class_velocities", class_velocity);
+    system->total_pcu = total_pcu;
+}
+
+// Replay a crossing from the count journal into the counters and the hourly charts.
+// Counters are daily, so crossings of an earlier day and of lanes that no longer exist
+// are dropped.
+void restore_count_record(CountingSystem *system, gint64 time_ms, int line_id, int lane,
+                          int class_id, int dir, float speed)
+{
+    if (!is_line_enabled(system, line_id) || lane < 0 || lane >= system->lines[line_id].num_lanes ||
+        class_id < 0 || class_id >= system->num_classes || (dir != COUNT_UP && dir != COUNT_DOWN))
+        return;
 
-    // Save the entire velocity buffer
-    json_t *velocity_buffer = json_array();
+    time_t now = time(NULL);
+    time_t when = (time_t)(time_ms / 1000);
+    struct tm local_now, local_when;
+    localtime_r(&now, &local_now);
+    localtime_r(&when, &local_when);
+    if (local_when.tm_year != local_now.tm_year || local_when.tm_yday != local_now.tm_yday)
+        return;
 
-    // If buffer is not full, we only need to save the records we have
-    int records_to_save = system->velocity_buffer_count;
+    add_count(system, line_id, class_id, lane, dir, 1);
+    add_to_period_hour(local_when.tm_hour, get_class_pcu(class_id), speed);
+}
 
-    // We'll store them in chronological order (oldest first)
-    for (int i = 0; i < records_to_save; i++)
+void free_counting_system(CountingSystem *system)
+{
+    if (system)
     {
-        // Calculate the index in the circular buffer
-        int idx = (system->velocity_buffer_index - records_to_save + i + HOURLY_VELOCITY_BUFFER_SIZE) % HOURLY_VELOCITY_BUFFER_SIZE;
+        free(system->counts);
+        free(system->class_totals);
+        free(system);
+    }
 
-        // Create a record object
-        json_t *record = json_object();
-        json_object_set_new(record, "velocity", json_real(system->velocity_buffer[idx].velocity));
-        json_object_set_new(record, "timestamp", json_integer(system->velocity_buffer[idx].timestamp));
-        json_object_set_new(record, "class_id", json_integer(system->velocity_buffer[idx].class_id));
+    pthread_mutex_lock(&live_exports_mutex);
+    json_decref(live_exports);
+    live_exports = NULL;
+    pthread_mutex_unlock(&live_exports_mutex);
+}
+
+// Function to add a velocity record to the current minute's bucket
+void add_velocity_record(CountingSystem *system, float velocity, int class_id, int line_id, int lane)
+{
+    if (!system)
+        return;
+
+    gint64 now_us = g_get_real_time();
+    gint64 bucket_us = (gint64)SPEED_BUCKET_SECONDS * G_USEC_PER_SEC;
+    int second = (int)((now_us % bucket_us) / G_USEC_PER_SEC);
+
+    add_speed_to_buckets(system, now_us / bucket_us, velocity, class_id, line_id, lane, second);
+    append_velocity_log(now_us / 1000, velocity, class_id, line_id, lane);
+}
+
+// Replay a record from the velocity log into the minute it happened
+void restore_velocity_record(CountingSystem *system, gint64 time_ms, float velocity,
+                             int class_id, int line_id, int lane)
+{
+    if (!system)
+        return;
+
+    gint64 bucket_ms = (gint64)SPEED_BUCKET_SECONDS * 1000;
+    int second = (int)((time_ms % bucket_ms) / 1000);
 
-        // Add to the buffer array
-        json_array_append_new(velocity_buffer, record);
+    add_speed_to_buckets(system, time_ms / bucket_ms, velocity, class_id, line_id, lane, second);
+}
+
+// Sum the aggregate picked by select over the buckets inside the time window.
+// A window covering every bucket is answered from the running totals.
+static SpeedAggregate sum_speed_window(CountingSystem *system, int time_window_ms,
+                                       const SpeedAggregate *(*select)(const SpeedBucket *, int, int), int a, int b)
+{
+    advance_speed_buckets(system, current_speed_minute());
+
+    gint64 bucket_ms = (gint64)SPEED_BUCKET_SECONDS * 1000;
+    gint64 minutes = ((gint64)time_window_ms + bucket_ms - 1) / bucket_ms;
+
+    if (minutes >= SPEED_BUCKET_COUNT)
+        return *select(&system->speed_totals, a, b);
+
+    SpeedAggregate result;
+    memset(&result, 0, sizeof(SpeedAggregate));
+    for (gint64 k = 0; k < minutes; k++)
+    {
+        gint64 minute = system->speed_minute - k;
+        const SpeedBucket *bucket = &system->speed_buckets[minute % SPEED_BUCKET_COUNT];
+        if (bucket->minute != minute)
+            continue;
+
+        merge_aggregate(&result, select(bucket, a, b));
     }
+    return result;
+}
+
+static const SpeedAggregate *select_class(const SpeedBucket *bucket, int class_id, int unused)
+{
+    (void)unused;
+    return class_id < 0 ? &bucket->total : &bucket->classes[class_id];
+}
+
+static const SpeedAggregate *select_lane(const SpeedBucket *bucket, int line_id, int lane)
+{
+    return &bucket->lanes[line_id][lane];
+}
+
+// Function to calculate average velocity over a time window, at minute resolution
+float get_average_velocity(CountingSystem *system, int time_window_ms, int class_id)
+{
+    if (!system || class_id >= MAX_SPEED_CLASSES)
+        return 0.0f;
+
+    SpeedAggregate window = sum_speed_window(system, time_window_ms, select_class, class_id, 0);
+    return (window.count > 0) ? (float)(window.sum / window.count) : 0.0f;
+}
+
+// Average velocity of one lane over a time window, at minute resolution
+float get_lane_average_velocity(CountingSystem *system, int time_window_ms, int line_id, int lane)
+{
+    if (!system || line_id < 0 || line_id >= MAX_COUNTING_LINES || lane < 0 || lane >= MAX_LANES)
+        return 0.0f;
+
+    SpeedAggregate window = sum_speed_window(system, time_window_ms, select_lane, line_id, lane);
+    return (window.count > 0) ? (float)(window.sum / window.count) : 0.0f;
+}
+
+// Percentile speed (V85 for 85) over a time window, at minute resolution
+float get_speed_percentile(CountingSystem *system, int time_window_ms, int class_id, float percentile)
+{
+    if (!system || class_id >= MAX_SPEED_CLASSES)
+        return 0.0f;
+
+    SpeedAggregate window = sum_speed_window(system, time_window_ms, select_class, class_id, 0);
+    return get_aggregate_percentile(&window, percentile);
+}
+
+// Percentile speed of one lane over a time window, at minute resolution
+float get_lane_speed_percentile(CountingSystem *system, int time_window_ms, int line_id, int lane, float percentile)
+{
+    if (!system || line_id < 0 || line_id >= MAX_COUNTING_LINES || lane < 0 || lane >= MAX_LANES)
+        return 0.0f;
+
+    SpeedAggregate window = sum_speed_window(system, time_window_ms, select_lane, line_id, lane);
+    return get_aggregate_percentile(&window, percentile);
+}
 
-    json_object_set_new(root, "velocity_buffer", velocity_buffer);
+// V15, V50, V85 and V95 of a window
+static json_t *percentiles_to_json(const SpeedAggregate *window)
+{
+    json_t *percentiles = json_object();
+    json_object_set_new(percentiles, "v15", json_real(get_aggregate_percentile(window, 15.0f)));
+    json_object_set_new(percentiles, "v50", json_real(get_aggregate_percentile(window, 50.0f)));
+    json_object_set_new(percentiles, "v85", json_real(get_aggregate_percentile(window, 85.0f)));
+    json_object_set_new(percentiles, "v95", json_real(get_aggregate_percentile(window, 95.0f)));
+    return percentiles;
+}
 
-    // Create first line data
-    json_t *line1 = json_object();
-    json_object_set_new(line1, "num_lanes", json_integer(system->line1.num_lanes));
+// Points, direction and per class/lane counters of one line
+static json_t *line_to_json(CountingSystem *system, int line_id)
+{
+    MultiLaneLine *line = &system->lines[line_id];
+    json_t *line_json = json_object();
+    json_object_set_new(line_json, "num_lanes", json_integer(line->num_lanes));
+    json_object_set_new(line_json, "direction", json_boolean(line->direction));
 
-    // Add line1 points
-    json_t *line1_points = json_array();
-    for (int i = 0; i < system->line1.num_points; i++)
+    json_t *points = json_array();
+    for (int i = 0; i < line->num_points; i++)
     {
         json_t *point = json_object();
-        json_object_set_new(point, "x", json_real(system->line1.points[i].x));
-        json_object_set_new(point, "y", json_real(system->line1.points[i].y));
-        json_array_append_new(line1_points, point);
+        json_object_set_new(point, "x", json_real(line->points[i].x));
+        json_object_set_new(point, "y", json_real(line->points[i].y));
+        json_array_append_new(points, point);
     }
-    json_object_set_new(line1, "points", line1_points);
+    json_object_set_new(line_json, "points", points);
 
-    // Add line1 counts for each class and lane
-    json_t *line1_up = json_array();
-    json_t *line1_down = json_array();
+    json_t *up_counts = json_array();
+    json_t *down_counts = json_array();
 
     for (int class_idx = 0; class_idx < system->num_classes; class_idx++)
     {
         json_t *class_up = json_array();
         json_t *class_down = json_array();
 
-        for (int lane = 0; lane < system->line1.num_lanes; lane++)
+        for (int lane = 0; lane < line->num_lanes; lane++)
         {
-            int idx = class_idx * system->line1.num_lanes + lane;
-            json_array_append_new(class_up, json_integer(system->line1.up_counts[idx]));
-            json_array_append_new(class_down, json_integer(system->line1.down_counts[idx]));
+            json_array_append_new(class_up, json_integer(system->counts[COUNT_INDEX(system, line_id, class_idx, lane, COUNT_UP)]));
+            json_array_append_new(class_down, json_integer(system->counts[COUNT_INDEX(system, line_id, class_idx, lane, COUNT_DOWN)]));
         }
 
-        json_array_append_new(line1_up, class_up);
-        json_array_append_new(line1_down, class_down);
+        json_array_append_new(up_counts, class_up);
+        json_array_append_new(down_counts, class_down);
     }
 
-    json_object_set_new(line1, "up_counts", line1_up);
-    json_object_set_new(line1, "down_counts", line1_down);
+    json_object_set_new(line_json, "up_counts", up_counts);
+    json_object_set_new(line_json, "down_counts", down_counts);
+    json_object_set_new(line_json, "total", json_integer(system->line_totals[line_id]));
 
-    // Add line1 to root
-    json_object_set_new(root, "line1", line1);
+    // Last hour average speed per lane
+    json_t *lane_velocities = json_array();
+    for (int lane = 0; lane < line->num_lanes; lane++)
+    {
+        json_array_append_new(lane_velocities, json_real(get_lane_average_velocity(system, 3600000, line_id, lane)));
+    }
+    json_object_set_new(line_json, "lane_velocities", lane_velocities);
 
-    // Handle second line if enabled
-    if (system->use_second_line)
+    json_t *lane_percentiles = json_array();
+    for (int lane = 0; lane < line->num_lanes; lane++)
     {
-        json_t *line2 = json_object();
-        json_object_set_new(line2, "num_lanes", json_integer(system->line2.num_lanes));
+        SpeedAggregate window = sum_speed_window(system, 3600000, select_lane, line_id, lane);
+        json_array_append_new(lane_percentiles, percentiles_to_json(&window));
+    }
+    json_object_set_new(line_json, "lane_percentiles", lane_percentiles);
 
-        // Add line2 points
-        json_t *line2_points = json_array();
-        for (int i = 0; i < system->line2.num_points; i++)
+    // Headway, gap and occupancy of the last closed interval
+    json_t *lane_metrics = json_array();
+    for (int lane = 0; lane < line->num_lanes; lane++)
+    {
+        const LaneMetrics *metrics = &line->metrics[lane];
+        json_t *metrics_json = json_object();
+        json_object_set_new(metrics_json, "volume", json_integer(metrics->last_volume));
+        json_object_set_new(metrics_json, "headway", json_real(metrics->last_headway));
+        json_object_set_new(metrics_json, "gap", json_real(metrics->last_gap));
+        json_object_set_new(metrics_json, "occupancy", json_real(metrics->last_occupancy));
+        json_array_append_new(lane_metrics, metrics_json);
+    }
+    json_object_set_new(line_json, "lane_metrics", lane_metrics);
+
+    // Flow, speeds and level of service of the approach over the same interval
+    json_t *traffic = json_object();
+    json_object_set_new(traffic, "flow", json_real(line->traffic.flow));
+    json_object_set_new(traffic, "speed", json_real(line->traffic.speed));
+    json_object_set_new(traffic, "v85", json_real(line->traffic.v85));
+    json_object_set_new(traffic, "level_of_service", level_of_service_to_json(line_id));
+    json_object_set_new(line_json, "traffic", traffic);
+    return line_json;
+}
+
+static void speed_aggregate_from_json(SpeedAggregate *aggregate, json_t *json)
+{
+    json_t *sum_json = json_array_get(json, 0);
+    json_t *count_json = json_array_get(json, 1);
+    if (json_is_number(sum_json) && json_is_integer(count_json))
+    {
+        aggregate->sum = json_number_value(sum_json);
+        aggregate->count = json_integer_value(count_json);
+    }
+}
+
+// Put a bucket saved before the velocity log existed back into its slot and onto the running totals
+static void load_speed_bucket(CountingSystem *system, json_t *bucket_json)
+{
+    json_t *minute_json = json_object_get(bucket_json, "minute");
+    if (!json_is_integer(minute_json))
+        return;
+
+    gint64 minute = json_integer_value(minute_json);
+    advance_speed_buckets(system, minute);
+    if (minute <= system->speed_minute - SPEED_BUCKET_COUNT)
+        return;
+
+    SpeedBucket *bucket = &system->speed_buckets[minute % SPEED_BUCKET_COUNT];
+    if (bucket->minute == minute)
+        return; // Already restored
+
+    clear_speed_bucket(bucket, minute);
+    speed_aggregate_from_json(&bucket->total, json_object_get(bucket_json, "total"));
+
+    json_t *classes = json_object_get(bucket_json, "classes");
+    for (int c = 0; c < MAX_SPEED_CLASSES; c++)
+    {
+        speed_aggregate_from_json(&bucket->classes[c], json_array_get(classes, c));
+    }
+
+    json_t *lines = json_object_get(bucket_json, "lanes");
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
+    {
+        json_t *lanes = json_array_get(lines, line_id);
+        for (int lane = 0; lane < MAX_LANES; lane++)
         {
-            json_t *point = json_object();
-            json_object_set_new(point, "x", json_real(system->line2.points[i].x));
-            json_object_set_new(point, "y", json_real(system->line2.points[i].y));
-            json_array_append_new(line2_points, point);
+            speed_aggregate_from_json(&bucket->lanes[line_id][lane], json_array_get(lanes, lane));
         }
-        json_object_set_new(line2, "points", line2_points);
+    }
 
-        // Add line2 counts for each class and lane
-        json_t *line2_up = json_array();
-        json_t *line2_down = json_array();
+    json_t *samples = json_object_get(bucket_json, "samples");
+    for (size_t i = 0; i < json_array_size(samples) && bucket->num_samples < SPEED_BUCKET_SAMPLES; i++)
+    {
+        json_t *sample_json = json_array_get(samples, i);
+        if (json_array_size(sample_json) != 5 || !json_is_number(json_array_get(sample_json, 0)))
+            continue;
 
-        for (int class_idx = 0; class_idx < system->num_classes; class_idx++)
-        {
-            json_t *class_up = json_array();
-            json_t *class_down = json_array();
+        double velocity = json_number_value(json_array_get(sample_json, 0));
+        VelocitySample *sample = &bucket->samples[bucket->num_samples++];
+        sample->velocity = (float)velocity;
+        sample->second = (guint8)json_integer_value(json_array_get(sample_json, 1));
+        sample->class_id = (gint8)json_integer_value(json_array_get(sample_json, 2));
+        sample->line_id = (gint8)json_integer_value(json_array_get(sample_json, 3));
+        sample->lane = (gint8)json_integer_value(json_array_get(sample_json, 4));
+    }
 
-            for (int lane = 0; lane < system->line2.num_lanes; lane++)
-            {
-                int idx = class_idx * system->line2.num_lanes + lane;
-                json_array_append_new(class_up, json_integer(system->line2.up_counts[idx]));
-                json_array_append_new(class_down, json_integer(system->line2.down_counts[idx]));
-            }
+    add_bucket_to_totals(system, bucket);
+}
 
-            json_array_append_new(line2_up, class_up);
-            json_array_append_new(line2_down, class_down);
-        }
+// Function to convert counting data to JSON format
+json_t *counting_data_to_json(CountingSystem *system)
+{
+    if (!system)
+        return NULL;
+
+    json_t *root = json_object();
+
+    // Add system-wide properties
+    json_object_set_new(root, "num_classes", json_integer(system->num_classes));
+    json_object_set_new(root, "num_lines", json_integer(system->num_lines));
+    json_object_set_new(root, "journal_seq", json_integer(get_count_journal_seq()));
+
+    // Flat flags for the first two lines kept for readers of older backups
+    json_object_set_new(root, "use_second_line", json_boolean(is_line_enabled(system, LINE_2)));
+    json_object_set_new(root, "line1_direction", json_boolean(system->lines[LINE_1].direction));
+    json_object_set_new(root, "line2_direction", json_boolean(system->lines[LINE_2].direction));
+
+    // Add velocity information
+    float avg_velocity = get_average_velocity(system, 3600000, -1); // Last hour, all classes
+    json_object_set_new(root, "average_velocity_kmh", json_real(avg_velocity));
 
-        json_object_set_new(line2, "up_counts", line2_up);
-        json_object_set_new(line2, "down_counts", line2_down);
+    // Create class-specific velocity averages
+    json_t *class_velocity = json_array();
+    for (int i = 0; i < system->num_classes; i++)
+    {
+        float class_avg = get_average_velocity(system, 3600000, i);
+        json_array_append_new(class_velocity, json_real(class_avg));
+    }
+    json_object_set_new(root, "class_velocities", class_velocity);
+
+    // Percentile speeds over the last hour, for all classes and per class
+    SpeedAggregate window = sum_speed_window(system, 3600000, select_class, -1, 0);
+    json_object_set_new(root, "speed_percentiles", percentiles_to_json(&window));
 
-        // Add line2 to root
-        json_object_set_new(root, "line2", line2);
+    json_t *class_percentiles = json_array();
+    for (int i = 0; i < system->num_classes && i < MAX_SPEED_CLASSES; i++)
+    {
+        window = sum_speed_window(system, 3600000, select_class, i, 0);
+        json_array_append_new(class_percentiles, percentiles_to_json(&window));
     }
+    json_object_set_new(root, "class_percentiles", class_percentiles);
 
-    // Add timestamp for when the backup was created
-    time_t now = time(NULL);
-    json_object_set_new(root, "backup_timestamp", json_integer(now));
+    // Add every configured line as "line1", "line2", ...
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        if (!is_line_enabled(system, line_id))
+            continue;
 
-    // Add human readable timestamp
-    struct tm *local_time = localtime(&now);
-    char time_str[64];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", local_time);
-    json_object_set_new(root, "backup_time", json_string(time_str));
+        char key[16];
+        snprintf(key, sizeof(key), "line%d", line_id + 1);
+        json_object_set_new(root, key, line_to_json(system, line_id));
+    }
+
+    // Movements between lines, since the last reset
+    json_object_set_new(root, "od_matrix", od_matrix_to_json());
+
+    // Add tracker load so capacity can be planned from real traffic
+    if (tracker)
+    {
+        json_t *tracker_stats = json_object();
+        json_object_set_new(tracker_stats, "capacity", json_integer(tracker->capacity));
+        json_object_set_new(tracker_stats, "max_capacity", json_integer(tracker->max_capacity));
+        json_object_set_new(tracker_stats, "peak_count", json_integer(tracker->peak_count));
+        json_object_set_new(tracker_stats, "dropped_detections", json_integer(tracker->dropped_detections));
+        json_object_set_new(root, "tracker", tracker_stats);
+    }
 
     return root;
 }
@@ -1034,21 +1481,91 @@ bool save_counting_data(CountingSystem *system, const char *filename)
         return false;
     }
 
-    // Save JSON to file
-    int result = json_dump_file(json_data, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
+    // Hand the snapshot to the background writer
+    return persist_json(filename, json_data);
+}
 
-    json_decref(json_data);
+// Copy one direction of a [class][lane] counter array from a backup
+static void load_line_counts(CountingSystem *system, int line_id, json_t *counts_json, int dir)
+{
+    if (!json_is_array(counts_json))
+        return;
 
-    if (result == 0)
+    int num_lanes = system->lines[line_id].num_lanes;
+    size_t json_class_size = json_array_size(counts_json);
+    size_t min_class_count = (size_t)system->num_classes < json_class_size ? (size_t)system->num_classes : json_class_size;
+
+    for (size_t class_idx = 0; class_idx < min_class_count; class_idx++)
     {
-        // syslog(LOG_INFO, "Counting data successfully saved to %s", filename);
-        return true;
+        json_t *class_counts = json_array_get(counts_json, class_idx);
+        if (!json_is_array(class_counts))
+            continue;
+
+        size_t json_lane_size = json_array_size(class_counts);
+        size_t min_lane_count = (size_t)num_lanes < json_lane_size ? (size_t)num_lanes : json_lane_size;
+
+        for (size_t lane = 0; lane < min_lane_count; lane++)
+        {
+            json_t *count = json_array_get(class_counts, lane);
+            if (json_is_integer(count))
+            {
+                int value = json_integer_value(count);
+                int index = COUNT_INDEX(system, line_id, (int)class_idx, (int)lane, dir);
+                add_count(system, line_id, (int)class_idx, (int)lane, dir, value - system->counts[index]);
+            }
+        }
     }
-    else
+}
+
+// Restore lanes, points and counters of one line from its backup object
+static void load_line_from_json(CountingSystem *system, int line_id, json_t *line_json)
+{
+    json_t *lanes_json = json_object_get(line_json, "num_lanes");
+    if (json_is_integer(lanes_json))
     {
-        syslog(LOG_ERR, "Failed to save counting data to %s", filename);
-        return false;
+        int file_lane_count = json_integer_value(lanes_json);
+        if (file_lane_count != system->lines[line_id].num_lanes &&
+            file_lane_count > 0 && file_lane_count <= MAX_LANES)
+        {
+            resize_line_lanes(system, line_id, file_lane_count);
+        }
+    }
+
+    json_t *points_json = json_object_get(line_json, "points");
+    if (json_is_array(points_json))
+    {
+        size_t num_points = json_array_size(points_json);
+
+        if (num_points <= MAX_SEGMENTS && num_points > 1) // Need at least 2 points for a line
+        {
+            LinePoint temp_points[MAX_SEGMENTS];
+
+            for (size_t i = 0; i < num_points; i++)
+            {
+                json_t *point_json = json_array_get(points_json, i);
+                json_t *x_json = json_object_get(point_json, "x");
+                json_t *y_json = json_object_get(point_json, "y");
+
+                if (json_is_real(x_json) && json_is_real(y_json))
+                {
+                    temp_points[i].x = (float)json_real_value(x_json);
+                    temp_points[i].y = (float)json_real_value(y_json);
+                }
+                else
+                {
+                    // Default to zeros if values are not valid
+                    temp_points[i].x = 0.0f;
+                    temp_points[i].y = 0.0f;
+                }
+            }
+
+            // Update the line points - this handles both the points and num_points
+            update_line_points(system, line_id, temp_points, (int)num_points);
+        }
     }
+
+    load_line_counts(system, line_id, json_object_get(line_json, "up_counts"), COUNT_UP);
+    load_line_counts(system, line_id, json_object_get(line_json, "down_counts"), COUNT_DOWN);
 }
 
 // Function to load counting data from a file
@@ -1072,365 +1589,283 @@ bool load_counting_data(CountingSystem *system, const char *filename)
         return false;
     }
 
+    // Journal records up to this one are already in the counters
+    json_t *journal_seq_json = json_object_get(root, "journal_seq");
+    system->journal_seq = json_is_integer(journal_seq_json) ? (guint32)json_integer_value(journal_seq_json) : 0;
+
     int num_classes = json_integer_value(num_classes_json);
     if (num_classes != system->num_classes)
     {
         // We'll continue anyway and adapt as needed
     }
 
-    // Get system-wide properties
-    json_t *line1_direction_json = json_object_get(root, "line1_direction");
-    if (json_is_boolean(line1_direction_json))
+    // Restore the speed buckets that are still inside the window
+    json_t *speed_buckets_json = json_object_get(root, "speed_buckets");
+    if (json_is_array(speed_buckets_json))
     {
-        system->line1_direction = json_boolean_value(line1_direction_json);
-    }
-
-    json_t *line2_direction_json = json_object_get(root, "line2_direction");
-    if (json_is_boolean(line2_direction_json))
-    {
-        system->line2_direction = json_boolean_value(line2_direction_json);
+        reset_speed_buckets(system);
+        for (size_t i = 0; i < json_array_size(speed_buckets_json); i++)
+        {
+            load_speed_bucket(system, json_array_get(speed_buckets_json, i));
+        }
     }
 
-    // Try to load velocity buffer if it exists
+    // Backups from before the buckets carry raw records with monotonic timestamps,
+    // replay them into the minute they happened
     json_t *velocity_buffer_json = json_object_get(root, "velocity_buffer");
-    if (json_is_array(velocity_buffer_json))
+    if (json_is_array(velocity_buffer_json) && !json_is_array(speed_buckets_json))
     {
-        // Reset current velocity buffer
-        system->velocity_buffer_count = 0;
-        system->velocity_buffer_index = 0;
-
-        size_t buffer_size = json_array_size(velocity_buffer_json);
-        size_t max_records = (buffer_size < HOURLY_VELOCITY_BUFFER_SIZE) ? buffer_size : HOURLY_VELOCITY_BUFFER_SIZE;
+        reset_speed_buckets(system);
+        gint64 bucket_us = (gint64)SPEED_BUCKET_SECONDS * G_USEC_PER_SEC;
 
-        for (size_t i = 0; i < max_records; i++)
+        for (size_t i = 0; i < json_array_size(velocity_buffer_json); i++)
         {
             json_t *record_json = json_array_get(velocity_buffer_json, i);
-            if (json_is_object(record_json))
-            {
-                json_t *velocity_json = json_object_get(record_json, "velocity");
-                json_t *timestamp_json = json_object_get(record_json, "timestamp");
-                json_t *class_id_json = json_object_get(record_json, "class_id");
+            json_t *velocity_json = json_object_get(record_json, "velocity");
+            json_t *timestamp_json = json_object_get(record_json, "timestamp");
+            json_t *class_id_json = json_object_get(record_json, "class_id");
 
-                if (json_is_real(velocity_json) && json_is_integer(timestamp_json) &&
-                    json_is_integer(class_id_json))
-                {
-                    int idx = system->velocity_buffer_index;
-                    system->velocity_buffer[idx].velocity = (float)json_real_value(velocity_json);
-                    system->velocity_buffer[idx].timestamp = json_integer_value(timestamp_json);
-                    system->velocity_buffer[idx].class_id = json_integer_value(class_id_json);
+            if (json_is_real(velocity_json) && json_is_integer(timestamp_json) &&
+                json_is_integer(class_id_json))
+            {
+                float velocity = (float)json_real_value(velocity_json);
+                int class_id = json_integer_value(class_id_json);
+                gint64 timestamp = json_integer_value(timestamp_json);
+                gint64 record_us = g_get_real_time() - (g_get_monotonic_time() - timestamp);
 
-                    system->velocity_buffer_index = (system->velocity_buffer_index + 1) % HOURLY_VELOCITY_BUFFER_SIZE;
-                    system->velocity_buffer_count++;
-                }
+                add_speed_to_buckets(system, record_us / bucket_us, velocity, class_id, -1, -1,
+                                     (int)((record_us % bucket_us) / G_USEC_PER_SEC));
             }
         }
+    }
+
+    // The first line is required, later lines are restored when present
+    if (!json_is_object(json_object_get(root, "line1")))
+    {
+        json_decref(root);
+        return false;
+    }
+
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
+    {
+        char key[32];
+        snprintf(key, sizeof(key), "line%d", line_id + 1);
+        json_t *line_json = json_object_get(root, key);
+        if (!json_is_object(line_json))
+            continue;
+
+        load_line_from_json(system, line_id, line_json);
+
+        // Older backups keep the direction of the first two lines at the top level
+        snprintf(key, sizeof(key), "line%d_direction", line_id + 1);
+        json_t *direction_json = json_object_get(line_json, "direction");
+        if (!json_is_boolean(direction_json))
+            direction_json = json_object_get(root, key);
+        if (json_is_boolean(direction_json))
+            set_line_direction(system, line_id, json_boolean_value(direction_json));
+    }
+
+    load_od_matrix(json_object_get(root, "od_matrix"));
+
+    json_decref(root);
+    return true;
+}
+
+// Binary state snapshot, native layout of the device that writes and reads it
+#define STATE_MAGIC 0x53584E45u    // "ENXS"
+#define STATE_VERSION 1            // Raise whenever StateBody changes
+
+typedef struct
+{
+    guint32 magic;
+    guint32 version;
+    guint32 length;    // Bytes after the header
+    guint32 crc;       // CRC-32 of those bytes
+} StateHeader;
+
+typedef struct
+{
+    LinePoint points[MAX_SEGMENTS];
+    int num_points;    // 0 while the line is not configured
+    int direction;
+} StateLine;
+
+// Followed by the counter table, see COUNT_INDEX
+typedef struct
+{
+    gint64 saved_us;   // Wall-clock time of the snapshot
+    guint32 journal_seq;
+    int num_classes;
+    int reset_day;     // Day of the month the counters and charts belong to
+    StateLine lines[MAX_COUNTING_LINES];
+    int daily_vehicle_count[DAILY_ARRAY_SIZE];
+    int weekly_vehicle_count[WEEKLY_ARRAY_SIZE];
+    double daily_vehicle_pcu[DAILY_ARRAY_SIZE];
+    double weekly_vehicle_pcu[WEEKLY_ARRAY_SIZE];
+    double daily_average_speed[DAILY_ARRAY_SIZE];
+    double weekly_average_speed[WEEKLY_ARRAY_SIZE];
+    double daily_speed_sum[DAILY_ARRAY_SIZE];
+    double today_speed_sum;
+    int od_counts[OD_POSITIONS][OD_POSITIONS];
+} StateBody;
+
+static size_t get_state_size(CountingSystem *system)
+{
+    return sizeof(StateHeader) + sizeof(StateBody) + sizeof(int) * COUNT_INDEX(system, MAX_COUNTING_LINES, 0, 0, 0);
+}
 
-        // syslog(LOG_INFO, "Loaded %d velocity records from backup", system->velocity_buffer_count);
-    }
+// Queue counters, lines, daily and weekly charts and the OD matrix as one binary file.
+// Speed history lives in the velocity log and is not part of it.
+bool save_state_snapshot(CountingSystem *system)
+{
+    if (!system)
+        return false;
 
-    // Update line1 data
-    json_t *line1_json = json_object_get(root, "line1");
-    if (!json_is_object(line1_json))
-    {
-        json_decref(root);
+    size_t size = get_state_size(system);
+    guint8 *buffer = (guint8 *)calloc(1, size);
+    if (!buffer)
         return false;
-    }
 
-    // Get line1 lane count
-    json_t *line1_lanes_json = json_object_get(line1_json, "num_lanes");
-    if (json_is_integer(line1_lanes_json))
+    StateHeader *header = (StateHeader *)buffer;
+    StateBody *body = (StateBody *)(buffer + sizeof(StateHeader));
+
+    body->saved_us = g_get_real_time();
+    body->journal_seq = get_count_journal_seq();
+    body->num_classes = system->num_classes;
+    body->reset_day = last_reset_day;
+
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
     {
-        int file_lane_count = json_integer_value(line1_lanes_json);
+        const MultiLaneLine *line = &system->lines[line_id];
+        StateLine *state_line = &body->lines[line_id];
+        if (line->num_lanes <= 0)
+            continue;
 
-        // If lane counts don't match, we might need to resize
-        if (file_lane_count != system->line1.num_lanes)
-        {
-            // Attempt to resize the lanes to match the file
-            if (file_lane_count > 0 && file_lane_count <= MAX_LANES)
-            {
-                resize_line_lanes(system, LINE_1, file_lane_count);
-            }
-        }
+        memcpy(state_line->points, line->points, sizeof(state_line->points));
+        state_line->num_points = line->num_points;
+        state_line->direction = line->direction;
     }
 
-    // Load line1 points data
-    json_t *line1_points_json = json_object_get(line1_json, "points");
-    if (json_is_array(line1_points_json))
-    {
-        size_t num_points = json_array_size(line1_points_json);
+    memcpy(body->daily_vehicle_count, daily_vehicle_count, sizeof(daily_vehicle_count));
+    memcpy(body->weekly_vehicle_count, weekly_vehicle_count, sizeof(weekly_vehicle_count));
+    memcpy(body->daily_vehicle_pcu, daily_vehicle_pcu, sizeof(daily_vehicle_pcu));
+    memcpy(body->weekly_vehicle_pcu, weekly_vehicle_pcu, sizeof(weekly_vehicle_pcu));
+    memcpy(body->daily_average_speed, daily_average_speed, sizeof(daily_average_speed));
+    memcpy(body->weekly_average_speed, weekly_average_speed, sizeof(weekly_average_speed));
+    memcpy(body->daily_speed_sum, daily_speed_sum, sizeof(daily_speed_sum));
+    body->today_speed_sum = today_speed_sum;
+    get_od_counts(body->od_counts);
 
-        // Only update points if the count matches or we can adapt
-        if (num_points <= MAX_SEGMENTS && num_points > 1) // Need at least 2 points for a line
-        {
-            // Temporary array to hold the points
-            LinePoint temp_points[MAX_SEGMENTS];
+    memcpy(buffer + sizeof(StateHeader) + sizeof(StateBody), system->counts, size - sizeof(StateHeader) - sizeof(StateBody));
 
-            // Extract all points first
-            for (size_t i = 0; i < num_points && i < MAX_SEGMENTS; i++)
-            {
-                json_t *point_json = json_array_get(line1_points_json, i);
-                if (json_is_object(point_json))
-                {
-                    json_t *x_json = json_object_get(point_json, "x");
-                    json_t *y_json = json_object_get(point_json, "y");
-
-                    if (json_is_real(x_json) && json_is_real(y_json))
-                    {
-                        temp_points[i].x = (float)json_real_value(x_json);
-                        temp_points[i].y = (float)json_real_value(y_json);
-                    }
-                    else
-                    {
-                        // Default to zeros if values are not valid
-                        temp_points[i].x = 0.0f;
-                        temp_points[i].y = 0.0f;
-                    }
-                }
-            }
+    header->magic = STATE_MAGIC;
+    header->version = STATE_VERSION;
+    header->length = (guint32)(size - sizeof(StateHeader));
+    header->crc = persist_crc32(body, header->length);
 
-            // Update the line points - this handles both the points and num_points
-            update_line_points(system, LINE_1, temp_points, (int)num_points);
-        }
-    }
+    bool result = persist_replace(STATE_SNAPSHOT_FILE, buffer, size);
+    free(buffer);
+    return result;
+}
 
-    // Get line1 up counts
-    json_t *line1_up_json = json_object_get(line1_json, "up_counts");
-    if (json_is_array(line1_up_json))
+// Put a validated snapshot back in place
+static void apply_state_snapshot(CountingSystem *system, const StateBody *body)
+{
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
     {
-        size_t json_class_size = json_array_size(line1_up_json);
-        size_t min_class_count = (size_t)system->num_classes < json_class_size ? (size_t)system->num_classes : json_class_size;
-
-        for (size_t class_idx = 0; class_idx < min_class_count; class_idx++)
-        {
-            json_t *class_up = json_array_get(line1_up_json, class_idx);
-            if (json_is_array(class_up))
-            {
-                size_t json_lane_size = json_array_size(class_up);
-                size_t min_lane_count = (size_t)system->line1.num_lanes < json_lane_size ? (size_t)system->line1.num_lanes : json_lane_size;
+        const StateLine *state_line = &body->lines[line_id];
+        if (state_line->num_points <= 1 || state_line->num_points > MAX_SEGMENTS)
+            continue;
 
-                for (size_t lane = 0; lane < min_lane_count; lane++)
-                {
-                    json_t *count = json_array_get(class_up, lane);
-                    if (json_is_integer(count))
-                    {
-                        int idx = (int)class_idx * system->line1.num_lanes + (int)lane;
-                        int value = json_integer_value(count);
-                        system->line1.up_counts[idx] = value;
-                    }
-                }
-            }
-        }
+        LinePoint points[MAX_SEGMENTS];
+        memcpy(points, state_line->points, sizeof(points));
+        update_line_points(system, line_id, points, state_line->num_points);
+        set_line_direction(system, line_id, state_line->direction != 0);
     }
 
-    // Get line1 down counts
-    json_t *line1_down_json = json_object_get(line1_json, "down_counts");
-    if (json_is_array(line1_down_json))
+    // Take the table over as a whole and add every counter back to build the totals
+    int num_counts = COUNT_INDEX(system, MAX_COUNTING_LINES, 0, 0, 0);
+    memcpy(system->counts, (const guint8 *)body + sizeof(StateBody), sizeof(int) * num_counts);
+    clear_count_totals(system);
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
     {
-        size_t json_class_size = json_array_size(line1_down_json);
-        size_t min_class_count = (size_t)system->num_classes < json_class_size ? (size_t)system->num_classes : json_class_size;
-
-        for (size_t class_idx = 0; class_idx < min_class_count; class_idx++)
+        for (int class_id = 0; class_id < system->num_classes; class_id++)
         {
-            json_t *class_down = json_array_get(line1_down_json, class_idx);
-            if (json_is_array(class_down))
+            for (int lane = 0; lane < MAX_LANES; lane++)
             {
-                size_t json_lane_size = json_array_size(class_down);
-                size_t min_lane_count = (size_t)system->line1.num_lanes < json_lane_size ? (size_t)system->line1.num_lanes : json_lane_size;
-
-                for (size_t lane = 0; lane < min_lane_count; lane++)
+                for (int dir = COUNT_UP; dir <= COUNT_DOWN; dir++)
                 {
-                    json_t *count = json_array_get(class_down, lane);
-                    if (json_is_integer(count))
-                    {
-                        int idx = (int)class_idx * system->line1.num_lanes + (int)lane;
-                        int value = json_integer_value(count);
-                        system->line1.down_counts[idx] = value;
-                    }
+                    int index = COUNT_INDEX(system, line_id, class_id, lane, dir);
+                    int value = system->counts[index];
+                    system->counts[index] = 0;
+                    add_count(system, line_id, class_id, lane, dir, value);
                 }
             }
         }
     }
 
-    // Update line2 data if it exists in both the file and the system
-    json_t *line2_json = json_object_get(root, "line2");
-    json_t *use_second_line_json = json_object_get(root, "use_second_line");
+    memcpy(daily_vehicle_count, body->daily_vehicle_count, sizeof(daily_vehicle_count));
+    memcpy(weekly_vehicle_count, body->weekly_vehicle_count, sizeof(weekly_vehicle_count));
+    memcpy(daily_vehicle_pcu, body->daily_vehicle_pcu, sizeof(daily_vehicle_pcu));
+    memcpy(weekly_vehicle_pcu, body->weekly_vehicle_pcu, sizeof(weekly_vehicle_pcu));
+    memcpy(daily_average_speed, body->daily_average_speed, sizeof(daily_average_speed));
+    memcpy(weekly_average_speed, body->weekly_average_speed, sizeof(weekly_average_speed));
+    memcpy(daily_speed_sum, body->daily_speed_sum, sizeof(daily_speed_sum));
+    today_speed_sum = body->today_speed_sum;
+    set_od_counts(body->od_counts);
 
-    bool file_has_line2 = json_is_object(line2_json) &&
-                          json_is_boolean(use_second_line_json) &&
-                          json_boolean_value(use_second_line_json);
+    system->journal_seq = body->journal_seq;
+    system->snapshot_due = false;
 
-    // Update system's use_second_line flag if file has line2 data
-    if (file_has_line2)
-    {
-        // If file has line2 but system doesn't, try to enable it
-        if (!system->use_second_line)
-        {
-            // Get line2 lane count
-            json_t *line2_lanes_json = json_object_get(line2_json, "num_lanes");
-            if (json_is_integer(line2_lanes_json))
-            {
-                int file_lane_count = json_integer_value(line2_lanes_json);
-                if (file_lane_count > 0 && file_lane_count <= MAX_LANES)
-                {
-                    // Get the points to initialize line2
-                    json_t *line2_points_json = json_object_get(line2_json, "points");
-                    if (json_is_array(line2_points_json) && json_array_size(line2_points_json) >= 2)
-                    {
-                        // Extract points
-                        size_t num_points = json_array_size(line2_points_json);
-                        LinePoint temp_points[MAX_SEGMENTS];
-
-                        for (size_t i = 0; i < num_points && i < MAX_SEGMENTS; i++)
-                        {
-                            json_t *point_json = json_array_get(line2_points_json, i);
-                            if (json_is_object(point_json))
-                            {
-                                json_t *x_json = json_object_get(point_json, "x");
-                                json_t *y_json = json_object_get(point_json, "y");
-
-                                if (json_is_real(x_json) && json_is_real(y_json))
-                                {
-                                    temp_points[i].x = (float)json_real_value(x_json);
-                                    temp_points[i].y = (float)json_real_value(y_json);
-                                }
-                                else
-                                {
-                                    temp_points[i].x = 0.0f;
-                                    temp_points[i].y = 0.0f;
-                                }
-                            }
-                        }
-
-                        // Initialize line2
-                        if (resize_line_lanes(system, LINE_2, file_lane_count))
-                        {
-                            update_line_points(system, LINE_2, temp_points, (int)num_points);
-                            system->use_second_line = true;
-                        }
-                    }
-                }
-            }
-        }
-        else
-        {
-            // System already has line2, just check if we need to resize
-            json_t *line2_lanes_json = json_object_get(line2_json, "num_lanes");
-            if (json_is_integer(line2_lanes_json))
-            {
-                int file_lane_count = json_integer_value(line2_lanes_json);
+    // Run the midnight rollover now when the snapshot is from an earlier day
+    last_reset_day = body->reset_day;
+    check_midnight_reset(system);
+}
 
-                // If lane counts don't match, try to resize
-                if (file_lane_count != system->line2.num_lanes &&
-                    file_lane_count > 0 && file_lane_count <= MAX_LANES)
-                {
-                    resize_line_lanes(system, LINE_2, file_lane_count);
-                }
-            }
+// Restore the state with one mmap of the binary snapshot. False when it is missing,
+// damaged or of another layout, the JSON exports are read instead then.
+bool load_state_snapshot(CountingSystem *system)
+{
+    if (!system)
+        return false;
 
-            // Load line2 points
-            json_t *line2_points_json = json_object_get(line2_json, "points");
-            if (json_is_array(line2_points_json))
-            {
-                size_t num_points = json_array_size(line2_points_json);
+    int fd = open(STATE_SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0)
+        return false;
 
-                if (num_points >= 2 && num_points <= MAX_SEGMENTS)
-                {
-                    LinePoint temp_points[MAX_SEGMENTS];
-
-                    for (size_t i = 0; i < num_points; i++)
-                    {
-                        json_t *point_json = json_array_get(line2_points_json, i);
-                        if (json_is_object(point_json))
-                        {
-                            json_t *x_json = json_object_get(point_json, "x");
-                            json_t *y_json = json_object_get(point_json, "y");
-
-                            if (json_is_real(x_json) && json_is_real(y_json))
-                            {
-                                temp_points[i].x = (float)json_real_value(x_json);
-                                temp_points[i].y = (float)json_real_value(y_json);
-                            }
-                        }
-                    }
-
-                    update_line_points(system, LINE_2, temp_points, (int)num_points);
-                }
-            }
-        }
+    size_t size = get_state_size(system);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)size)
+    {
+        close(fd);
+        syslog(LOG_WARNING, "State snapshot has the wrong size, reading the JSON backups");
+        return false;
     }
 
-    // Now load line2 counts if system has line2 enabled
-    if (system->use_second_line && file_has_line2)
-    {
-        // Get line2 up counts
-        json_t *line2_up_json = json_object_get(line2_json, "up_counts");
-        if (json_is_array(line2_up_json))
-        {
-            size_t json_class_size = json_array_size(line2_up_json);
-            size_t min_class_count = (size_t)system->num_classes < json_class_size ? (size_t)system->num_classes : json_class_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
 
-            for (size_t class_idx = 0; class_idx < min_class_count; class_idx++)
-            {
-                json_t *class_up = json_array_get(line2_up_json, class_idx);
-                if (json_is_array(class_up))
-                {
-                    size_t json_lane_size = json_array_size(class_up);
-                    size_t min_lane_count = (size_t)system->line2.num_lanes < json_lane_size ? (size_t)system->line2.num_lanes : json_lane_size;
-
-                    for (size_t lane = 0; lane < min_lane_count; lane++)
-                    {
-                        json_t *count = json_array_get(class_up, lane);
-                        if (json_is_integer(count))
-                        {
-                            int idx = (int)class_idx * system->line2.num_lanes + (int)lane;
-                            int value = json_integer_value(count);
-                            system->line2.up_counts[idx] = value;
-                        }
-                    }
-                }
-            }
-        }
+    const StateHeader *header = (const StateHeader *)map;
+    const StateBody *body = (const StateBody *)((const guint8 *)map + sizeof(StateHeader));
 
-        // Get line2 down counts
-        json_t *line2_down_json = json_object_get(line2_json, "down_counts");
-        if (json_is_array(line2_down_json))
-        {
-            size_t json_class_size = json_array_size(line2_down_json);
-            size_t min_class_count = (size_t)system->num_classes < json_class_size ? (size_t)system->num_classes : json_class_size;
+    bool valid = header->magic == STATE_MAGIC && header->version == STATE_VERSION &&
+                 header->length == size - sizeof(StateHeader) && body->num_classes == system->num_classes &&
+                 persist_crc32(body, header->length) == header->crc;
 
-            for (size_t class_idx = 0; class_idx < min_class_count; class_idx++)
-            {
-                json_t *class_down = json_array_get(line2_down_json, class_idx);
-                if (json_is_array(class_down))
-                {
-                    size_t json_lane_size = json_array_size(class_down);
-                    size_t min_lane_count = (size_t)system->line2.num_lanes < json_lane_size ? (size_t)system->line2.num_lanes : json_lane_size;
-
-                    for (size_t lane = 0; lane < min_lane_count; lane++)
-                    {
-                        json_t *count = json_array_get(class_down, lane);
-                        if (json_is_integer(count))
-                        {
-                            int idx = (int)class_idx * system->line2.num_lanes + (int)lane;
-                            int value = json_integer_value(count);
-                            system->line2.down_counts[idx] = value;
-                        }
-                    }
-                }
-            }
-        }
-    }
+    if (valid)
+        apply_state_snapshot(system, body);
+    else
+        syslog(LOG_WARNING, "State snapshot is damaged or outdated, reading the JSON backups");
 
-    json_decref(root);
-    return true;
+    munmap(map, size);
+    return valid;
 }
 
-// Function to save vehicle count data in the requested format
-bool save_vehicle_count_data(CountingSystem *system, const char *filename)
+// Class totals of every line in the format the web interface expects
+static json_t *vehicle_count_to_json(CountingSystem *system)
 {
-    if (!system || !filename)
-        return false;
-
     // Define vehicle types
     const char *vehicle_types[] = {"Car", "Bike", "Truck", "Bus", "Taxi", "Pickup", "Trailer"};
     int num_types = sizeof(vehicle_types) / sizeof(vehicle_types[0]);
@@ -1451,24 +1886,8 @@ bool save_vehicle_count_data(CountingSystem *system, const char *filename)
     // Calculate total counts for each type by summing up and down counts across all lanes
     for (int i = 0; i < num_types && i < system->num_classes; i++)
     {
-        int total_count = 0;
-
-        // Count from first line
-        for (int lane = 0; lane < system->line1.num_lanes; lane++)
-        {
-            int idx = i * system->line1.num_lanes + lane;
-            total_count += system->line1.up_counts[idx] + system->line1.down_counts[idx];
-        }
-
-        // Count from second line if enabled
-        if (system->use_second_line)
-        {
-            for (int lane = 0; lane < system->line2.num_lanes; lane++)
-            {
-                int idx = i * system->line2.num_lanes + lane;
-                total_count += system->line2.up_counts[idx] + system->line2.down_counts[idx];
-            }
-        }
+        // Count from every line
+        int total_count = get_class_count(system, i);
 
         json_array_append_new(quantity_array, json_integer(total_count));
     }
@@ -1476,30 +1895,22 @@ bool save_vehicle_count_data(CountingSystem *system, const char *filename)
     // Add arrays to root object
     json_object_set_new(root, "type", type_array);
     json_object_set_new(root, "quantity", quantity_array);
-
-    // Save JSON to file
-    int result = json_dump_file(root, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
-
-    json_decref(root);
-
-    if (result == 0)
-    {
-        // syslog(LOG_INFO, "Vehicle count data successfully saved to %s", filename);
-        return true;
-    }
-    else
-    {
-        syslog(LOG_ERR, "Failed to save vehicle count data to %s", filename);
-        return false;
-    }
+    return root;
 }
 
-// Function to save vehicle PCU data in the same format as vehicle count data
-bool save_vehicle_pcu_data(CountingSystem *system, const char *filename)
+// Function to save vehicle count data in the requested format
+bool save_vehicle_count_data(CountingSystem *system, const char *filename)
 {
     if (!system || !filename)
         return false;
 
+    // Hand the snapshot to the background writer
+    return persist_json(filename, vehicle_count_to_json(system));
+}
+
+// PCU of every class in the same format as vehicle count data
+static json_t *vehicle_pcu_to_json(CountingSystem *system)
+{
     // Define vehicle types
     const char *vehicle_types[] = {"Car", "Bike", "Truck", "Bus", "Taxi", "Pickup", "Trailer"};
     int num_types = sizeof(vehicle_types) / sizeof(vehicle_types[0]);
@@ -1520,24 +1931,8 @@ bool save_vehicle_pcu_data(CountingSystem *system, const char *filename)
     // Calculate PCU values for each type by summing up and down counts and applying PCU multipliers
     for (int i = 0; i < num_types && i < system->num_classes; i++)
     {
-        int class_count = 0;
-
-        // Count from first line
-        for (int lane = 0; lane < system->line1.num_lanes; lane++)
-        {
-            int idx = i * system->line1.num_lanes + lane;
-            class_count += system->line1.up_counts[idx] + system->line1.down_counts[idx];
-        }
-
-        // Count from second line if enabled
-        if (system->use_second_line)
-        {
-            for (int lane = 0; lane < system->line2.num_lanes; lane++)
-            {
-                int idx = i * system->line2.num_lanes + lane;
-                class_count += system->line2.up_counts[idx] + system->line2.down_counts[idx];
-            }
-        }
+        // Count from every line
+        int class_count = get_class_count(system, i);
 
         // Apply PCU multiplier and add to array
         float pcu_value = class_count * pcu_values[i];
@@ -1547,36 +1942,29 @@ bool save_vehicle_pcu_data(CountingSystem *system, const char *filename)
     // Add arrays to root object
     json_object_set_new(root, "type", type_array);
     json_object_set_new(root, "quantity", quantity_array);
-
-    // Save JSON to file
-    int result = json_dump_file(root, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
-
-    json_decref(root);
-
-    if (result == 0)
-    {
-        // syslog(LOG_INFO, "Vehicle PCU data successfully saved to %s", filename);
-        return true;
-    }
-    else
-    {
-        syslog(LOG_ERR, "Failed to save vehicle PCU data to %s", filename);
-        return false;
-    }
+    return root;
 }
 
-bool save_chart_data(const char *filename, int *chart_data, int array_size)
+// Function to save vehicle PCU data in the same format as vehicle count data
+bool save_vehicle_pcu_data(CountingSystem *system, const char *filename)
 {
-    if (!filename || !chart_data || array_size <= 0)
+    if (!system || !filename)
         return false;
 
+    // Hand the snapshot to the background writer
+    return persist_json(filename, vehicle_pcu_to_json(system));
+}
+
+static json_t *chart_to_json(const int *chart_data, int array_size)
+{
     json_t *root = json_object();
     json_t *quantity_json_array = json_array();
 
     if (!root || !quantity_json_array)
     {
         json_decref(root);
-        return false;
+        json_decref(quantity_json_array);
+        return NULL;
     }
 
     // Add all elements in a single loop
@@ -1587,25 +1975,27 @@ bool save_chart_data(const char *filename, int *chart_data, int array_size)
 
     json_object_set_new(root, "type", json_string("Total"));
     json_object_set_new(root, "quantity", quantity_json_array);
-
-    int result = json_dump_file(root, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
-    json_decref(root);
-
-    return (result == 0);
+    return root;
 }
 
-bool save_chart_data_double(const char *filename, double *chart_data, int array_size)
+bool save_chart_data(const char *filename, int *chart_data, int array_size)
 {
     if (!filename || !chart_data || array_size <= 0)
         return false;
 
+    return persist_json(filename, chart_to_json(chart_data, array_size));
+}
+
+static json_t *chart_double_to_json(const double *chart_data, int array_size)
+{
     json_t *root = json_object();
     json_t *quantity_json_array = json_array();
 
     if (!root || !quantity_json_array)
     {
         json_decref(root);
-        return false;
+        json_decref(quantity_json_array);
+        return NULL;
     }
 
     // Add all elements in a single loop
@@ -1616,11 +2006,15 @@ bool save_chart_data_double(const char *filename, double *chart_data, int array_
 
     json_object_set_new(root, "type", json_string("Total"));
     json_object_set_new(root, "quantity", quantity_json_array);
+    return root;
+}
 
-    int result = json_dump_file(root, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
-    json_decref(root);
+bool save_chart_data_double(const char *filename, double *chart_data, int array_size)
+{
+    if (!filename || !chart_data || array_size <= 0)
+        return false;
 
-    return (result == 0);
+    return persist_json(filename, chart_double_to_json(chart_data, array_size));
 }
 
 bool load_chart_data(const char *filename, int *chart_data, int array_size)
@@ -1732,71 +2126,13 @@ bool load_chart_data_double(const char *filename, double *chart_data, int array_
 // Function to calculate the total count across all vehicle types and lanes
 int calculate_total_count(CountingSystem *system)
 {
-    if (!system)
-        return 0;
-
-    int total_count = 0;
-
-    for (int i = 0; i < system->num_classes; i++)
-    {
-        // Count from first line
-        for (int lane = 0; lane < system->line1.num_lanes; lane++)
-        {
-            int idx = i * system->line1.num_lanes + lane;
-            total_count += system->line1.up_counts[idx] + system->line1.down_counts[idx];
-        }
-
-        // Count from second line if enabled
-        if (system->use_second_line)
-        {
-            for (int lane = 0; lane < system->line2.num_lanes; lane++)
-            {
-                int idx = i * system->line2.num_lanes + lane;
-                total_count += system->line2.up_counts[idx] + system->line2.down_counts[idx];
-            }
-        }
-    }
-
-    return total_count;
+    return system ? system->total : 0;
 }
 
 // Function to calculate the total PCU (Passenger Car Unit) count across all vehicle types and lanes
 float calculate_total_pcu(CountingSystem *system)
 {
-    if (!system)
-        return 0.0f;
-
-    float total_pcu = 0.0f;
-
-    // Use the global pcu_values array
-    int num_multipliers = NUM_VEHICLE_TYPES;
-
-    for (int i = 0; i < system->num_classes && i < num_multipliers; i++)
-    {
-        int class_count = 0;
-
-        // Count from first line
-        for (int lane = 0; lane < system->line1.num_lanes; lane++)
-        {
-            int idx = i * system->line1.num_lanes + lane;
-            class_count += system->line1.up_counts[idx] + system->line1.down_counts[idx];
-        }
-
-        // Count from second line if enabled
-        if (system->use_second_line)
-        {
-            for (int lane = 0; lane < system->line2.num_lanes; lane++)
-            {
-                int idx = i * system->line2.num_lanes + lane;
-                class_count += system->line2.up_counts[idx] + system->line2.down_counts[idx];
-            }
-        }
-
-        // Apply PCU multiplier for this vehicle class
-        total_pcu += class_count * pcu_values[i];
-    }
-
-    return total_pcu;
+    return system ? (float)system->total_pcu : 0.0f;
 }
 
 bool save_daily_vehicle_count_data(CountingSystem *system, const char *filename)
@@ -1804,28 +2140,8 @@ bool save_daily_vehicle_count_data(CountingSystem *system, const char *filename)
     if (!system || !filename)
         return false;
 
-    time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
-
-    int total_count = calculate_total_count(system);
-
-    if (local_time->tm_hour == 0)
-    {
-        daily_vehicle_count[local_time->tm_hour] = total_count;
-    }
-    else
-    {
-        int pre_total_count = 0;
-        for (int i = 0; i < local_time->tm_hour; i++)
-        {
-            pre_total_count += daily_vehicle_count[i];
-        }
-        daily_vehicle_count[local_time->tm_hour] = total_count - pre_total_count;
-    }
-
-    int array_size = sizeof(daily_vehicle_count) / sizeof(daily_vehicle_count[0]);
-
-    return save_chart_data(filename, daily_vehicle_count, array_size);
+    // Kept up to date as objects are counted
+    return save_chart_data(filename, daily_vehicle_count, DAILY_ARRAY_SIZE);
 }
 
 // Function to save daily PCU data
@@ -1834,28 +2150,7 @@ bool save_daily_vehicle_pcu_data(CountingSystem *system, const char *filename)
     if (!system || !filename)
         return false;
 
-    time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
-
-    float total_pcu = calculate_total_pcu(system);
-
-    if (local_time->tm_hour == 0)
-    {
-        daily_vehicle_pcu[local_time->tm_hour] = total_pcu;
-    }
-    else
-    {
-        float pre_total_pcu = 0.0f;
-        for (int i = 0; i < local_time->tm_hour; i++)
-        {
-            pre_total_pcu += daily_vehicle_pcu[i];
-        }
-        daily_vehicle_pcu[local_time->tm_hour] = total_pcu - pre_total_pcu;
-    }
-
-    int array_size = sizeof(daily_vehicle_pcu) / sizeof(daily_vehicle_pcu[0]);
-
-    return save_chart_data_double(filename, daily_vehicle_pcu, array_size);
+    return save_chart_data_double(filename, daily_vehicle_pcu, DAILY_ARRAY_SIZE);
 }
 
 bool save_weekly_vehicle_count_data(CountingSystem *system, const char *filename)
@@ -1863,13 +2158,7 @@ bool save_weekly_vehicle_count_data(CountingSystem *system, const char *filename
     if (!system || !filename)
         return false;
 
-    int total_count = calculate_total_count(system);
-
-    weekly_vehicle_count[WEEKLY_ARRAY_SIZE - 1] = total_count;
-
-    int array_size = sizeof(weekly_vehicle_count) / sizeof(weekly_vehicle_count[0]);
-
-    return save_chart_data(filename, weekly_vehicle_count, array_size);
+    return save_chart_data(filename, weekly_vehicle_count, WEEKLY_ARRAY_SIZE);
 }
 
 bool save_weekly_vehicle_pcu_data(CountingSystem *system, const char *filename)
@@ -1877,13 +2166,7 @@ bool save_weekly_vehicle_pcu_data(CountingSystem *system, const char *filename)
     if (!system || !filename)
         return false;
 
-    float total_pcu = calculate_total_pcu(system);
-
-    weekly_vehicle_pcu[WEEKLY_ARRAY_SIZE - 1] = total_pcu;
-
-    int array_size = sizeof(weekly_vehicle_pcu) / sizeof(weekly_vehicle_pcu[0]);
-
-    return save_chart_data_double(filename, weekly_vehicle_pcu, array_size);
+    return save_chart_data_double(filename, weekly_vehicle_pcu, WEEKLY_ARRAY_SIZE);
 }
 
 bool save_average_speed_data(CountingSystem *system, const char *filename)
@@ -1903,14 +2186,7 @@ bool save_daily_average_speed_data(CountingSystem *system, const char *filename)
     if (!system || !filename)
         return false;
 
-    time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
-
-    daily_average_speed[local_time->tm_hour] = get_average_velocity(system, 3600000, -1);
-
-    int array_size = sizeof(daily_average_speed) / sizeof(daily_average_speed[0]);
-
-    return save_chart_data_double(filename, daily_average_speed, array_size);
+    return save_chart_data_double(filename, daily_average_speed, DAILY_ARRAY_SIZE);
 }
 
 bool save_weekly_average_speed_data(CountingSystem *system, const char *filename)
@@ -1918,28 +2194,98 @@ bool save_weekly_average_speed_data(CountingSystem *system, const char *filename
     if (!system || !filename)
         return false;
 
-    double sum = 0;
-    int count = 0;
+    return save_chart_data_double(filename, weekly_average_speed, WEEKLY_ARRAY_SIZE);
+}
+
+// Exports of the charts and class totals, named as the parameters the web interface asks for
+static const char *count_exports[] = {"vehicle_counts", "daily_vehicle_count", "weekly_vehicle_count",
+                                      "vehicle_pcu", "daily_vehicle_pcu", "weekly_vehicle_pcu",
+                                      "average_speed", "daily_average_speed", "weekly_average_speed"};
+#define NUM_COUNT_EXPORTS (int)(sizeof(count_exports) / sizeof(count_exports[0]))
 
-    for (int i = 0; i < DAILY_ARRAY_SIZE; i++)
+static json_t *count_export_to_json(CountingSystem *system, int index)
+{
+    switch (index)
+    {
+    case 0:
+        return vehicle_count_to_json(system);
+    case 1:
+        return chart_to_json(daily_vehicle_count, DAILY_ARRAY_SIZE);
+    case 2:
+        return chart_to_json(weekly_vehicle_count, WEEKLY_ARRAY_SIZE);
+    case 3:
+        return vehicle_pcu_to_json(system);
+    case 4:
+        return chart_double_to_json(daily_vehicle_pcu, DAILY_ARRAY_SIZE);
+    case 5:
+        return chart_double_to_json(weekly_vehicle_pcu, WEEKLY_ARRAY_SIZE);
+    case 6:
+        return chart_double_to_json(average_speed, 1);
+    case 7:
+        return chart_double_to_json(daily_average_speed, DAILY_ARRAY_SIZE);
+    default:
+        return chart_double_to_json(weekly_average_speed, WEEKLY_ARRAY_SIZE);
+    }
+}
+
+// Write every export, called with each snapshot
+void save_count_exports(CountingSystem *system)
+{
+    if (!system)
+        return;
+
+    average_speed[0] = get_average_velocity(system, 3600000, -1);
+    for (int i = 0; i < NUM_COUNT_EXPORTS; i++)
     {
-        if (fabs(daily_average_speed[i]) > 0.0001)
-        {
-            sum += daily_average_speed[i];
-            count++;
-        }
+        char filename[PERSIST_PATH_LENGTH];
+        snprintf(filename, sizeof(filename), COUNT_EXPORT_FORMAT, count_exports[i]);
+        persist_json(filename, count_export_to_json(system, i));
     }
+}
 
-    // syslog(LOG_INFO, "average: %f / %d = %f", sum, count,  sum / count);
+static void update_live_exports(CountingSystem *system)
+{
+    json_t *exports = json_object();
+    json_object_set_new(exports, LIVE_COUNTS_NAME, counting_data_to_json(system));
+    for (int i = 0; i < NUM_COUNT_EXPORTS; i++)
+        json_object_set_new(exports, count_exports[i], count_export_to_json(system, i));
+
+    pthread_mutex_lock(&live_exports_mutex);
+    json_t *old = live_exports;
+    live_exports = exports;
+    pthread_mutex_unlock(&live_exports_mutex);
+    json_decref(old);
+}
 
-    if (!count)
-        return false;
+// Copy of the last content of an export or the counting data, NULL when name is neither
+// or the backup job has not run yet
+json_t *get_live_export(const char *name)
+{
+    if (!name)
+        return NULL;
+
+    pthread_mutex_lock(&live_exports_mutex);
+    json_t *data = live_exports ? json_deep_copy(json_object_get(live_exports, name)) : NULL;
+    pthread_mutex_unlock(&live_exports_mutex);
+    return data;
+}
 
-    weekly_average_speed[WEEKLY_ARRAY_SIZE - 1] = sum / count;
+// Run once a second by the scheduler. Crossings since the last call go to the journal in
+// one append, the full state and the JSON files only every few minutes or after the
+// counters were changed some other way. The web interface reads the copies kept here.
+bool save_periodic_backup(CountingSystem *system)
+{
+    if (!system)
+        return false;
 
-    int array_size = sizeof(weekly_average_speed) / sizeof(weekly_average_speed[0]);
+    flush_count_journal();
+    if (system->snapshot_due ||
+        g_get_monotonic_time() - system->snapshot_us >= (gint64)COUNT_SNAPSHOT_SECONDS * G_USEC_PER_SEC)
+        compact_count_journal(system);
 
-    return save_chart_data_double(filename, weekly_average_speed, array_size);
+    average_speed[0] = get_average_velocity(system, 3600000, -1);
+    update_live_exports(system);
+    return true;
 }
 
 void shift_array_left(int array[], int array_size)
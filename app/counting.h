@@ -5,46 +5,151 @@
 #include <stdbool.h>
 #include <jansson.h>  // Add this include for JSON support
 
-#define MAX_LANES 4
-#define MAX_SEGMENTS 5  // Maximum number of points to define lane segments (4 lanes = 5 points)
+// Site limits, override at build time for intersections and wide roads
+#ifndef MAX_COUNTING_LINES
+#define MAX_COUNTING_LINES 8  // Counting lines per site
+#endif
+#ifndef MAX_LANES
+#define MAX_LANES 4           // Lanes per counting line
+#endif
+#if MAX_LANES > 32
+#error "MAX_LANES must fit in a 32-bit lane mask"
+#endif
+
+#define MAX_SEGMENTS (MAX_LANES + 1)            // Points needed to define MAX_LANES lane segments
+#define LANE_SLOTS (((MAX_LANES + 3) / 4) * 4)  // Geometry slots, padded to whole 4-lane vectors
+
+// Direction index into the counter table
+#define COUNT_UP 0
+#define COUNT_DOWN 1
+
+// Position of a counter in CountingSystem.counts, laid out [line][class][lane][dir]
+#define COUNT_INDEX(system, line_id, class_id, lane, dir) \
+    ((((line_id) * (system)->num_classes + (class_id)) * MAX_LANES + (lane)) * 2 + (dir))
 
 #define DAILY_ARRAY_SIZE 24
 #define WEEKLY_ARRAY_SIZE 7
-#define HOURLY_VELOCITY_BUFFER_SIZE 10000  // Buffer to store velocity data for the last hour
+
+#define MAX_SPEED_CLASSES 8       // Classes with their own speed aggregates
+#define SPEED_BUCKET_SECONDS 60   // Wall-clock width of one speed bucket
+#define SPEED_BUCKET_COUNT 60     // Buckets kept, one hour of minutes
+#define SPEED_BUCKET_SAMPLES 64   // Raw speeds kept per bucket, a uniform sample once it is full
+#define SPEED_HISTOGRAM_BINS 32   // Speed histogram bins, the last one also takes every faster object
+#define SPEED_HISTOGRAM_BIN_KMH 5.0f
+
+#define STATE_SNAPSHOT_FILE "/usr/local/packages/enixma_analytic/localdata/state.bin"
+#define COUNT_EXPORT_FORMAT "/usr/local/packages/enixma_analytic/localdata/%s.json"
+
+#define LANE_METRICS_SECONDS 60   // Interval headway, gap and occupancy are reported over
+#define SECTION_TIMEOUT_SECONDS 30  // Section clock run before a waiting count takes its spot speed
 
 // Structures for the counting system
 typedef struct {
     float x, y;  // Normalized coordinates (0-1)
 } LinePoint;
 
-// Structure to store velocity data for each counted object
+// Raw speed of one counted object, kept as a bounded sample per bucket
 typedef struct {
     float velocity;   // Speed in km/h
-    gint64 timestamp; // When the object was counted
-    int class_id;     // Vehicle class
-} VelocityRecord;
+    guint8 second;    // Second within the bucket's minute
+    gint8 class_id;   // Vehicle class
+    gint8 line_id;    // Line and lane the object was counted on, -1 when unknown
+    gint8 lane;
+} VelocitySample;
+
+// Running speed sum, sample count and speed histogram
+typedef struct {
+    double sum;
+    int count;
+    guint16 bins[SPEED_HISTOGRAM_BINS];  // Objects per speed bin, for percentiles
+} SpeedAggregate;
+
+// Speed aggregates of every object counted during one wall-clock minute
+typedef struct {
+    gint64 minute;  // Minutes since the epoch this bucket covers, -1 while unused
+    SpeedAggregate total;
+    SpeedAggregate classes[MAX_SPEED_CLASSES];
+    SpeedAggregate lanes[MAX_COUNTING_LINES][MAX_LANES];
+    VelocitySample samples[SPEED_BUCKET_SAMPLES];
+    int num_samples;
+} SpeedBucket;
+
+// Segment geometry derived from the line points, one slot per lane so four
+// lanes fit in one vector. Unused slots have a zero direction.
+typedef struct {
+    float start_x[LANE_SLOTS];
+    float start_y[LANE_SLOTS];
+    float dir_x[LANE_SLOTS];      // Segment end minus start
+    float dir_y[LANE_SLOTS];
+    float normal_x[LANE_SLOTS];   // Left normal (-dir_y, dir_x)
+    float normal_y[LANE_SLOTS];
+    float min_x, min_y;          // Bounding box of the whole line
+    float max_x, max_y;
+} LineGeometry;
+
+// Loop-detector measures of one lane, running sums of the open interval
+// and the results of the last closed one
+typedef struct {
+    int volume;                // Crossings in the open interval
+    double headway_sum;        // Seconds between consecutive crossings
+    int headway_count;
+    double gap_sum;            // Seconds the lane stayed clear before a box covered it again
+    int gap_count;
+    gint64 occupied_us;        // Time a track box covered the lane segment
+    gint64 covered_since_us;   // Monotonic start of the current cover, 0 while clear
+    gint64 cleared_us;         // Monotonic end of the last cover, 0 before the first
+
+    int last_volume;
+    float last_headway;        // Mean seconds, 0 with fewer than two crossings
+    float last_gap;            // Mean seconds, 0 when the lane was never cleared and covered
+    float last_occupancy;      // Percent of the interval the lane was covered
+} LaneMetrics;
+
+// Traffic of one line over the last closed lane metrics interval
+typedef struct {
+    float flow;      // Vehicles per hour and lane
+    float speed;     // Mean speed in km/h, 0 when no speed was measured
+    float v85;
+    int speeds;      // Speeds behind the mean and V85
+} LineTraffic;
 
 typedef struct {
     LinePoint points[MAX_SEGMENTS];
     int num_points;
-    int num_lanes;
-    int* up_counts;       // Per-line counters
-    int* down_counts;     // Per-line counters
-    gint64* timestamps;   // Per-line timestamps
+    int num_lanes;                 // 0 until the line is configured
+    bool direction;                // true counts objects moving down, false counts up
+    gint64 timestamps[MAX_LANES];  // Last crossing per lane
+    LineGeometry geometry;         // Rebuilt whenever points or lanes change
+    LaneMetrics metrics[MAX_LANES];
+    SpeedAggregate interval_speeds;  // Speeds of every track crossing in the open lane metrics interval
+    LineTraffic traffic;             // Last closed interval
 } MultiLaneLine;
 
 typedef struct {
-    MultiLaneLine line1;
-    MultiLaneLine line2;
-    bool line1_direction;
-    bool line2_direction;
-    bool use_second_line;
+    MultiLaneLine lines[MAX_COUNTING_LINES];
+    int num_lines;      // One past the highest configured line
     int num_classes;
-    
-    // New fields for velocity tracking
-    VelocityRecord velocity_buffer[HOURLY_VELOCITY_BUFFER_SIZE];
-    int velocity_buffer_count;
-    int velocity_buffer_index;
+    int* counts;        // Counters for every line, see COUNT_INDEX
+
+    // Sums of counts by class, lane and line, changed together with it by add_count()
+    int* class_totals;
+    int lane_totals[MAX_COUNTING_LINES][MAX_LANES];
+    int line_totals[MAX_COUNTING_LINES];
+    int total;
+    double total_pcu;   // Class totals weighted by the current pcu_values
+
+    // Per-minute speed aggregates, speed_totals is the sum of all live buckets.
+    // Expiry is a bucket rotation, so memory and work stay fixed at any traffic volume.
+    SpeedBucket speed_buckets[SPEED_BUCKET_COUNT];
+    SpeedBucket speed_totals;
+    gint64 speed_minute;  // Newest minute the buckets have been advanced to
+
+    gint64 metrics_start_us;  // Monotonic start of the open lane metrics interval
+
+    // Count journal, see countlog.h
+    guint32 journal_seq;      // Last journal record the loaded snapshot includes
+    bool snapshot_due;        // Counters were changed other than by a crossing
+    gint64 snapshot_us;       // Monotonic time of the last snapshot
 } CountingSystem;
 
 // Global variable declaration
@@ -63,37 +168,61 @@ extern double weekly_average_speed[WEEKLY_ARRAY_SIZE];
 CountingSystem* init_counting_system(int num_classes, int num_lanes, LinePoint* points);
 void free_counting_system(CountingSystem* system);
 
-// Define line identifiers for better readability
+// Line identifiers are indices into CountingSystem.lines, the first two have names
 typedef enum {
     LINE_1 = 0,
     LINE_2 = 1
 } LineId;
 
 // Line and counting management
-void update_line_points(CountingSystem* system, LineId line_id, LinePoint* points, int num_points);
-bool resize_line_lanes(CountingSystem* system, LineId line_id, int new_lane_count);
+void update_line_points(CountingSystem* system, int line_id, LinePoint* points, int num_points);
+bool resize_line_lanes(CountingSystem* system, int line_id, int new_lane_count);
+bool is_line_enabled(CountingSystem* system, int line_id);
+void set_line_direction(CountingSystem* system, int line_id, bool direction);
 void update_counting(CountingSystem* system, TrackedObject* obj);
+void abandon_section_count(CountingSystem* system, TrackedObject* obj);
 
 // Data retrieval
-void get_lane_counts(CountingSystem* system, LineId line_id, int class_id, int lane_id, 
+void get_lane_counts(CountingSystem* system, int line_id, int class_id, int lane_id, 
                      int* up_count, int* down_count);
+int get_class_count(CountingSystem* system, int class_id);
+int get_lane_total(CountingSystem* system, int line_id, int lane_id);
+void update_total_pcu(CountingSystem* system);
+void restore_count_record(CountingSystem* system, gint64 time_ms, int line_id, int lane,
+                          int class_id, int dir, float speed);
 
-// Internal helper functions
+// Internal helper functions, in crossing.c so tests/crossing_test.c can build them alone
 bool is_segment_crossed(Point* p1, Point* p2, LinePoint* seg_start, LinePoint* seg_end, int* lane_id);
 int get_crossing_direction(Point* p1, Point* p2, LinePoint* seg_start, LinePoint* seg_end);
+void update_line_geometry(MultiLaneLine* line);
+unsigned int test_line_crossings(const MultiLaneLine* line, const Point* p1, const Point* p2, unsigned int* down_mask);
+unsigned int test_line_crossings_scalar(const MultiLaneLine* line, const Point* p1, const Point* p2, unsigned int* down_mask);
 
 // Midnight reset functionality
 void reset_all_counters(CountingSystem* system);
 bool check_midnight_reset(CountingSystem *system);
 
-void add_velocity_record(CountingSystem* system, float velocity, int class_id);
+void add_velocity_record(CountingSystem* system, float velocity, int class_id, int line_id, int lane);
+void restore_velocity_record(CountingSystem* system, gint64 time_ms, float velocity,
+                             int class_id, int line_id, int lane);
 float get_average_velocity(CountingSystem* system, int time_window_ms, int class_id);
-void clean_velocity_buffer(CountingSystem* system, gint64 max_age_us);
+float get_lane_average_velocity(CountingSystem* system, int time_window_ms, int line_id, int lane);
+float get_speed_percentile(CountingSystem* system, int time_window_ms, int class_id, float percentile);
+float get_lane_speed_percentile(CountingSystem* system, int time_window_ms, int line_id, int lane, float percentile);
+
+// Headway, gap and occupancy per lane
+void update_lane_occupancy(CountingSystem* system, const Tracker* tracker);
+void close_lane_metrics(CountingSystem* system);
 
 // Backup and restore functionality
 json_t* counting_data_to_json(CountingSystem* system);
 bool save_counting_data(CountingSystem* system, const char* filename);
 bool load_counting_data(CountingSystem* system, const char* filename);
+
+// Binary snapshot of counters, lines, charts and the OD matrix for restore at startup,
+// the JSON files are exports and the fallback for when it is unusable
+bool save_state_snapshot(CountingSystem* system);
+bool load_state_snapshot(CountingSystem* system);
 bool save_vehicle_count_data(CountingSystem* system, const char* filename);
 bool save_vehicle_pcu_data(CountingSystem* system, const char* filename);
 
@@ -102,6 +231,8 @@ bool save_chart_data_double(const char* filename, double* chart_data, int array_
 bool load_chart_data(const char* filename, int* chart_data, int array_size);
 bool load_chart_data_double(const char* filename, double* chart_data, int array_size);
 
+void update_period_aggregates(CountingSystem* system);
+void restore_period_aggregates(void);
 int calculate_total_count(CountingSystem* system);
 float calculate_total_pcu(CountingSystem* system);
 bool save_daily_vehicle_count_data(CountingSystem* system, const char* filename);
@@ -115,7 +246,15 @@ bool save_daily_average_speed_data(CountingSystem* system, const char* filename)
 bool save_weekly_average_speed_data(CountingSystem* system, const char* filename);
 
 // Periodic backup functionality
-bool check_periodic_backup(CountingSystem* system);
+bool save_periodic_backup(CountingSystem* system);
+
+// Name of the counting data among the live exports, as its snapshot file
+#define LIVE_COUNTS_NAME "counts_backup"
+
+// Counting data, charts and class totals the web interface reads by name, copied from what
+// the backup job built last. The charts are also written to localdata with each snapshot
+json_t* get_live_export(const char* name);
+void save_count_exports(CountingSystem* system);
 
 // Function to shift all elements in an integer array one position left
 void shift_array_left(int array[], int array_size);
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "countlog.h"
+#include "persist.h"
+
+#define RECORD_SIZE 20         // seq, time, line, lane, class, direction, speed, CRC
+#define RECORD_CRC_OFFSET 18
+#define SPEED_SCALE 10.0f      // Stored speed resolution, 0.1 km/h
+
+static guint8 buffer[COUNT_JOURNAL_RECORDS * RECORD_SIZE];
+static int num_buffered = 0;
+
+static guint32 last_seq = 0;      // Sequence number of the newest record
+static int active_file = 0;       // Journal file the records go to
+static bool start_over = true;    // The next flush replaces what the active file held
+
+static void put_u16(guint8 *p, guint16 value)
+{
+    p[0] = (guint8)value;
+    p[1] = (guint8)(value >> 8);
+}
+
+static void put_u32(guint8 *p, guint32 value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (guint8)(value >> (8 * i));
+}
+
+static void put_u64(guint8 *p, guint64 value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (guint8)(value >> (8 * i));
+}
+
+static guint16 get_u16(const guint8 *p)
+{
+    return (guint16)(p[0] | (p[1] << 8));
+}
+
+static guint32 get_u32(const guint8 *p)
+{
+    guint32 value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static guint64 get_u64(const guint8 *p)
+{
+    guint64 value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static void get_journal_filename(int index, char *filename, size_t size)
+{
+    snprintf(filename, size, COUNT_JOURNAL_FORMAT, index);
+}
+
+// Low half of the CRC-32 over the rest of the record, enough to spot a torn tail
+static guint16 get_record_crc(const guint8 *record)
+{
+    return (guint16)persist_crc32(record, RECORD_CRC_OFFSET);
+}
+
+// Queue the buffered records as one append, called about once a second
+void flush_count_journal(void)
+{
+    if (num_buffered == 0)
+        return;
+
+    char filename[PERSIST_PATH_LENGTH];
+    get_journal_filename(active_file, filename, sizeof(filename));
+
+    if (!persist_append(filename, buffer, (size_t)num_buffered * RECORD_SIZE, start_over))
+        syslog(LOG_ERR, "Failed to queue count journal for %s", filename);
+
+    start_over = false;
+    num_buffered = 0;
+}
+
+// Add one counted crossing, returns its sequence number
+guint32 append_count_journal(gint64 time_ms, int line_id, int lane, int class_id, int dir, float speed)
+{
+    if (num_buffered == COUNT_JOURNAL_RECORDS)
+        flush_count_journal();
+
+    float scaled = speed * SPEED_SCALE + 0.5f;
+    if (scaled < 0.0f)
+        scaled = 0.0f;
+    if (scaled > 65535.0f)
+        scaled = 65535.0f;
+
+    guint8 *record = &buffer[num_buffered * RECORD_SIZE];
+    put_u32(record, ++last_seq);
+    put_u64(record + 4, (guint64)time_ms);
+    record[12] = (guint8)line_id;
+    record[13] = (guint8)lane;
+    record[14] = (guint8)class_id;
+    record[15] = (guint8)dir;
+    put_u16(record + 16, (guint16)scaled);
+    put_u16(record + RECORD_CRC_OFFSET, get_record_crc(record));
+    num_buffered++;
+
+    return last_seq;
+}
+
+// Sequence number of the newest record, the counters in memory include it
+guint32 get_count_journal_seq(void)
+{
+    return last_seq;
+}
+
+// Write the full state and switch to the other journal file. The file in use until
+// now is kept for one more round, the snapshot covers it once it is on disk.
+void compact_count_journal(CountingSystem *system)
+{
+    if (!system)
+        return;
+
+    flush_count_journal();
+    save_state_snapshot(system);
+    save_counting_data(system, COUNT_SNAPSHOT_FILE);
+    save_count_exports(system);
+
+    active_file = 1 - active_file;
+    start_over = true;
+    system->snapshot_due = false;
+    system->snapshot_us = g_get_monotonic_time();
+}
+
+// Apply the records of one file newer than the snapshot, returns the highest sequence seen.
+// Appends are whole records, so reading stops at the first torn or damaged one.
+static guint32 replay_journal_file(CountingSystem *system, int index, int *restored)
+{
+    char filename[PERSIST_PATH_LENGTH];
+    get_journal_filename(index, filename, sizeof(filename));
+
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return 0;
+
+    guint8 record[RECORD_SIZE];
+    guint32 max_seq = 0;
+
+    while (fread(record, 1, RECORD_SIZE, file) == RECORD_SIZE)
+    {
+        if (get_u16(record + RECORD_CRC_OFFSET) != get_record_crc(record))
+        {
+            syslog(LOG_WARNING, "Count journal %s ends in a damaged record", filename);
+            break;
+        }
+
+        guint32 seq = get_u32(record);
+        if (seq > max_seq)
+            max_seq = seq;
+        if (seq <= system->journal_seq)
+            continue;
+
+        // Speed histories come back from the velocity log, the speed here is for the charts
+        restore_count_record(system, (gint64)get_u64(record + 4), record[12], record[13], record[14], record[15],
+                             get_u16(record + 16) / SPEED_SCALE);
+        (*restored)++;
+    }
+
+    fclose(file);
+    return max_seq;
+}
+
+// Add the counts journaled after the snapshot that was loaded to the counters and the
+// hourly charts. The binary snapshot and the JSON exports are written together, so
+// whichever was loaded misses the same records. The caller compacts right after, so
+// the new snapshot is queued before the older file is started over.
+int replay_count_journal(CountingSystem *system)
+{
+    if (!system)
+        return 0;
+
+    int restored = 0;
+    guint32 max_seq[2];
+    for (int i = 0; i < 2; i++)
+    {
+        max_seq[i] = replay_journal_file(system, i, &restored);
+    }
+
+    last_seq = system->journal_seq;
+    for (int i = 0; i < 2; i++)
+    {
+        if (max_seq[i] > last_seq)
+            last_seq = max_seq[i];
+    }
+    // Carry on as if the newer file were in use, the compaction moves on to the older one
+    active_file = max_seq[0] > max_seq[1] ? 0 : 1;
+    start_over = true;
+
+    if (restored > 0)
+        syslog(LOG_INFO, "Replayed %d counts from the journal", restored);
+    return restored;
+}
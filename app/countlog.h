@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "counting.h"
+
+// JSON export of the count state, written with the binary snapshot when the journal
+// is compacted and read only when that snapshot is unusable
+#define COUNT_SNAPSHOT_FILE "/usr/local/packages/enixma_analytic/localdata/counts_backup.json"
+
+// Two journal files used in turn, so the one written before the last snapshot is kept
+// until the next one in case that snapshot never reached the disk
+#define COUNT_JOURNAL_FORMAT "/usr/local/packages/enixma_analytic/localdata/counts_%d.journal"
+
+#define COUNT_SNAPSHOT_SECONDS 300   // Journal compacted into a snapshot this often
+#define COUNT_JOURNAL_RECORDS 256    // Records buffered before they are written regardless
+
+// Append-only journal of counted crossings. Each record is 20 bytes: sequence number,
+// epoch milliseconds, line, lane, class, direction, speed in 0.1 km/h and a CRC. Records
+// are buffered and queued as one append per flush, so a group shares one fdatasync.
+// A snapshot stores the sequence number it includes, startup replays everything after it.
+guint32 append_count_journal(gint64 time_ms, int line_id, int lane, int class_id, int dir, float speed);
+guint32 get_count_journal_seq(void);
+void flush_count_journal(void);
+void compact_count_journal(CountingSystem* system);
+int replay_count_journal(CountingSystem* system);
@@ -0,0 +1,172 @@
+#include <math.h>
+#include <string.h>
+
+#include "counting.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+bool is_segment_crossed(Point *p1, Point *p2, LinePoint *seg_start, LinePoint *seg_end, int *lane_id_out)
+{
+    // Parameter lane_id_out is used for future extension but not used now
+    (void)lane_id_out; // Suppress unused parameter warning
+
+    float s1_x = seg_end->x - seg_start->x;
+    float s1_y = seg_end->y - seg_start->y;
+    float s2_x = p2->x - p1->x;
+    float s2_y = p2->y - p1->y;
+
+    float denominator = (-s2_x * s1_y + s1_x * s2_y);
+    const float small_value = 1e-6f;
+    if (fabsf(denominator) < small_value)
+        return false; // Lines are parallel
+
+    float s = (-s1_y * (seg_start->x - p1->x) + s1_x * (seg_start->y - p1->y)) / denominator;
+    float t = (s2_x * (seg_start->y - p1->y) - s2_y * (seg_start->x - p1->x)) / denominator;
+
+    return (s >= 0 && s <= 1 && t >= 0 && t <= 1);
+}
+
+int get_crossing_direction(Point *p1, Point *p2, LinePoint *seg_start, LinePoint *seg_end)
+{
+    float cross_product = (seg_end->x - seg_start->x) * (p2->y - p1->y) -
+                          (seg_end->y - seg_start->y) * (p2->x - p1->x);
+    return (cross_product > 0) ? 1 : -1; // 1 for down, -1 for up
+}
+
+// Precompute the per-lane segment vectors and the line's bounding box
+void update_line_geometry(MultiLaneLine *line)
+{
+    LineGeometry *geo = &line->geometry;
+    memset(geo, 0, sizeof(LineGeometry));
+
+    geo->min_x = geo->min_y = 1.0f;
+    geo->max_x = geo->max_y = 0.0f;
+
+    for (int i = 0; i < line->num_lanes; i++)
+    {
+        LinePoint *start = &line->points[i];
+        LinePoint *end = &line->points[i + 1];
+
+        geo->start_x[i] = start->x;
+        geo->start_y[i] = start->y;
+        geo->dir_x[i] = end->x - start->x;
+        geo->dir_y[i] = end->y - start->y;
+        geo->normal_x[i] = -geo->dir_y[i];
+        geo->normal_y[i] = geo->dir_x[i];
+
+        geo->min_x = fminf(geo->min_x, fminf(start->x, end->x));
+        geo->min_y = fminf(geo->min_y, fminf(start->y, end->y));
+        geo->max_x = fmaxf(geo->max_x, fmaxf(start->x, end->x));
+        geo->max_y = fmaxf(geo->max_y, fmaxf(start->y, end->y));
+    }
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// Collapse a per-lane comparison result into a lane bitmask
+static unsigned int neon_lane_mask(uint32x4_t value)
+{
+    static const uint32_t weights[4] = {1, 2, 4, 8};
+    uint32x4_t bits = vandq_u32(value, vld1q_u32(weights));
+    uint32x2_t sum = vadd_u32(vget_low_u32(bits), vget_high_u32(bits));
+    sum = vpadd_u32(sum, sum);
+    return vget_lane_u32(sum, 0);
+}
+#endif
+
+// Keep the lanes the line has, down only where the lane was crossed
+static unsigned int finish_lane_masks(const MultiLaneLine *line, unsigned int crossed, unsigned int down, unsigned int *down_mask)
+{
+    unsigned int lanes = line->num_lanes < 32 ? (1u << line->num_lanes) - 1 : ~0u;
+    if (down_mask)
+        *down_mask = down & crossed & lanes;
+    return crossed & lanes;
+}
+
+// One lane at a time, for targets without NEON and as the reference for the NEON version
+unsigned int test_line_crossings_scalar(const MultiLaneLine *line, const Point *p1, const Point *p2, unsigned int *down_mask)
+{
+    const LineGeometry *geo = &line->geometry;
+    const float small_value = 1e-6f;
+    float move_x = p2->x - p1->x;
+    float move_y = p2->y - p1->y;
+    unsigned int crossed = 0;
+    unsigned int down = 0;
+
+    for (int i = 0; i < line->num_lanes; i++)
+    {
+        float qx = geo->start_x[i] - p1->x;
+        float qy = geo->start_y[i] - p1->y;
+
+        float denominator = geo->normal_x[i] * move_x + geo->normal_y[i] * move_y;
+        float s = geo->normal_x[i] * qx + geo->normal_y[i] * qy;
+        float t = move_x * qy - move_y * qx;
+
+        float magnitude = fabsf(denominator);
+        if (denominator < 0)
+        {
+            s = -s;
+            t = -t;
+        }
+
+        if (magnitude >= small_value && s >= 0 && s <= magnitude && t >= 0 && t <= magnitude)
+            crossed |= 1u << i;
+        if (denominator > 0)
+            down |= 1u << i;
+    }
+    return finish_lane_masks(line, crossed, down, down_mask);
+}
+
+// Test the movement p1->p2 against every lane segment of a line, four lanes at a time.
+// Same intersection as is_segment_crossed, with the division replaced by
+// comparing the numerators against the denominator's magnitude. Returns the
+// crossed lanes as a bitmask, down_mask gets the lanes crossed moving down.
+unsigned int test_line_crossings(const MultiLaneLine *line, const Point *p1, const Point *p2, unsigned int *down_mask)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const LineGeometry *geo = &line->geometry;
+    const float small_value = 1e-6f;
+    float move_x = p2->x - p1->x;
+    float move_y = p2->y - p1->y;
+    unsigned int crossed = 0;
+    unsigned int down = 0;
+
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    float32x4_t mx = vdupq_n_f32(move_x);
+    float32x4_t my = vdupq_n_f32(move_y);
+
+    for (int base = 0; base < line->num_lanes; base += 4)
+    {
+        float32x4_t nx = vld1q_f32(&geo->normal_x[base]);
+        float32x4_t ny = vld1q_f32(&geo->normal_y[base]);
+
+        // Offset of each segment start from the movement start
+        float32x4_t qx = vsubq_f32(vld1q_f32(&geo->start_x[base]), vdupq_n_f32(p1->x));
+        float32x4_t qy = vsubq_f32(vld1q_f32(&geo->start_y[base]), vdupq_n_f32(p1->y));
+
+        float32x4_t denominator = vmlaq_f32(vmulq_f32(nx, mx), ny, my);
+        float32x4_t s = vmlaq_f32(vmulq_f32(nx, qx), ny, qy);
+        float32x4_t t = vmlsq_f32(vmulq_f32(mx, qy), my, qx);
+
+        // Fold the denominator's sign into the numerators
+        uint32x4_t negative = vcltq_f32(denominator, zero);
+        float32x4_t magnitude = vabsq_f32(denominator);
+        s = vbslq_f32(negative, vnegq_f32(s), s);
+        t = vbslq_f32(negative, vnegq_f32(t), t);
+
+        uint32x4_t hit = vcgeq_f32(magnitude, vdupq_n_f32(small_value));
+        hit = vandq_u32(hit, vcgeq_f32(s, zero));
+        hit = vandq_u32(hit, vcleq_f32(s, magnitude));
+        hit = vandq_u32(hit, vcgeq_f32(t, zero));
+        hit = vandq_u32(hit, vcleq_f32(t, magnitude));
+
+        crossed |= neon_lane_mask(hit) << base;
+        down |= neon_lane_mask(vcgtq_f32(denominator, zero)) << base;
+    }
+
+    return finish_lane_masks(line, crossed, down, down_mask);
+#else
+    return test_line_crossings_scalar(line, p1, p2, down_mask);
+#endif
+}
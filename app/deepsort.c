@@ -3,22 +3,148 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "deepsort.h"
 #include "incident.h"
 #include "detection.h"
 #include "counting.h"
+#include "fastcgi.h"
+#include "pathlog.h"
 
 Tracker *tracker = NULL;
 
 // Initialize tracker
 float frame_time = 1.0f / 30.0f; // 30 FPS
 
-// Calculate velocity using last two trajectory points
+// Speed estimator settings, changed from the web UI
+int speed_window_size = 8;          // Samples in the least-squares fit
+double speed_outlier_clamp = 2.0;   // Largest accepted deviation from the fit, in meters
+
+// Rebuild the running sums from the samples still in the window, so float
+// error from adding and subtracting cannot build up over a long track
+static void recompute_speed_sums(SpeedWindow *window)
+{
+    window->sum_t = window->sum_x = window->sum_y = 0.0;
+    window->sum_tt = window->sum_tx = window->sum_ty = 0.0;
+
+    for (int k = 0; k < window->count; k++)
+    {
+        double t = window->t[k];
+        window->sum_t += t;
+        window->sum_x += window->x[k];
+        window->sum_y += window->y[k];
+        window->sum_tt += t * t;
+        window->sum_tx += t * window->x[k];
+        window->sum_ty += t * window->y[k];
+    }
+}
+
+// Least-squares slope of the window, in normalized units per second
+static bool fit_speed_window(SpeedWindow *window, double *vx, double *vy)
+{
+    if (window->count < 2)
+        return false;
+
+    double n = window->count;
+    double denom = n * window->sum_tt - window->sum_t * window->sum_t;
+    if (denom < 1e-9)
+        return false;
+
+    *vx = (n * window->sum_tx - window->sum_t * window->sum_x) / denom;
+    *vy = (n * window->sum_ty - window->sum_t * window->sum_y) / denom;
+    return true;
+}
+
+// Add a position to the track's speed window in O(1). Samples further than
+// speed_outlier_clamp meters from the current fit are pulled back onto that radius,
+// a clamp of zero disables this.
+void add_speed_sample(TrackedObject *obj, float x, float y, int64_t timestamp_us,
+                      float pixels_per_meter, int widthFrameHD, int heightFrameHD)
+{
+    SpeedWindow *window = &obj->speed_window;
+
+    if (window->size == 0)
+    {
+        window->size = speed_window_size;
+        if (window->size < 2)
+            window->size = 2;
+        if (window->size > MAX_SPEED_WINDOW)
+            window->size = MAX_SPEED_WINDOW;
+        window->origin_us = timestamp_us;
+    }
+
+    // Repeated observations within the same frame carry no timing information
+    if (window->count > 0 && timestamp_us == window->last_us)
+        return;
+    window->last_us = timestamp_us;
+
+    double t = (double)(timestamp_us - window->origin_us) / 1000000.0;
+
+    double vx, vy;
+    if (speed_outlier_clamp > 0 && pixels_per_meter > 0 && fit_speed_window(window, &vx, &vy))
+    {
+        double mean_t = window->sum_t / window->count;
+        double rx = x - (window->sum_x / window->count + vx * (t - mean_t));
+        double ry = y - (window->sum_y / window->count + vy * (t - mean_t));
+        double meters = sqrt(rx * widthFrameHD * rx * widthFrameHD + ry * heightFrameHD * ry * heightFrameHD) / pixels_per_meter;
+
+        if (meters > speed_outlier_clamp)
+        {
+            double scale = speed_outlier_clamp / meters;
+            x = (float)(x - rx * (1.0 - scale));
+            y = (float)(y - ry * (1.0 - scale));
+        }
+    }
+
+    if (window->count == window->size)
+    {
+        // Window full, the slot at head holds the oldest sample
+        double old_t = window->t[window->head];
+        window->sum_t -= old_t;
+        window->sum_x -= window->x[window->head];
+        window->sum_y -= window->y[window->head];
+        window->sum_tt -= old_t * old_t;
+        window->sum_tx -= old_t * window->x[window->head];
+        window->sum_ty -= old_t * window->y[window->head];
+    }
+    else
+    {
+        window->count++;
+    }
+
+    window->t[window->head] = t;
+    window->x[window->head] = x;
+    window->y[window->head] = y;
+    window->head = (window->head + 1) % window->size;
+
+    if (window->head == 0)
+    {
+        recompute_speed_sums(window);
+    }
+    else
+    {
+        window->sum_t += t;
+        window->sum_x += x;
+        window->sum_y += y;
+        window->sum_tt += t * t;
+        window->sum_tx += t * x;
+        window->sum_ty += t * y;
+    }
+
+    update_velocity(obj, frame_time, pixels_per_meter, widthFrameHD, heightFrameHD);
+}
+
+// Velocity from the least-squares fit over the track's speed window, expressed
+// as displacement per frame like the rest of the tracker expects
 void update_velocity(TrackedObject *obj, float frame_time, float pixels_per_meter, int widthFrameHD, int heightFrameHD)
 {
-    // Need at least 2 points to calculate velocity
-    if (obj->trajectory_count < 2)
+    double vx, vy;
+
+    // Need at least 2 samples to calculate velocity
+    if (!fit_speed_window(&obj->speed_window, &vx, &vy))
     {
         obj->velocity[0] = 0;
         obj->velocity[1] = 0;
@@ -26,35 +152,85 @@ void update_velocity(TrackedObject *obj, float frame_time, float pixels_per_mete
         return;
     }
 
-    // Get the last two points from trajectory
-    Point *current = &obj->trajectory[obj->trajectory_count - 1];
-    Point *previous = &obj->trajectory[obj->trajectory_count - 2];
-
-    // Calculate velocity components
-    float dx = (current->x - previous->x);
-    float dy = (current->y - previous->y);
+    float dx = (float)(vx * frame_time);
+    float dy = (float)(vy * frame_time);
 
     obj->velocity[0] = dx;
     obj->velocity[1] = dy;
     obj->speed_kmh = calculate_speed_kmh(dx, dy, frame_time, pixels_per_meter, widthFrameHD, heightFrameHD);
 }
 
-// Initialize tracker
-Tracker *init_tracker(int capacity, float iou_threshold, int max_age, int min_hits)
+// Bytes of arena needed for count tracks, rounded up to whole pages
+static size_t arena_bytes(int count)
 {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = sizeof(TrackedObject) * (size_t)count;
+    return (bytes + page_size - 1) / page_size * page_size;
+}
+
+// Back more of the reserved arena with memory, doubling capacity up to the high-water mark
+static bool grow_tracker(Tracker *tracker)
+{
+    if (tracker->capacity >= tracker->max_capacity)
+        return false;
+
+    int new_capacity = tracker->capacity * 2;
+    if (new_capacity > tracker->max_capacity)
+        new_capacity = tracker->max_capacity;
+
+    if (mprotect(tracker->objects, arena_bytes(new_capacity), PROT_READ | PROT_WRITE) != 0)
+    {
+        syslog(LOG_ERR, "Failed to grow tracker to %d tracks: %s", new_capacity, strerror(errno));
+        return false;
+    }
+
+    syslog(LOG_INFO, "Tracker grown from %d to %d tracks", tracker->capacity, new_capacity);
+    tracker->capacity = new_capacity;
+    return true;
+}
+
+// Initialize tracker. Address space for max_capacity tracks is reserved up front
+// so the objects array never moves; memory is only committed as the tracker grows.
+Tracker *init_tracker(int capacity, int max_capacity, float iou_threshold, int max_age, int min_hits)
+{
+    if (capacity <= 0 || max_capacity < capacity)
+        return NULL;
+
     Tracker *tracker = (Tracker *)malloc(sizeof(Tracker));
     if (!tracker)
         return NULL;
 
-    tracker->objects = (TrackedObject *)malloc(sizeof(TrackedObject) * capacity);
-    if (!tracker->objects)
+    void *arena = mmap(NULL, arena_bytes(max_capacity), PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED)
     {
+        syslog(LOG_ERR, "Failed to reserve tracker arena: %s", strerror(errno));
+        free(tracker);
+        return NULL;
+    }
+
+    if (mprotect(arena, arena_bytes(capacity), PROT_READ | PROT_WRITE) != 0)
+    {
+        syslog(LOG_ERR, "Failed to commit tracker arena: %s", strerror(errno));
+        munmap(arena, arena_bytes(max_capacity));
+        free(tracker);
+        return NULL;
+    }
+    tracker->objects = (TrackedObject *)arena;
+
+    tracker->grid = init_spatial_grid(GRID_COLS, GRID_ROWS);
+    if (!tracker->grid)
+    {
+        munmap(arena, arena_bytes(max_capacity));
         free(tracker);
         return NULL;
     }
 
     tracker->count = 0;
     tracker->capacity = capacity;
+    tracker->max_capacity = max_capacity;
+    tracker->peak_count = 0;
+    tracker->dropped_detections = 0;
     tracker->iou_threshold = iou_threshold;
     tracker->max_age = max_age;
     tracker->min_hits = min_hits;
@@ -96,7 +272,8 @@ void update_tracker(Tracker *tracker,
                     float *scores,
                     int num_detections,
                     float threshold,
-                    char **labels)
+                    char **labels,
+                    int64_t frame_time_us)
 {
     (void)labels;
 
@@ -106,7 +283,6 @@ void update_tracker(Tracker *tracker,
     // Update age of all existing tracks
     for (int i = 0; i < tracker->count; i++)
     {
-        update_counting(counting_system, &tracker->objects[i]);
         tracker->objects[i].time_since_update++;
     }
 
@@ -125,94 +301,87 @@ void update_tracker(Tracker *tracker,
             continue;
         }
 
-        // Try to match with existing tracks
-        for (int j = 0; j < tracker->count; j++)
+        // Try to match with existing tracks. Only tracks sharing a grid cell
+        // can overlap the detection; the lowest index wins, as with a full scan.
+        int *candidates;
+        int num_candidates = query_spatial_grid(tracker->grid, curr_bbox, 0.0f, &candidates);
+        float iou_threshold = ((int)classes[i] == 1) ? 0.1f : tracker->iou_threshold;
+        int j = -1;
+
+        for (int c = 0; c < num_candidates; c++)
         {
-            if (tracker->objects[j].time_since_update > tracker->max_age)
+            int candidate = candidates[c];
+            if (j >= 0 && candidate > j)
+                continue;
+            if (tracker->objects[candidate].time_since_update > tracker->max_age)
                 continue;
 
-            float iou = calculate_iou(curr_bbox, tracker->objects[j].bbox);
-            float iou_threshold = ((int)classes[i] == 1) ? 0.1f : tracker->iou_threshold;
+            if (calculate_iou(curr_bbox, tracker->objects[candidate].bbox) >= iou_threshold)
+            {
+                j = candidate;
+            }
+        }
+
+        if (j >= 0)
+        {
+            // Store original event-related states
+            bool was_event_detected = tracker->objects[j].event_detected;
+            bool was_event_initialized = tracker->objects[j].event_check_initialized;
+            time_t event_check_start = tracker->objects[j].event_check_start;
+            time_t start_time = tracker->objects[j].start_time;
+
+            // Update existing track
+            memcpy(tracker->objects[j].bbox, curr_bbox, 4 * sizeof(float));
+            tracker->objects[j].score = scores[i];
+            tracker->objects[j].class_id = (int)classes[i];
+            tracker->objects[j].hits++;
+            tracker->objects[j].time_since_update = 0;
+
+            // Preserve event detection state
+            tracker->objects[j].event_detected = was_event_detected;
+            tracker->objects[j].event_check_initialized = was_event_initialized;
+            tracker->objects[j].event_check_start = event_check_start;
+            tracker->objects[j].start_time = start_time;
+
+            // Keep the moved box reachable for the remaining detections
+            insert_grid_item(tracker->grid, j, curr_bbox);
+
+            // Calculate center point for trajectory
+            float cx = (curr_bbox[1] + curr_bbox[3]) / 2.0f;
+            float cy = (curr_bbox[0] + curr_bbox[2]) / 2.0f;
+
+            // Keep the speed fit current, stationary frames pull it towards zero
+            add_speed_sample(&tracker->objects[j], cx, cy, frame_time_us, pixels_per_meter,
+                             context.resolution.widthFrameHD, context.resolution.heightFrameHD);
 
-            if (iou >= iou_threshold)
+            // Only add point if it's different from the last trajectory point
+            if (add_trajectory_point(&tracker->objects[j], cx, cy))
             {
-                // Store original event-related states
-                bool was_event_detected = tracker->objects[j].event_detected;
-                bool was_event_initialized = tracker->objects[j].event_check_initialized;
-                time_t event_check_start = tracker->objects[j].event_check_start;
-                time_t start_time = tracker->objects[j].start_time;
-
-                // Update existing track
-                memcpy(tracker->objects[j].bbox, curr_bbox, 4 * sizeof(float));
-                tracker->objects[j].score = scores[i];
-                tracker->objects[j].class_id = (int)classes[i];
-                tracker->objects[j].hits++;
-                tracker->objects[j].time_since_update = 0;
-
-                // Preserve event detection state
-                tracker->objects[j].event_detected = was_event_detected;
-                tracker->objects[j].event_check_initialized = was_event_initialized;
-                tracker->objects[j].event_check_start = event_check_start;
-                tracker->objects[j].start_time = start_time;
-
-                // Calculate center point for trajectory
-                float cx = (curr_bbox[1] + curr_bbox[3]) / 2.0f;
-                float cy = (curr_bbox[0] + curr_bbox[2]) / 2.0f;
-
-                // Only add point if it's different from the last trajectory point
-                if (tracker->objects[j].trajectory_count == 0)
-                {
-                    // First point, always add it
-                    tracker->objects[j].trajectory[0].x = cx;
-                    tracker->objects[j].trajectory[0].y = cy;
-                    tracker->objects[j].trajectory_count = 1;
-                }
-                else
-                {
-                    // Get last trajectory point
-                    Point *last_point = &tracker->objects[j].trajectory[tracker->objects[j].trajectory_count - 1];
-
-                    // Check if position has changed
-                    if (fabs(last_point->x - cx) > EPSILON || fabs(last_point->y - cy) > EPSILON)
-                    {
-                        if (tracker->objects[j].trajectory_count < MAX_TRAJECTORY_POINTS)
-                        {
-                            int idx = tracker->objects[j].trajectory_count++;
-                            tracker->objects[j].trajectory[idx].x = cx;
-                            tracker->objects[j].trajectory[idx].y = cy;
-                        }
-                        else
-                        {
-                            for (int k = 0; k < MAX_TRAJECTORY_POINTS - 1; k++)
-                            {
-                                tracker->objects[j].trajectory[k] = tracker->objects[j].trajectory[k + 1];
-                            }
-                            tracker->objects[j].trajectory[MAX_TRAJECTORY_POINTS - 1].x = cx;
-                            tracker->objects[j].trajectory[MAX_TRAJECTORY_POINTS - 1].y = cy;
-                        }
-
-                        // // Update velocity after adding new trajectory point
-                        // update_velocity(&tracker->objects[j], frame_time, pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
-
-                        // If object has moved significantly, reset the timer and event detection
-                        float movement = sqrt(
-                            tracker->objects[j].velocity[0] * tracker->objects[j].velocity[0] +
-                            tracker->objects[j].velocity[1] * tracker->objects[j].velocity[1]);
-
-                        if (movement > 0.01f)
-                        { // Threshold for considering movement significant
-                            reset_object_timer(&tracker->objects[j]);
-                        }
-                    }
+                // If object has moved significantly, reset the timer and event detection
+                float movement = sqrt(
+                    tracker->objects[j].velocity[0] * tracker->objects[j].velocity[0] +
+                    tracker->objects[j].velocity[1] * tracker->objects[j].velocity[1]);
+
+                if (movement > 0.01f)
+                { // Threshold for considering movement significant
+                    reset_object_timer(&tracker->objects[j]);
                 }
-
-                matched = true;
-                break;
             }
+
+            matched = true;
         }
 
-        // If no match found and we have capacity, create new track
-        if (!matched && tracker->count < tracker->capacity)
+        // If no match found, create a new track, growing the tracker when it is full
+        if (!matched && tracker->count == tracker->capacity && !grow_tracker(tracker))
+        {
+            tracker->dropped_detections++;
+            if (tracker->dropped_detections == 1 || tracker->dropped_detections % 1000 == 0)
+            {
+                syslog(LOG_WARNING, "Tracker full at %d tracks, %ld detections dropped so far",
+                       tracker->max_capacity, tracker->dropped_detections);
+            }
+        }
+        else if (!matched)
         {
             TrackedObject new_obj = {0};
             memcpy(new_obj.bbox, curr_bbox, 4 * sizeof(float));
@@ -236,41 +405,25 @@ void update_tracker(Tracker *tracker,
             // Initialize first trajectory point
             float cx = (curr_bbox[1] + curr_bbox[3]) / 2.0f;
             float cy = (curr_bbox[0] + curr_bbox[2]) / 2.0f;
-            new_obj.trajectory[0].x = cx;
-            new_obj.trajectory[0].y = cy;
-            new_obj.trajectory_count = 1;
+            add_trajectory_point(&new_obj, cx, cy);
+            add_speed_sample(&new_obj, cx, cy, frame_time_us, pixels_per_meter,
+                             context.resolution.widthFrameHD, context.resolution.heightFrameHD);
 
             // Initialize timer for the new object
             init_object_timer(&new_obj);
 
-            tracker->objects[tracker->count++] = new_obj;
+            tracker->objects[tracker->count] = new_obj;
+            insert_grid_item(tracker->grid, tracker->count, new_obj.bbox);
+            tracker->count++;
+
+            if (tracker->count > tracker->peak_count)
+                tracker->peak_count = tracker->count;
         }
     }
 
     // Delete old tracks and compress the array
-    int write_index = 0;
-    for (int read_index = 0; read_index < tracker->count; read_index++)
-    {
-        if (tracker->objects[read_index].time_since_update <= tracker->max_age)
-        {
-            if (write_index != read_index)
-            {
-                // When moving objects during compression, make a complete copy
-                TrackedObject temp = tracker->objects[read_index];
-                tracker->objects[write_index] = temp;
-            }
-            write_index++;
-        }
-        // else
-        // {
-        //     syslog(LOG_INFO, "Deleting track %d due to age %d exceeding max_age %d",
-        //            tracker->objects[read_index].track_id,
-        //            tracker->objects[read_index].time_since_update,
-        //            tracker->max_age);
-        // }
-    }
-    tracker->count = write_index;
-    
+    compact_tracker(tracker);
+
     // // Log active tracks
     // for (int i = 0; i < tracker->count; i++) {
     //     if (tracker->objects[i].hits < tracker->min_hits) continue;
@@ -322,6 +475,119 @@ void update_tracker(Tracker *tracker,
     process_events(tracker);
 }
 
+// Append a trajectory point, ignoring it when the object has not moved.
+// Returns true when a point was added.
+bool add_trajectory_point(TrackedObject *obj, float cx, float cy)
+{
+    if (obj->trajectory_count == 0)
+    {
+        // First point, always add it
+        obj->trajectory[0].x = cx;
+        obj->trajectory[0].y = cy;
+        obj->trajectory_count = 1;
+        obj->point_time_us[0] = obj->point_time_us[1] = g_get_monotonic_time();
+        init_compact_path(&obj->path, cx, cy);
+        return true;
+    }
+
+    // Check if position has changed
+    Point *last_point = &obj->trajectory[obj->trajectory_count - 1];
+    if (fabs(last_point->x - cx) <= EPSILON && fabs(last_point->y - cy) <= EPSILON)
+        return false;
+
+    if (obj->trajectory_count < MAX_TRAJECTORY_POINTS)
+    {
+        int idx = obj->trajectory_count++;
+        obj->trajectory[idx].x = cx;
+        obj->trajectory[idx].y = cy;
+    }
+    else
+    {
+        for (int k = 0; k < MAX_TRAJECTORY_POINTS - 1; k++)
+        {
+            obj->trajectory[k] = obj->trajectory[k + 1];
+        }
+        obj->trajectory[MAX_TRAJECTORY_POINTS - 1].x = cx;
+        obj->trajectory[MAX_TRAJECTORY_POINTS - 1].y = cy;
+    }
+    append_compact_path(&obj->path, cx, cy);
+    obj->point_time_us[0] = obj->point_time_us[1];
+    obj->point_time_us[1] = g_get_monotonic_time();
+
+    // The new segment is the only movement that can cross a counting line
+    update_counting(counting_system, obj);
+    return true;
+}
+
+// Put back a track saved before a restart, it keeps its id and state
+bool restore_track(Tracker *tracker, const TrackedObject *obj)
+{
+    if (!tracker || !obj)
+        return false;
+
+    if (tracker->count == tracker->capacity && !grow_tracker(tracker))
+        return false;
+
+    tracker->objects[tracker->count] = *obj;
+    insert_grid_item(tracker->grid, tracker->count, obj->bbox);
+    tracker->count++;
+
+    if (tracker->count > tracker->peak_count)
+        tracker->peak_count = tracker->count;
+    return true;
+}
+
+// Delete tracks unseen for longer than max_age, keep the survivors packed and re-indexed
+void compact_tracker(Tracker *tracker)
+{
+    int write_index = 0;
+    for (int read_index = 0; read_index < tracker->count; read_index++)
+    {
+        if (tracker->objects[read_index].time_since_update <= tracker->max_age)
+        {
+            if (write_index != read_index)
+            {
+                // When moving objects during compression, make a complete copy
+                TrackedObject temp = tracker->objects[read_index];
+                tracker->objects[write_index] = temp;
+            }
+            write_index++;
+        }
+        else
+        {
+            // syslog(LOG_INFO, "Deleting track %d due to age %d exceeding max_age %d",
+            //        tracker->objects[read_index].track_id,
+            //        tracker->objects[read_index].time_since_update,
+            //        tracker->max_age);
+
+            // A count still waiting for its section speed is made at the spot speed
+            abandon_section_count(counting_system, &tracker->objects[read_index]);
+
+            // The whole path goes to the API, tentative tracks are mostly noise
+            const TrackedObject *ended = &tracker->objects[read_index];
+            if (ended->hits >= tracker->min_hits)
+                record_finished_path(ended->track_id, ended->class_id, &ended->path);
+        }
+    }
+    tracker->count = write_index;
+
+    // Index the surviving tracks for neighbor queries and the next frame
+    rebuild_track_grid(tracker);
+}
+
+// Re-insert every live track box, predicting each track stays where it was last seen
+void rebuild_track_grid(Tracker *tracker)
+{
+    if (!tracker || !tracker->grid)
+        return;
+
+    reset_spatial_grid(tracker->grid);
+    for (int i = 0; i < tracker->count; i++)
+    {
+        insert_grid_item(tracker->grid, i, tracker->objects[i].bbox);
+    }
+}
+
 // Free tracker resources
 void free_tracker(Tracker *tracker)
 {
@@ -329,8 +595,9 @@ void free_tracker(Tracker *tracker)
     {
         if (tracker->objects)
         {
-            free(tracker->objects);
+            munmap(tracker->objects, arena_bytes(tracker->max_capacity));
         }
+        free_spatial_grid(tracker->grid);
         free(tracker);
     }
 }
\ No newline at end of file
@@ -3,18 +3,39 @@
 #include <math.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "roi.h"
+#include "grid.h"
+#include "trajectory.h"
 
-#define MAX_TRAJECTORY_POINTS 100  // Maximum points to store per trajectory
+#define MAX_TRAJECTORY_POINTS 32  // Recent points kept as floats, the full path lives in CompactPath
 #define EPSILON 1e-6 // Define a small value for floating-point comparison
 #define MAX_TRACK_ID 10000
+#define TRACKER_INITIAL_CAPACITY 100   // Tracks backed by memory at startup
+#define TRACKER_MAX_CAPACITY 1000      // High-water mark the tracker may grow to
+#define MAX_SPEED_WINDOW 16     // Most samples the speed estimator can fit over
+#define REID_EMBEDDING_DIM 128  // Largest appearance embedding a track can hold
 
 typedef struct {
     float x;
     float y;
 } Point;
 
+// Sliding window of track positions with running least-squares sums,
+// so the fitted velocity is available in O(1) after every sample
+typedef struct {
+    double t[MAX_SPEED_WINDOW]; // Seconds since the track's first sample
+    float x[MAX_SPEED_WINDOW];
+    float y[MAX_SPEED_WINDOW];
+    int size;                   // Window length, fixed when the track is created
+    int head;                   // Slot the next sample is written to
+    int count;
+    int64_t origin_us;          // Monotonic time of the first sample
+    int64_t last_us;            // Frame time of the newest sample
+    double sum_t, sum_x, sum_y, sum_tt, sum_tx, sum_ty;
+} SpeedWindow;
+
 // Forward declaration without causing conflicts with incident.h
 #ifndef EVENT_TYPE_ENUM_DEFINED
 typedef enum EventTypeEnum EventTypeEnum;
@@ -28,12 +49,27 @@ typedef struct {
     int track_id;   // Unique tracking ID
     float velocity[2];  // [dx, dy] for motion estimation
     float speed_kmh;    // Speed in km/hr
+    SpeedWindow speed_window;  // Recent positions behind velocity and speed_kmh
     int age;        // Number of frames this object has been tracked
     int hits;       // Number of detections associated with this track
     int time_since_update;  // Frames since last detection
     Point trajectory[MAX_TRAJECTORY_POINTS];
     int trajectory_count;
+    CompactPath path;   // Simplified path since the track was created
     bool counted;   // Flag for crossing line
+    int64_t point_time_us[2];  // Monotonic time of the previous and the newest trajectory point
+
+    // Section speed, timed from the first of the two section lines crossed
+    int section_line;
+    int64_t section_start_us;  // Sub-frame crossing time, 0 before the first line, -1 once measured
+
+    // Count made on a section line, waiting for the section speed with the spot speed as fallback
+    bool count_pending;
+    int pending_line;
+    int pending_lane;
+    int pending_class;
+    bool pending_down;
+    float spot_speed_kmh;
     
     // Timer-related fields
     time_t start_time;     // When the object was first detected
@@ -43,28 +79,44 @@ typedef struct {
     bool event_check_initialized;  // Whether the 15-second check has started
     time_t event_check_start;      // When the 15-second check started
     bool event_detected;           // Whether an event has been detected for this object
+
+    // Appearance for re-identification, only filled in when a ReID model is loaded
+    float embedding[REID_EMBEDDING_DIM];
+    bool has_embedding;
 } TrackedObject;
 
 // Structure for tracking history
 typedef struct {
     TrackedObject* objects;
     int count;
-    int capacity;
+    int capacity;       // Tracks the committed part of the arena can hold
+    int max_capacity;   // High-water mark, the arena is reserved for this many tracks
+    int peak_count;     // Most tracks alive at the same time
+    long dropped_detections;  // Detections lost because the tracker was at its high-water mark
     float iou_threshold;
     int max_age;
     int min_hits;
     int next_track_id;  // Counter for generating unique track IDs
+    SpatialGrid* grid;  // Track boxes of the current frame, for neighbor lookups
 } Tracker;
 
 // Global variable declaration
 extern Tracker* tracker;
 extern float frame_time;
+extern int speed_window_size;
+extern double speed_outlier_clamp;
 
 // Function declarations - core tracking functions
 void update_velocity(TrackedObject* obj, float frame_time, float pixels_per_meter, int widthFrameHD, int heightFrameHD);
-Tracker* init_tracker(int capacity, float iou_threshold, int max_age, int min_hits);
+Tracker* init_tracker(int capacity, int max_capacity, float iou_threshold, int max_age, int min_hits);
+void add_speed_sample(TrackedObject* obj, float x, float y, int64_t timestamp_us,
+                      float pixels_per_meter, int widthFrameHD, int heightFrameHD);
 float calculate_iou(float* box1, float* box2);
 float calculate_speed_kmh(float dx, float dy, float frame_time, float pixels_per_meter, int widthFrameHD, int heightFrameHD);
 void update_tracker(Tracker* tracker, float* locations, float* classes, float* scores, 
-                   int num_detections, float threshold, char** labels);
+                   int num_detections, float threshold, char** labels, int64_t frame_time_us);
+bool add_trajectory_point(TrackedObject* obj, float cx, float cy);
+bool restore_track(Tracker* tracker, const TrackedObject* obj);
+void compact_tracker(Tracker* tracker);
+void rebuild_track_grid(Tracker* tracker);
 void free_tracker(Tracker* tracker);
\ No newline at end of file
@@ -20,6 +20,15 @@
 #include "fastcgi.h"
 #include "imwrite.h"
 #include "event.h"
+#include "reid.h"
+#include "persist.h"
+#include "velocitylog.h"
+#include "countlog.h"
+#include "warmstart.h"
+#include "tsdb.h"
+#include "scheduler.h"
+#include "queue.h"
+#include "los.h"
 
 static GMainLoop *main_loop = NULL;
 static gint animation_timer = -1;
@@ -28,6 +37,53 @@ static gint overlay_id_text = -1;
 
 gdouble start_value  = 0.0;
 
+// Jobs run by the scheduler from the main loop, between frames
+
+static void backup_job(gpointer user_data)
+{
+    save_periodic_backup((CountingSystem *)user_data);
+}
+
+static void velocity_log_job(gpointer user_data)
+{
+    (void)user_data;
+    flush_velocity_log(false);
+}
+
+static void tsdb_job(gpointer user_data)
+{
+    (void)user_data;
+    update_tsdb();
+}
+
+static void hour_job(gpointer user_data)
+{
+    update_period_aggregates((CountingSystem *)user_data);
+}
+
+static void midnight_job(gpointer user_data)
+{
+    check_midnight_reset((CountingSystem *)user_data);
+}
+
+static void lane_metrics_job(gpointer user_data)
+{
+    close_lane_metrics((CountingSystem *)user_data);
+    update_level_of_service((CountingSystem *)user_data);
+}
+
+static void retention_job(gpointer user_data)
+{
+    (void)user_data;
+    cleanup_incident_images_directory();
+}
+
+static void warm_start_job(gpointer user_data)
+{
+    (void)user_data;
+    save_warm_start(tracker);
+}
+
 /**
  * @brief Callback function which is called when animation timer has elapsed.
  *
@@ -110,6 +166,9 @@ static gboolean process_frame(gpointer user_data)
         goto end;
     }
 
+    // One timestamp for every observation of this frame, the speed fits drop repeats of it
+    gint64 frame_time_us = g_get_monotonic_time();
+
     // Get data from latest frame.
     uint8_t *nv12Data = (uint8_t *)vdo_buffer_get_data(buf);
     uint8_t *nv12Data_hq = (uint8_t *)vdo_buffer_get_data(buf_hq);
@@ -220,14 +279,18 @@ static gboolean process_frame(gpointer user_data)
                        scores,
                        numberOfDetections[0],
                        threshold,
-                       labels);
+                       labels,
+                       frame_time_us);
     }
 
-    // Check for periodic backup (every 5 minutes)
-    check_periodic_backup(counting_system);
+    // Re-identify tracks lost behind occlusions, one batched job per frame
+    update_reid(tracker, frame_time_us);
 
-    // Check for midnight reset (already part of your system)
-    check_midnight_reset(counting_system);
+    // Lane occupancy from this frame's boxes, nothing covers a lane when nothing was detected
+    update_lane_occupancy(counting_system, numberOfDetections[0] > 0 ? tracker : NULL);
+
+    // Queue length per ROI from the same tracks
+    update_queues(numberOfDetections[0] > 0 ? tracker : NULL);
 
     // Release frame reference to provider.
     returnFrame(sdImageProvider, buf);
@@ -1036,6 +1099,9 @@ int main(int argc, char **argv)
         goto end;
     }
 
+    // Appearance model is optional, tracking stays IoU-only without it
+    init_reid(context.larod.conn, chipString, REID_MODEL_FILE);
+
     if (context.args.labelsFile)
     {
         if (!parseLabels(&context.label.labels, &context.label.labelFileData, context.args.labelsFile, &numLabels))
@@ -1163,7 +1229,7 @@ int main(int argc, char **argv)
     // Initialize tracker on first call
     if (tracker == NULL)
     {
-        tracker = init_tracker(100, 0.3f, 30, 3);
+        tracker = init_tracker(TRACKER_INITIAL_CAPACITY, TRACKER_MAX_CAPACITY, 0.3f, 30, 3);
     }
 
     // Load icons at program start
@@ -1181,17 +1247,31 @@ int main(int argc, char **argv)
         {0.0, 0.0},
         {0.0, 0.0}};
     counting_system = init_counting_system(7, 1, line1_points);
+
+    // Backups are written by a background thread from here on
+    init_persist();
+    init_tsdb();
     
     if (counting_system) {
-        load_counting_data(counting_system, "/usr/local/packages/enixma_analytic/localdata/counts_backup.json");
-        load_chart_data("/usr/local/packages/enixma_analytic/localdata/daily_vehicle_count.json", daily_vehicle_count, 24);
-        load_chart_data("/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_count.json", weekly_vehicle_count, 7);
+        // One mmap of the binary snapshot, the JSON backups only when it is unusable
+        if (!load_state_snapshot(counting_system))
+        {
+            load_counting_data(counting_system, COUNT_SNAPSHOT_FILE);
+            load_chart_data("/usr/local/packages/enixma_analytic/localdata/daily_vehicle_count.json", daily_vehicle_count, 24);
+            load_chart_data("/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_count.json", weekly_vehicle_count, 7);
 
-        load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/daily_vehicle_pcu.json", daily_vehicle_pcu, 24);
-        load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_pcu.json", weekly_vehicle_pcu, 7);
+            load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/daily_vehicle_pcu.json", daily_vehicle_pcu, 24);
+            load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/weekly_vehicle_pcu.json", weekly_vehicle_pcu, 7);
 
-        load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/daily_average_speed.json", daily_average_speed, 24);
-        load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/weekly_average_speed.json", weekly_average_speed, 7);
+            load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/daily_average_speed.json", daily_average_speed, 24);
+            load_chart_data_double("/usr/local/packages/enixma_analytic/localdata/weekly_average_speed.json", weekly_average_speed, 7);
+            restore_period_aggregates();
+        }
+        restore_velocity_log(counting_system);
+
+        // Counts since the snapshot, folded into a new one before the journal is reused
+        replay_count_journal(counting_system);
+        compact_count_journal(counting_system);
 
         load_image_name("/usr/local/packages/enixma_analytic/localdata/incidentImages.json", incident_images, 10);
         cleanup_incident_images_directory();
@@ -1199,6 +1279,9 @@ int main(int argc, char **argv)
 
     get_parameters();
 
+    // Vehicles still in the scene after a quick restart keep their tracks and counted flags
+    restore_warm_start(tracker);
+
     // Initialize StopLine event handler
     app_data_stopline = calloc(1, sizeof(AppData_StopLine));
     app_data_stopline->base.event_handler = ax_event_handler_new();
@@ -1214,6 +1297,31 @@ int main(int argc, char **argv)
     app_data_incidents->base.event_handler = ax_event_handler_new();
     app_data_incidents->base.event_id = setup_incidents_declaration(app_data_incidents->base.event_handler);
 
+    // Initialize LaneMetrics event handler
+    app_data_lane_metrics = calloc(1, sizeof(AppData_LaneMetrics));
+    app_data_lane_metrics->base.event_handler = ax_event_handler_new();
+    app_data_lane_metrics->base.event_id = setup_lane_metrics_declaration(app_data_lane_metrics->base.event_handler);
+
+    // Initialize Queue event handler
+    app_data_queue = calloc(1, sizeof(AppData_Queue));
+    app_data_queue->base.event_handler = ax_event_handler_new();
+    app_data_queue->base.event_id = setup_queue_declaration(app_data_queue->base.event_handler);
+
+    // Initialize LevelOfService event handler
+    app_data_los = calloc(1, sizeof(AppData_Los));
+    app_data_los->base.event_handler = ax_event_handler_new();
+    app_data_los->base.event_id = setup_los_declaration(app_data_los->base.event_handler);
+
+    // Periodic and wall-clock work, kept off the frame path
+    schedule_job("backup", 1, false, backup_job, counting_system);
+    schedule_job("velocity log", 1, false, velocity_log_job, NULL);
+    schedule_job("time series", 60, true, tsdb_job, NULL);
+    schedule_job("hour rollover", 3600, true, hour_job, counting_system);
+    schedule_job("midnight rollover", 86400, true, midnight_job, counting_system);
+    schedule_job("lane metrics", LANE_METRICS_SECONDS, true, lane_metrics_job, counting_system);
+    schedule_job("retention", 3600, false, retention_job, NULL);
+    schedule_job("warm start", 1, false, warm_start_job, NULL);
+
     // Start animation timer
     animation_timer = g_timeout_add(1, process_frame, &context);
 
@@ -1239,13 +1347,21 @@ int main(int argc, char **argv)
     // Release library resources
     axoverlay_cleanup();
 
-    // Release the animation timer
+    // Release the animation timer and the scheduled jobs
     g_source_remove(animation_timer);
+    stop_scheduler();
+
+    // Counts waiting for a section speed are made at their spot speed while the events still go out
+    for (int i = 0; tracker && i < tracker->count; i++)
+        abandon_section_count(counting_system, &tracker->objects[i]);
 
     // Cleanup event handler
     free_app_data(app_data_stopline, 1);
     free_app_data(app_data_counting, 2);
     free_app_data(app_data_incidents, 3);
+    free_app_data(app_data_lane_metrics, 4);
+    free_app_data(app_data_queue, 5);
+    free_app_data(app_data_los, 6);
 
     // Release main loop
     g_main_loop_unref(main_loop);
@@ -1253,8 +1369,14 @@ int main(int argc, char **argv)
     // Cleanup
     free_polygon(roi1);
     free_polygon(roi2);
+    save_warm_start(tracker);
     free_tracker(tracker);
+    free_reid();
+    flush_velocity_log(true);
+    flush_tsdb();
+    compact_count_journal(counting_system);
     free_counting_system(counting_system);
+    stop_persist();
     cleanup_vehicle_icons();
     curl_global_cleanup();
 
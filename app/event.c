@@ -31,6 +31,9 @@
 AppData_StopLine *app_data_stopline = NULL;
 AppData_Counting *app_data_counting = NULL;
 AppData_Incidents *app_data_incidents = NULL;
+AppData_LaneMetrics *app_data_lane_metrics = NULL;
+AppData_Queue *app_data_queue = NULL;
+AppData_Los *app_data_los = NULL;
 
 /**
  * Send stop line event with current vehicle and incident data
@@ -214,6 +217,152 @@ gboolean send_event_incidents(AppData_Incidents *app_data, const gchar *vehicle_
     return TRUE;
 }
 
+/**
+ * Send headway, gap and occupancy of one lane for the interval just closed
+ */
+gboolean send_event_lane_metrics(AppData_LaneMetrics *app_data, gint line, gint lane,
+                                 gint volume, gdouble headway, gdouble gap, gdouble occupancy)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    AXEvent *event = NULL;
+
+    // Update current data
+    app_data->line = line;
+    app_data->lane = lane;
+    app_data->volume = volume;
+    app_data->headway = headway;
+    app_data->gap = gap;
+    app_data->occupancy = occupancy;
+
+    key_value_set = ax_event_key_value_set_new();
+
+    // Add the event data to the set
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "line", NULL,
+        &app_data->line, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "lane", NULL,
+        &app_data->lane, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "volume", NULL,
+        &app_data->volume, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "headway", NULL,
+        &app_data->headway, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "gap", NULL,
+        &app_data->gap, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "occupancy", NULL,
+        &app_data->occupancy, AX_VALUE_TYPE_DOUBLE, NULL);
+
+    // Create and send the event
+    event = ax_event_new2(key_value_set, NULL);
+    ax_event_handler_send_event(app_data->base.event_handler, app_data->base.event_id, event, NULL);
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    ax_event_free(event);
+
+    return TRUE;
+}
+
+/**
+ * Send the smoothed queue length of a ROI
+ */
+gboolean send_event_queue(AppData_Queue *app_data, gint roi, gdouble length, gint vehicles)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    AXEvent *event = NULL;
+
+    // Update current data
+    app_data->roi = roi;
+    app_data->length = length;
+    app_data->vehicles = vehicles;
+
+    key_value_set = ax_event_key_value_set_new();
+
+    // Add the event data to the set
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "roi", NULL,
+        &app_data->roi, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "length", NULL,
+        &app_data->length, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "vehicles", NULL,
+        &app_data->vehicles, AX_VALUE_TYPE_INT, NULL);
+
+    // Create and send the event
+    event = ax_event_new2(key_value_set, NULL);
+    ax_event_handler_send_event(app_data->base.event_handler, app_data->base.event_id, event, NULL);
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    ax_event_free(event);
+
+    return TRUE;
+}
+
+/**
+ * Send the level of service of an approach after it changed
+ */
+gboolean send_event_los(AppData_Los *app_data, gint approach, const gchar *level, const gchar *state,
+                        gdouble flow, gdouble speed, gdouble v85, gdouble density)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    AXEvent *event = NULL;
+
+    // Update current data
+    app_data->approach = approach;
+
+    g_free(app_data->level);
+    app_data->level = g_strdup(level);
+
+    g_free(app_data->state);
+    app_data->state = g_strdup(state);
+
+    app_data->flow = flow;
+    app_data->speed = speed;
+    app_data->v85 = v85;
+    app_data->density = density;
+
+    key_value_set = ax_event_key_value_set_new();
+
+    // Add the event data to the set
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "approach", NULL,
+        &app_data->approach, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "level", NULL,
+        app_data->level, AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "state", NULL,
+        app_data->state, AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "flow", NULL,
+        &app_data->flow, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "speed", NULL,
+        &app_data->speed, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "v85", NULL,
+        &app_data->v85, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "density", NULL,
+        &app_data->density, AX_VALUE_TYPE_DOUBLE, NULL);
+
+    // Create and send the event
+    event = ax_event_new2(key_value_set, NULL);
+    ax_event_handler_send_event(app_data->base.event_handler, app_data->base.event_id, event, NULL);
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    ax_event_free(event);
+
+    return TRUE;
+}
+
 /**
  * Declaration completion callback for stopline data
  */
@@ -473,6 +622,227 @@ guint setup_incidents_declaration(AXEventHandler *event_handler)
     return declaration;
 }
 
+/**
+ * Setup lane metrics event declaration
+ */
+guint setup_lane_metrics_declaration(AXEventHandler *event_handler)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    guint declaration = 0;
+    gint start_value = 0;
+    GError *error = NULL;
+    gdouble start_double = 0.0;
+
+    // Create event structure
+    key_value_set = create_base_key_value_set("EnixmaAnalytic_LaneMetrics", 3);
+
+    // Add data fields
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "line", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "lane", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "volume", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "headway", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "gap", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "occupancy", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+
+    // Mark data properties
+    ax_event_key_value_set_mark_as_data(key_value_set, "line", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "line", NULL,
+        "wstype:xs:int", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "lane", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "lane", NULL,
+        "wstype:xs:int", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "volume", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "volume", NULL,
+        "wstype:xs:int", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "headway", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "headway", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "gap", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "gap", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "occupancy", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "occupancy", NULL,
+        "wstype:xs:double", NULL);
+
+    // Declare event
+    if (!ax_event_handler_declare(
+            event_handler, key_value_set,
+            FALSE, // Indicate a property state event
+            &declaration,
+            (AXDeclarationCompleteCallback)declaration_complete_callback,
+            &start_value,
+            &error))
+    {
+        syslog(LOG_WARNING, "Could not declare lane metrics event: %s", error->message);
+        g_error_free(error);
+    }
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    return declaration;
+}
+
+/**
+ * Setup queue length event declaration
+ */
+guint setup_queue_declaration(AXEventHandler *event_handler)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    guint declaration = 0;
+    gint start_value = 0;
+    GError *error = NULL;
+    gdouble start_double = 0.0;
+
+    // Create event structure
+    key_value_set = create_base_key_value_set("EnixmaAnalytic_QueueLength", 4);
+
+    // Add data fields
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "roi", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "length", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "vehicles", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+
+    // Mark data properties
+    ax_event_key_value_set_mark_as_data(key_value_set, "roi", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "roi", NULL,
+        "wstype:xs:int", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "length", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "length", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "vehicles", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "vehicles", NULL,
+        "wstype:xs:int", NULL);
+
+    // Declare event
+    if (!ax_event_handler_declare(
+            event_handler, key_value_set,
+            FALSE, // Indicate a property state event
+            &declaration,
+            (AXDeclarationCompleteCallback)declaration_complete_callback,
+            &start_value,
+            &error))
+    {
+        syslog(LOG_WARNING, "Could not declare queue event: %s", error->message);
+        g_error_free(error);
+    }
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    return declaration;
+}
+
+/**
+ * Setup level of service event declaration
+ */
+guint setup_los_declaration(AXEventHandler *event_handler)
+{
+    AXEventKeyValueSet *key_value_set = NULL;
+    guint declaration = 0;
+    gint start_value = 0;
+    GError *error = NULL;
+    const gchar *test_str = "TEST";
+    gdouble start_double = 0.0;
+
+    // Create event structure
+    key_value_set = create_base_key_value_set("EnixmaAnalytic_LevelOfService", 5);
+
+    // Add data fields
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "approach", NULL,
+        &start_value, AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "level", NULL,
+        test_str, AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "state", NULL,
+        test_str, AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "flow", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "speed", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "v85", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+    ax_event_key_value_set_add_key_value(
+        key_value_set, "density", NULL,
+        &start_double, AX_VALUE_TYPE_DOUBLE, NULL);
+
+    // Mark data properties
+    ax_event_key_value_set_mark_as_data(key_value_set, "approach", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "approach", NULL,
+        "wstype:xs:int", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "level", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "level", NULL,
+        "wstype:xs:string", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "state", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "state", NULL,
+        "wstype:xs:string", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "flow", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "flow", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "speed", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "speed", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "v85", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "v85", NULL,
+        "wstype:xs:double", NULL);
+    ax_event_key_value_set_mark_as_data(key_value_set, "density", NULL, NULL);
+    ax_event_key_value_set_mark_as_user_defined(
+        key_value_set, "density", NULL,
+        "wstype:xs:double", NULL);
+
+    // Declare event
+    if (!ax_event_handler_declare(
+            event_handler, key_value_set,
+            FALSE, // Indicate a property state event
+            &declaration,
+            (AXDeclarationCompleteCallback)declaration_complete_callback,
+            &start_value,
+            &error))
+    {
+        syslog(LOG_WARNING, "Could not declare level of service event: %s", error->message);
+        g_error_free(error);
+    }
+
+    // Cleanup
+    ax_event_key_value_set_free(key_value_set);
+    return declaration;
+}
+
 /**
  * Free resources for a specific app data type
  */
@@ -524,6 +894,23 @@ void free_app_data(void *data, int type)
         g_free(incidents->filename);
         break;
     }
+    case 4:
+    { // LaneMetrics
+        // No additional fields to free
+        break;
+    }
+    case 5:
+    { // Queue
+        // No additional fields to free
+        break;
+    }
+    case 6:
+    { // LevelOfService
+        AppData_Los *los = (AppData_Los *)data;
+        g_free(los->level);
+        g_free(los->state);
+        break;
+    }
     }
 
     free(data);
@@ -61,15 +61,49 @@ typedef struct {
     gchar *filename;
 } AppData_Incidents;
 
+typedef struct {
+    AppData_Base base;
+    gint line;
+    gint lane;
+    gint volume;
+    gdouble headway;
+    gdouble gap;
+    gdouble occupancy;
+} AppData_LaneMetrics;
+
+typedef struct {
+    AppData_Base base;
+    gint roi;
+    gdouble length;
+    gint vehicles;
+} AppData_Queue;
+
+typedef struct {
+    AppData_Base base;
+    gint approach;
+    gchar *level;
+    gchar *state;
+    gdouble flow;
+    gdouble speed;
+    gdouble v85;
+    gdouble density;
+} AppData_Los;
+
 // Global data structures
 extern AppData_StopLine* app_data_stopline;
 extern AppData_Counting *app_data_counting;
 extern AppData_Incidents *app_data_incidents;
+extern AppData_LaneMetrics *app_data_lane_metrics;
+extern AppData_Queue *app_data_queue;
+extern AppData_Los *app_data_los;
 
 // Function declarations
 gboolean send_event_stopline(AppData_StopLine *app_data);
 gboolean send_event_counting(AppData_Counting *app_data, const gchar *vehicle_class, gdouble speed, gint line, gint lane, const gchar *direction);
 gboolean send_event_incidents(AppData_Incidents *app_data, const gchar *vehicle_class, const gchar *analytic_name, gint area_id, gdouble speed, const gchar *filename);
+gboolean send_event_lane_metrics(AppData_LaneMetrics *app_data, gint line, gint lane, gint volume, gdouble headway, gdouble gap, gdouble occupancy);
+gboolean send_event_queue(AppData_Queue *app_data, gint roi, gdouble length, gint vehicles);
+gboolean send_event_los(AppData_Los *app_data, gint approach, const gchar *level, const gchar *state, gdouble flow, gdouble speed, gdouble v85, gdouble density);
 
 void declaration_stopline_complete(guint declaration, gint *value);
 void declaration_complete_callback(guint declaration, gint *value);
@@ -79,5 +113,8 @@ AXEventKeyValueSet* create_base_key_value_set(const gchar *topic1, guint token);
 guint setup_stopline_declaration(AXEventHandler *event_handler);
 guint setup_counting_declaration(AXEventHandler *event_handler);
 guint setup_incidents_declaration(AXEventHandler *event_handler);
+guint setup_lane_metrics_declaration(AXEventHandler *event_handler);
+guint setup_queue_declaration(AXEventHandler *event_handler);
+guint setup_los_declaration(AXEventHandler *event_handler);
 
 void free_app_data(void *data, int type);
\ No newline at end of file
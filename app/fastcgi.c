@@ -1,5 +1,8 @@
 #include "fastcgi.h"
 #include "incident.h"
+#include "persist.h"
+#include "tsdb.h"
+#include "pathlog.h"
 
 #include "uriparser/Uri.h"
 #include <sys/stat.h>
@@ -21,6 +24,7 @@ volatile int fcgi_running = 1;
 
 double confidence = 50.0;
 double pixels_per_meter = 50.0;
+double section_distance = 0.0;
 bool first_wrongway = false;
 bool second_wrongway = false;
 bool first_truckright = false;
@@ -153,12 +157,42 @@ MultiLineCoordinates process_crossline(json_t *json_data)
     return coords;
 }
 
+// Crossline parameters map to counting lines: "firstCrossline", "secondCrossline",
+// then "crossline3" up to "crossline<MAX_COUNTING_LINES>". Returns -1 for other names.
+int get_crossline_index(const char *name_param)
+{
+    if (strcmp(name_param, "firstCrossline") == 0)
+        return LINE_1;
+    if (strcmp(name_param, "secondCrossline") == 0)
+        return LINE_2;
+
+    int number = 0;
+    if (sscanf(name_param, "crossline%d", &number) == 1 && number > LINE_2 + 1 && number <= MAX_COUNTING_LINES)
+        return number - 1;
+
+    return -1;
+}
+
+void get_crossline_name(int line_id, char *name, size_t size)
+{
+    if (line_id == LINE_1)
+        snprintf(name, size, "firstCrossline");
+    else if (line_id == LINE_2)
+        snprintf(name, size, "secondCrossline");
+    else
+        snprintf(name, size, "crossline%d", line_id + 1);
+}
+
 // Update the set_crossline_values function to check for empty points array
 void set_crossline_values(const char *name_param, json_t *json_data)
 {
     if (!name_param || !counting_system)
         return;
 
+    int line_id = get_crossline_index(name_param);
+    if (line_id < 0)
+        return;
+
     // Process the crossline with multi-point support
     MultiLineCoordinates multi_coords = process_crossline(json_data);
 
@@ -179,24 +213,13 @@ void set_crossline_values(const char *name_param, json_t *json_data)
 
     if (is_empty_array)
     {
-        // Handle as deletion - reset the line
-        if (strcmp(name_param, "firstCrossline") == 0)
+        // Handle as deletion - reset the line to a single lane with no points.
+        // Lines other than the first are only reset once they have been configured.
+        if (line_id == LINE_1 || is_line_enabled(counting_system, line_id))
         {
-            // Reset first line to a default state (single lane with no points)
-            resize_line_lanes(counting_system, LINE_1, 1);
-            // Reset the points to zeros
+            resize_line_lanes(counting_system, line_id, 1);
             LinePoint default_points[2] = {{0.0f, 0.0f}, {0.0f, 0.0f}};
-            update_line_points(counting_system, LINE_1, default_points, 2);
-        }
-        else if (strcmp(name_param, "secondCrossline") == 0)
-        {
-            // Reset second line
-            if (counting_system->use_second_line)
-            {
-                resize_line_lanes(counting_system, LINE_2, 1);
-                LinePoint default_points[2] = {{0.0f, 0.0f}, {0.0f, 0.0f}};
-                update_line_points(counting_system, LINE_2, default_points, 2);
-            }
+            update_line_points(counting_system, line_id, default_points, 2);
         }
         return;
     }
@@ -208,37 +231,16 @@ void set_crossline_values(const char *name_param, json_t *json_data)
     // Extract lane count (points - 1)
     int num_lanes = multi_coords.num_points - 1;
 
-    if (strcmp(name_param, "firstCrossline") == 0)
-    {
-        // For the first line
-        if (resize_line_lanes(counting_system, LINE_1, num_lanes))
-        {
-            update_line_points(counting_system, LINE_1, multi_coords.points, multi_coords.num_points);
-        }
-    }
-    else if (strcmp(name_param, "secondCrossline") == 0)
+    if (resize_line_lanes(counting_system, line_id, num_lanes))
     {
-        // For the second line
-        if (resize_line_lanes(counting_system, LINE_2, num_lanes))
-        {
-            update_line_points(counting_system, LINE_2, multi_coords.points, multi_coords.num_points);
-        }
+        update_line_points(counting_system, line_id, multi_coords.points, multi_coords.num_points);
     }
 
     // Store direction information if available
     json_t *direction_json = json_object_get(json_data, "direction");
     if (json_is_boolean(direction_json))
     {
-        bool direction = json_boolean_value(direction_json);
-        // Set direction based on the line type
-        if (strcmp(name_param, "firstCrossline") == 0)
-        {
-            counting_system->line1_direction = direction;
-        }
-        else if (strcmp(name_param, "secondCrossline") == 0)
-        {
-            counting_system->line2_direction = direction;
-        }
+        set_line_direction(counting_system, line_id, json_boolean_value(direction_json));
     }
 }
 
@@ -505,6 +507,51 @@ LimitSpeedData process_limitspeed(json_t *json_data, bool *received_flag)
     return limitspeed;
 }
 
+// Function to process a queue axis, [{"x1", "y1", "x2", "y2", "length"}] with the
+// stop line at (x1, y1) and the real-world length of the axis in meters
+QueueAxis process_queue_axis(json_t *json_data)
+{
+    QueueAxis axis = {0};
+
+    if (!json_data)
+    {
+        return axis;
+    }
+
+    // Get array (check if input is array directly or under "data" key)
+    json_t *data_array = json_is_array(json_data) ? json_data : json_object_get(json_data, "data");
+    if (!data_array || !json_is_array(data_array) || json_array_size(data_array) == 0)
+    {
+        return axis;
+    }
+
+    json_t *object = json_array_get(data_array, 0);
+    if (!object || !json_is_object(object))
+    {
+        return axis;
+    }
+
+    json_t *x1 = json_object_get(object, "x1");
+    json_t *y1 = json_object_get(object, "y1");
+    json_t *x2 = json_object_get(object, "x2");
+    json_t *y2 = json_object_get(object, "y2");
+    json_t *length = json_object_get(object, "length");
+    if (!json_is_number(x1) || !json_is_number(y1) || !json_is_number(x2) || !json_is_number(y2) ||
+        !json_is_number(length))
+    {
+        return axis;
+    }
+
+    axis.start_x = (float)json_number_value(x1);
+    axis.start_y = (float)json_number_value(y1);
+    axis.end_x = (float)json_number_value(x2);
+    axis.end_y = (float)json_number_value(y2);
+    axis.length = (float)json_number_value(length);
+    axis.enabled = axis.length > 0;
+
+    return axis;
+}
+
 // Function to process PCU data from JSON
 void process_pcu(json_t *json_data, float *values)
 {
@@ -596,7 +643,7 @@ void set_name_values(const char *name_param, json_t *json_data)
     {
         process_polygon(&roi2, json_data);
     }
-    else if (strcmp(name_param, "firstCrossline") == 0 || strcmp(name_param, "secondCrossline") == 0)
+    else if (get_crossline_index(name_param) >= 0)
     {
         set_crossline_values(name_param, json_data);
     }
@@ -608,6 +655,19 @@ void set_name_values(const char *name_param, json_t *json_data)
     {
         pixels_per_meter = process_slider(json_data);
     }
+    else if (strcmp(name_param, "sectionDistance") == 0)
+    {
+        section_distance = process_slider(json_data);
+    }
+    else if (strcmp(name_param, "speedWindow") == 0)
+    {
+        double window = process_slider(json_data);
+        speed_window_size = (int)window;
+    }
+    else if (strcmp(name_param, "speedClamp") == 0)
+    {
+        speed_outlier_clamp = process_slider(json_data);
+    }
     else if (strcmp(name_param, "firstWrongWay") == 0)
     {
         first_wrongway = process_toggle(json_data);
@@ -680,9 +740,20 @@ void set_name_values(const char *name_param, json_t *json_data)
         second_limitspeed = process_limitspeed(json_data, &second_limitspeed_received);
         // syslog(LOG_INFO, "secondLimitSpeed-Min: %d, firstLimitSpeed-Max: %d, Received Flag: %d", second_limitspeed.min, second_limitspeed.max, second_limitspeed_received);
     }
+    else if (strcmp(name_param, "firstQueueAxis") == 0)
+    {
+        QueueAxis axis = process_queue_axis(json_data);
+        set_queue_axis(1, &axis);
+    }
+    else if (strcmp(name_param, "secondQueueAxis") == 0)
+    {
+        QueueAxis axis = process_queue_axis(json_data);
+        set_queue_axis(2, &axis);
+    }
     else if (strcmp(name_param, "pcu") == 0)
     {
         process_pcu(json_data, pcu_values);
+        update_total_pcu(counting_system);
 
         // syslog(LOG_INFO, "PCU values updated - Car: %.2f, Bike: %.2f, Truck: %.2f, Bus: %.2f, Taxi: %.2f, Pickup: %.2f, Trailer: %.2f",
         //        pcu_values[0], pcu_values[1], pcu_values[2],
@@ -743,14 +814,10 @@ int save_to_file(const char *name_param, json_t *data)
 
     if (json_str)
     {
-        FILE *file = fopen(filename, "w");
-        if (file)
+        // Replace atomically so a power cut never leaves half a parameter file
+        if (write_file_atomic(filename, json_str, strlen(json_str)))
         {
-            if (fputs(json_str, file) >= 0)
-            {
-                result = 0; // Success
-            }
-            fclose(file);
+            result = 0; // Success
         }
         free(json_str);
     }
@@ -923,51 +990,33 @@ void get_parameters(void)
         }
     }
 
-    // Process crossline1
-    char *crossline1_filename = create_filename("firstCrossline");
-    if (crossline1_filename)
+    // Process every crossline
+    for (int line_id = 0; line_id < MAX_COUNTING_LINES; line_id++)
     {
-        char *crossline1_content = get_file_contents(crossline1_filename);
-        free(crossline1_filename);
+        char crossline_name[32];
+        get_crossline_name(line_id, crossline_name, sizeof(crossline_name));
 
-        if (crossline1_content)
-        {
-            json_error_t error;
-            json_t *json_obj = json_loads(crossline1_content, 0, &error);
-            if (json_obj)
-            {
-                set_crossline_values("firstCrossline", json_obj);
-                json_decref(json_obj);
-            }
-            else
-            {
-                syslog(LOG_ERR, "JSON parsing failed for crossline1: %s", error.text);
-            }
-            free(crossline1_content);
-        }
-    }
+        char *crossline_filename = create_filename(crossline_name);
+        if (!crossline_filename)
+            continue;
 
-    // Process crossline2
-    char *crossline2_filename = create_filename("secondCrossline");
-    if (crossline2_filename)
-    {
-        char *crossline2_content = get_file_contents(crossline2_filename);
-        free(crossline2_filename);
+        char *crossline_content = get_file_contents(crossline_filename);
+        free(crossline_filename);
 
-        if (crossline2_content)
+        if (crossline_content)
         {
             json_error_t error;
-            json_t *json_obj = json_loads(crossline2_content, 0, &error);
+            json_t *json_obj = json_loads(crossline_content, 0, &error);
             if (json_obj)
             {
-                set_crossline_values("secondCrossline", json_obj);
+                set_crossline_values(crossline_name, json_obj);
                 json_decref(json_obj);
             }
             else
             {
-                syslog(LOG_ERR, "JSON parsing failed for crossline2: %s", error.text);
+                syslog(LOG_ERR, "JSON parsing failed for %s: %s", crossline_name, error.text);
             }
-            free(crossline2_content);
+            free(crossline_content);
         }
     }
 
@@ -1025,6 +1074,88 @@ void get_parameters(void)
         }
     }
 
+    // Process section distance
+    char *section_distance_filename = create_filename("sectionDistance");
+    if (section_distance_filename)
+    {
+        char *section_distance_content = get_file_contents(section_distance_filename);
+        free(section_distance_filename);
+
+        if (section_distance_content)
+        {
+            json_error_t error;
+            json_t *json_array = json_loads(section_distance_content, 0, &error);
+            if (json_array)
+            {
+                json_t *json_data = json_object();
+                json_object_set_new(json_data, "data", json_array);
+
+                section_distance = process_slider(json_data);
+                json_decref(json_data);
+            }
+            else
+            {
+                syslog(LOG_ERR, "JSON parsing failed for sectionDistance: %s", error.text);
+            }
+            free(section_distance_content);
+        }
+    }
+
+    // Process speed window
+    char *speed_window_filename = create_filename("speedWindow");
+    if (speed_window_filename)
+    {
+        char *speed_window_content = get_file_contents(speed_window_filename);
+        free(speed_window_filename);
+
+        if (speed_window_content)
+        {
+            json_error_t error;
+            json_t *json_array = json_loads(speed_window_content, 0, &error);
+            if (json_array)
+            {
+                json_t *json_data = json_object();
+                json_object_set_new(json_data, "data", json_array);
+
+                double window = process_slider(json_data);
+                speed_window_size = (int)window;
+                json_decref(json_data);
+            }
+            else
+            {
+                syslog(LOG_ERR, "JSON parsing failed for speedWindow: %s", error.text);
+            }
+            free(speed_window_content);
+        }
+    }
+
+    // Process speed outlier clamp
+    char *speed_clamp_filename = create_filename("speedClamp");
+    if (speed_clamp_filename)
+    {
+        char *speed_clamp_content = get_file_contents(speed_clamp_filename);
+        free(speed_clamp_filename);
+
+        if (speed_clamp_content)
+        {
+            json_error_t error;
+            json_t *json_array = json_loads(speed_clamp_content, 0, &error);
+            if (json_array)
+            {
+                json_t *json_data = json_object();
+                json_object_set_new(json_data, "data", json_array);
+
+                speed_outlier_clamp = process_slider(json_data);
+                json_decref(json_data);
+            }
+            else
+            {
+                syslog(LOG_ERR, "JSON parsing failed for speedClamp: %s", error.text);
+            }
+            free(speed_clamp_content);
+        }
+    }
+
     // Process first wrongway toggle
     char *first_wrongway_filename = create_filename("firstWrongWay");
     if (first_wrongway_filename)
@@ -1346,6 +1477,7 @@ void get_parameters(void)
                 json_object_set_new(json_data, "data", json_array);
 
                 process_pcu(json_data, pcu_values);
+                update_total_pcu(counting_system);
 
                 // syslog(LOG_INFO, "PCU values loaded from file - Car: %.2f, Bike: %.2f, Truck: %.2f, Bus: %.2f, Taxi: %.2f, Pickup: %.2f, Trailer: %.2f",
                 //        pcu_values[0], pcu_values[1], pcu_values[2],
@@ -1361,6 +1493,35 @@ void get_parameters(void)
             free(pcu_content);
         }
     }
+
+    // Process the queue axes, one per ROI
+    const char *queue_axis_names[MAX_QUEUE_ROIS] = {"firstQueueAxis", "secondQueueAxis"};
+    for (int roi_index = 1; roi_index <= MAX_QUEUE_ROIS; roi_index++)
+    {
+        char *queue_axis_filename = create_filename(queue_axis_names[roi_index - 1]);
+        if (!queue_axis_filename)
+            continue;
+
+        char *queue_axis_content = get_file_contents(queue_axis_filename);
+        free(queue_axis_filename);
+
+        if (queue_axis_content)
+        {
+            json_error_t error;
+            json_t *json_array = json_loads(queue_axis_content, 0, &error);
+            if (json_array)
+            {
+                QueueAxis axis = process_queue_axis(json_array);
+                set_queue_axis(roi_index, &axis);
+                json_decref(json_array);
+            }
+            else
+            {
+                syslog(LOG_ERR, "JSON parsing failed for %s: %s", queue_axis_names[roi_index - 1], error.text);
+            }
+            free(queue_axis_content);
+        }
+    }
 }
 
 // Function to send JSON response
@@ -1455,6 +1616,17 @@ const char *get_name_param(json_t *query_params)
     return name ? json_string_value(name) : NULL;
 }
 
+// Data of a name, the counting data, count exports and track paths from memory and
+// everything else from its file
+static json_t *load_named_data(const char *name)
+{
+    if (strcmp(name, "track_paths") == 0)
+        return finished_paths_to_json();
+
+    json_t *data = get_live_export(name);
+    return data ? data : load_from_file(name);
+}
+
 // Function to get all files data
 json_t *get_all_files_data(void)
 {
@@ -1482,7 +1654,7 @@ json_t *get_all_files_data(void)
                 *dot = '\0';
 
             // Load data for this file
-            json_t *file_data = load_from_file(name);
+            json_t *file_data = load_named_data(name);
             if (file_data)
             {
                 json_object_set_new(all_data, name, file_data);
@@ -1496,6 +1668,31 @@ json_t *get_all_files_data(void)
     return all_data;
 }
 
+// Integer query parameter, fallback when it is missing
+static gint64 get_int_param(json_t *query_params, const char *key, gint64 fallback)
+{
+    const char *value = json_string_value(json_object_get(query_params, key));
+    return value ? g_ascii_strtoll(value, NULL, 10) : fallback;
+}
+
+// Range query on the time-series store, e.g. ?tier=15min&from=1700000000&to=1700086400&line=1&lane=2
+static json_t *get_timeseries_data(json_t *query_params)
+{
+    int tier = get_tsdb_tier(json_string_value(json_object_get(query_params, "tier")));
+    if (tier < 0)
+        return NULL;
+
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    gint64 to = get_int_param(query_params, "to", now);
+    gint64 from = get_int_param(query_params, "from", to - 86400);
+
+    // Lines and lanes are numbered from 1 like everywhere else in the API, 0 or missing means all
+    int line_id = (int)get_int_param(query_params, "line", 0) - 1;
+    int lane = (int)get_int_param(query_params, "lane", 0) - 1;
+
+    return query_tsdb(tier, from, to, line_id, lane);
+}
+
 // Function to handle GET request
 void handle_get_request(FCGX_Stream *out, json_t *query_params)
 {
@@ -1504,10 +1701,15 @@ void handle_get_request(FCGX_Stream *out, json_t *query_params)
 
     json_object_set_new(response, "method", json_string("GET"));
 
-    if (name_param)
+    if (json_object_get(query_params, "tier"))
+    {
+        json_t *data = get_timeseries_data(query_params);
+        json_object_set_new(response, "data", data ? data : json_null());
+    }
+    else if (name_param)
     {
         // Handle specific file request
-        json_t *data = load_from_file(name_param);
+        json_t *data = load_named_data(name_param);
         if (data)
         {
             json_object_set_new(response, "data", data);
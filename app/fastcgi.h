@@ -7,6 +7,7 @@
 #include "detection.h"
 #include "roi.h"
 #include "counting.h"
+#include "queue.h"
 
 // Define the number of vehicle types for PCU
 #define NUM_VEHICLE_TYPES 7
@@ -17,6 +18,7 @@ extern volatile int fcgi_running;
 
 extern double confidence;
 extern double pixels_per_meter;
+extern double section_distance;   // Meters between the first two lines, 0 for spot speed
 extern bool first_wrongway;
 extern bool second_wrongway;
 extern bool first_truckright;
@@ -79,12 +81,15 @@ void process_polygon(Polygon** roi, json_t *json_data);
 MultiLineCoordinates process_crossline(json_t *json_data);
 LineCoordinates extract_two_point_coords(MultiLineCoordinates multi_coords);
 void set_crossline_values(const char *name_param, json_t *json_data);
+int get_crossline_index(const char *name_param);
+void get_crossline_name(int line_id, char *name, size_t size);
 double process_slider(json_t *json_data);
 bool process_toggle(json_t *json_data);
 IncidentData process_incidents(json_t *json_data, bool *received_flag);
 int process_overspeed(json_t *json_data, bool *received_flag);
 LimitSpeedData process_limitspeed(json_t *json_data, bool *received_flag);
 void process_pcu(json_t *json_data, float *pcu_values);
+QueueAxis process_queue_axis(json_t *json_data);
 void set_name_values(const char *name_param, json_t *json_data);
 int ensure_storage_directory(void);
 char *create_filename(const char *name_param);
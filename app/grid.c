@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "grid.h"
+
+// Map a normalized coordinate to a cell index, clamping boxes that stick out of the frame
+static int cell_index(float value, int cells)
+{
+    int index = (int)(value * cells);
+    if (index < 0)
+        return 0;
+    if (index >= cells)
+        return cells - 1;
+    return index;
+}
+
+// Make sure stamps and results can hold item ids up to and including item
+static bool reserve_items(SpatialGrid *grid, int item)
+{
+    if (item < grid->item_capacity)
+        return true;
+
+    int new_capacity = grid->item_capacity > 0 ? grid->item_capacity : 64;
+    while (new_capacity <= item)
+        new_capacity *= 2;
+
+    unsigned int *stamps = (unsigned int *)realloc(grid->stamps, sizeof(unsigned int) * new_capacity);
+    if (!stamps)
+        return false;
+    memset(stamps + grid->item_capacity, 0, sizeof(unsigned int) * (new_capacity - grid->item_capacity));
+    grid->stamps = stamps;
+
+    int *results = (int *)realloc(grid->results, sizeof(int) * new_capacity);
+    if (!results)
+        return false;
+    grid->results = results;
+
+    grid->item_capacity = new_capacity;
+    return true;
+}
+
+SpatialGrid *init_spatial_grid(int cols, int rows)
+{
+    if (cols <= 0 || rows <= 0)
+        return NULL;
+
+    SpatialGrid *grid = (SpatialGrid *)calloc(1, sizeof(SpatialGrid));
+    if (!grid)
+        return NULL;
+
+    grid->cells = (GridCell *)calloc(cols * rows, sizeof(GridCell));
+    if (!grid->cells)
+    {
+        free(grid);
+        return NULL;
+    }
+
+    grid->cols = cols;
+    grid->rows = rows;
+    return grid;
+}
+
+// Empty every cell but keep the buffers for the next frame
+void reset_spatial_grid(SpatialGrid *grid)
+{
+    if (!grid)
+        return;
+
+    for (int i = 0; i < grid->cols * grid->rows; i++)
+    {
+        grid->cells[i].count = 0;
+    }
+}
+
+// Add an item to every cell its bbox [top, left, bottom, right] overlaps
+bool insert_grid_item(SpatialGrid *grid, int item, const float *bbox)
+{
+    if (!grid || item < 0 || !reserve_items(grid, item))
+        return false;
+
+    int x0 = cell_index(bbox[1], grid->cols);
+    int x1 = cell_index(bbox[3], grid->cols);
+    int y0 = cell_index(bbox[0], grid->rows);
+    int y1 = cell_index(bbox[2], grid->rows);
+
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            GridCell *cell = &grid->cells[y * grid->cols + x];
+            if (cell->count == cell->capacity)
+            {
+                int new_capacity = cell->capacity > 0 ? cell->capacity * 2 : 8;
+                int *items = (int *)realloc(cell->items, sizeof(int) * new_capacity);
+                if (!items)
+                {
+                    syslog(LOG_ERR, "Failed to grow spatial grid cell");
+                    return false;
+                }
+                cell->items = items;
+                cell->capacity = new_capacity;
+            }
+            cell->items[cell->count++] = item;
+        }
+    }
+    return true;
+}
+
+// Collect every item sharing a cell with bbox grown by margin on each side.
+// Each item is reported once. The returned buffer is owned by the grid and
+// stays valid until the next query or insert.
+int query_spatial_grid(SpatialGrid *grid, const float *bbox, float margin, int **results)
+{
+    *results = NULL;
+    if (!grid || grid->item_capacity == 0)
+        return 0;
+
+    if (++grid->query_stamp == 0)
+    {
+        // Stamp wrapped around, forget every previous query
+        memset(grid->stamps, 0, sizeof(unsigned int) * grid->item_capacity);
+        grid->query_stamp = 1;
+    }
+
+    int x0 = cell_index(bbox[1] - margin, grid->cols);
+    int x1 = cell_index(bbox[3] + margin, grid->cols);
+    int y0 = cell_index(bbox[0] - margin, grid->rows);
+    int y1 = cell_index(bbox[2] + margin, grid->rows);
+
+    int count = 0;
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            GridCell *cell = &grid->cells[y * grid->cols + x];
+            for (int k = 0; k < cell->count; k++)
+            {
+                int item = cell->items[k];
+                if (grid->stamps[item] != grid->query_stamp)
+                {
+                    grid->stamps[item] = grid->query_stamp;
+                    grid->results[count++] = item;
+                }
+            }
+        }
+    }
+
+    *results = grid->results;
+    return count;
+}
+
+void free_spatial_grid(SpatialGrid *grid)
+{
+    if (!grid)
+        return;
+
+    if (grid->cells)
+    {
+        for (int i = 0; i < grid->cols * grid->rows; i++)
+        {
+            free(grid->cells[i].items);
+        }
+        free(grid->cells);
+    }
+    free(grid->stamps);
+    free(grid->results);
+    free(grid);
+}
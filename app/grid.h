@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define GRID_COLS 16  // Cells across normalized image width
+#define GRID_ROWS 16  // Cells across normalized image height
+
+// Items whose bbox overlaps a cell, stored as indices into the caller's array
+typedef struct {
+    int* items;
+    int count;
+    int capacity;
+} GridCell;
+
+// Uniform grid over normalized (0-1) image space, rebuilt every frame.
+// Buffers only grow, so once warmed up a frame does no allocation at all.
+typedef struct {
+    int cols;
+    int rows;
+    GridCell* cells;
+    unsigned int* stamps;    // Last query that reported each item, to skip duplicates
+    int* results;            // Query output buffer, one slot per possible item
+    int item_capacity;
+    unsigned int query_stamp;
+} SpatialGrid;
+
+SpatialGrid* init_spatial_grid(int cols, int rows);
+void reset_spatial_grid(SpatialGrid* grid);
+bool insert_grid_item(SpatialGrid* grid, int item, const float* bbox);
+int query_spatial_grid(SpatialGrid* grid, const float* bbox, float margin, int** results);
+void free_spatial_grid(SpatialGrid* grid);
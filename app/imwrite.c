@@ -10,6 +10,7 @@
 
 #include "imwrite.h"
 #include "detection.h"
+#include "persist.h"
 
 #define IMAGE_PATH "/usr/local/packages/enixma_analytic/html/images/incident/%s.jpg"
 
@@ -210,10 +211,7 @@ bool save_image_name(const char *filename, char **image_names, int array_size)
     json_object_set_new(root, "quantity", images_json_array);
     json_object_set_new(root, "size", json_integer(array_size));
 
-    int result = json_dump_file(root, filename, JSON_COMPACT | JSON_ENSURE_ASCII);
-    json_decref(root);
-
-    return (result == 0);
+    return persist_json(filename, root);
 }
 
 bool load_image_name(const char *filename, char **image_names, int array_size)
@@ -271,6 +271,18 @@ void init_object_timer(TrackedObject *obj)
     obj->event_detected = false;
 }
 
+// Take over the timer of a track restored after a restart
+void restore_object_timer(TrackedObject *obj)
+{
+    if (!initialized)
+    {
+        memset(object_start_times, 0, sizeof(object_start_times));
+        initialized = true;
+    }
+
+    object_start_times[obj->track_id % MAX_TRACKED_IDS] = obj->start_time;
+}
+
 // Reset object timer
 void reset_object_timer(TrackedObject *obj)
 {
@@ -322,12 +334,25 @@ float calculate_object_distance(TrackedObject *obj1, TrackedObject *obj2)
     return sqrt(dx * dx + dy * dy);
 }
 
+// Collect tracks whose box shares a grid cell with the proximity area around obj
+static int find_nearby_candidates(Tracker *tracker, TrackedObject *obj, int **candidates)
+{
+    float cx = (obj->bbox[1] + obj->bbox[3]) / 2.0f;
+    float cy = (obj->bbox[0] + obj->bbox[2]) / 2.0f;
+    float center[4] = {cy, cx, cy, cx};
+
+    return query_spatial_grid(tracker->grid, center, PROXIMITY_THRESHOLD, candidates);
+}
+
 // Function to check for presence of person near an object
 bool is_person_nearby(Tracker *tracker, TrackedObject *obj)
 {
-    for (int i = 0; i < tracker->count; i++)
+    int *candidates;
+    int num_candidates = find_nearby_candidates(tracker, obj, &candidates);
+
+    for (int c = 0; c < num_candidates; c++)
     {
-        TrackedObject *other = &tracker->objects[i];
+        TrackedObject *other = &tracker->objects[candidates[c]];
 
         // Skip if same object or not a person
         if (other->track_id == obj->track_id || other->class_id != PERSON_CLASS_ID)
@@ -360,9 +385,12 @@ bool is_car_accident_event(Tracker *tracker, TrackedObject *obj)
     (void)nearby_vehicle_id;
 
     // Check for nearby objects
-    for (int i = 0; i < tracker->count; i++)
+    int *candidates;
+    int num_candidates = find_nearby_candidates(tracker, obj, &candidates);
+
+    for (int c = 0; c < num_candidates; c++)
     {
-        TrackedObject *other = &tracker->objects[i];
+        TrackedObject *other = &tracker->objects[candidates[c]];
 
         // Skip if same object
         if (other->track_id == obj->track_id)
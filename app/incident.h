@@ -67,6 +67,7 @@ void reset_events_for_object(int object_id);
 // Timer-related function declarations
 void init_object_timer(TrackedObject* obj);
 void reset_object_timer(TrackedObject* obj);
+void restore_object_timer(TrackedObject* obj);
 
 // ROI event settings
 void update_roi_event_settings(int roi_index, ROIEventSettings settings);
@@ -0,0 +1,146 @@
+#include "los.h"
+#include "event.h"
+#include "queue.h"
+
+// Upper density of levels A to E in vehicles per km and lane, F is everything above
+static const float density_limits[LOS_LEVELS - 1] = {7.0f, 11.0f, 16.0f, 22.0f, 28.0f};
+static const char *level_names[LOS_LEVELS] = {"A", "B", "C", "D", "E", "F"};
+
+// Highest mean speed as a fraction of the free-flow speed for levels D to F
+static const float speed_ratio_limits[LOS_SPEED_LEVELS] = {0.5f, 0.4f, 0.3f};
+
+typedef struct
+{
+    bool graded;     // False until the first interval with data
+    int level;       // Index into level_names
+    float density;   // Vehicles per km and lane of the last interval
+    float free_flow; // V85 of free-flowing intervals, 0 until there was one
+} ApproachState;
+
+static ApproachState approaches[MAX_COUNTING_LINES];
+
+// Free flow for A to C, dense for D and E, congested for F
+static const char *get_state_name(int level)
+{
+    if (level <= 2)
+        return "free_flow";
+    return level <= 4 ? "dense" : "congested";
+}
+
+// Level for a density. A worse level is taken as soon as its boundary is passed, a better
+// one only once the density is LOS_HYSTERESIS below it, so a boundary value does not flap.
+static int grade_density(float density, const ApproachState *approach)
+{
+    int level = 0;
+    while (level < LOS_LEVELS - 1 && density > density_limits[level])
+        level++;
+
+    if (approach->graded)
+    {
+        while (level < approach->level && density > density_limits[level] - LOS_HYSTERESIS)
+            level++;
+    }
+    return level;
+}
+
+// Level for the mean speed against the free-flow speed, A when the speed says nothing.
+// Only D to F are graded this way, a slow approach is congested however few vehicles
+// reach the lines. Hysteresis as for density, in speed ratio.
+static int grade_speed(const MultiLaneLine *line, const ApproachState *approach)
+{
+    if (line->traffic.speeds < LOS_MIN_SPEEDS || approach->free_flow < 1.0f)
+        return 0;
+
+    float ratio = line->traffic.speed / approach->free_flow;
+    int first = LOS_LEVELS - LOS_SPEED_LEVELS;
+    int level = 0;
+    for (int k = 0; k < LOS_SPEED_LEVELS; k++)
+    {
+        if (ratio <= speed_ratio_limits[k])
+            level = first + k;
+    }
+
+    if (approach->graded)
+    {
+        int next = level < first ? first : level + 1;
+        while (next <= approach->level && ratio <= speed_ratio_limits[next - first] + LOS_SPEED_HYSTERESIS)
+            level = next++;
+    }
+    return level;
+}
+
+// Density of an approach, measured over the ROI of the first two lines when it has an
+// axis, otherwise derived from flow and mean speed. False when neither is known.
+static bool get_density(const MultiLaneLine *line, int line_id, float *density)
+{
+    float roi_density;
+    if (line_id < MAX_QUEUE_ROIS && take_roi_density(line_id + 1, &roi_density))
+    {
+        *density = roi_density / line->num_lanes;
+        return true;
+    }
+
+    // Without a ROI nothing tells an empty road from a standing queue, keep the last level
+    if (line->traffic.speeds == 0 || line->traffic.speed < 1.0f)
+        return false;
+
+    *density = line->traffic.flow / line->traffic.speed;
+    return true;
+}
+
+void update_level_of_service(CountingSystem *system)
+{
+    if (!system)
+        return;
+
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
+    {
+        const MultiLaneLine *line = &system->lines[line_id];
+        ApproachState *approach = &approaches[line_id];
+        float density;
+
+        if (line->num_lanes == 0 || !get_density(line, line_id, &density))
+            continue;
+
+        int level = grade_density(density, approach);
+        int speed_level = grade_speed(line, approach);
+        if (speed_level > level)
+            level = speed_level;
+
+        // The free-flow speed takes a higher V85 at once and a lower one slowly while traffic
+        // flows freely, so slowing traffic does not drag it down. It holds through congestion.
+        if (level <= 2 && line->traffic.speeds >= LOS_MIN_SPEEDS)
+        {
+            float v85 = line->traffic.v85;
+            if (v85 > approach->free_flow)
+                approach->free_flow = v85;
+            else
+                approach->free_flow += (v85 - approach->free_flow) * LOS_FREE_FLOW_WEIGHT;
+        }
+
+        bool changed = !approach->graded || level != approach->level;
+
+        approach->graded = true;
+        approach->level = level;
+        approach->density = density;
+
+        if (changed)
+        {
+            send_event_los(app_data_los, line_id + 1, level_names[level], get_state_name(level),
+                           line->traffic.flow, line->traffic.speed, line->traffic.v85, density);
+        }
+    }
+}
+
+json_t *level_of_service_to_json(int line_id)
+{
+    if (line_id < 0 || line_id >= MAX_COUNTING_LINES || !approaches[line_id].graded)
+        return json_null();
+
+    const ApproachState *approach = &approaches[line_id];
+    json_t *los = json_object();
+    json_object_set_new(los, "level", json_string(level_names[approach->level]));
+    json_object_set_new(los, "state", json_string(get_state_name(approach->level)));
+    json_object_set_new(los, "density", json_real(approach->density));
+    return los;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <jansson.h>
+
+#include "counting.h"
+
+#define LOS_LEVELS 6                // A to F
+#define LOS_HYSTERESIS 1.5f         // Vehicles per km and lane below a boundary before the level improves
+#define LOS_SPEED_LEVELS 3          // D to F, also graded by mean speed over free-flow speed
+#define LOS_SPEED_HYSTERESIS 0.05f  // Speed ratio above a boundary before the level improves
+#define LOS_MIN_SPEEDS 5            // Speeds an interval needs before its mean and V85 are used
+#define LOS_FREE_FLOW_WEIGHT 0.05f  // Share of a lower free-flowing V85 taken into the free-flow speed
+
+// Level of service of each line's approach, graded by density once per lane metrics
+// interval from the flow, speeds and ROI occupancy gathered during it. The mean speed
+// against the V85 of free-flowing intervals can make it worse, down to D to F.
+void update_level_of_service(CountingSystem* system);
+json_t* level_of_service_to_json(int line_id);
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "od.h"
+
+#define POSITION(line_id, lane, down) (((line_id) * MAX_LANES + (lane)) * 2 + ((down) ? 1 : 0))
+
+// Last crossing of a track still waiting for its destination
+typedef struct
+{
+    bool used;
+    int track_id;
+    int position;    // POSITION of the crossing
+    gint64 bucket;   // Tick of the expiry clock it was made in
+} OdEntry;
+
+static OdEntry table[OD_TABLE_SIZE];
+static int num_entries = 0;
+static int od_counts[OD_POSITIONS][OD_POSITIONS];
+
+// Tick the table was last swept at, and whether a full table was logged during it
+static gint64 sweep_bucket = -1;
+static bool full_logged = false;
+
+static guint get_slot(int track_id)
+{
+    return ((guint)track_id * 2654435761u) & (OD_TABLE_SIZE - 1);
+}
+
+// Linear probe for a track, returns the slot holding it or the free slot it would go in,
+// -1 when it is missing and the table is full
+static int find_slot(int track_id)
+{
+    guint slot = get_slot(track_id);
+    for (int probe = 0; probe < OD_TABLE_SIZE; probe++)
+    {
+        OdEntry *entry = &table[slot];
+        if (!entry->used || entry->track_id == track_id)
+            return (int)slot;
+        slot = (slot + 1) & (OD_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+// Drop the crossings older than the time to live. The table is rebuilt once per tick,
+// so lookups never meet expired entries and the probe chains stay unbroken.
+static void sweep_table(gint64 bucket)
+{
+    if (bucket == sweep_bucket)
+        return;
+    sweep_bucket = bucket;
+    full_logged = false;
+
+    static OdEntry live[OD_TABLE_SIZE];
+    int num_live = 0;
+    for (int i = 0; i < OD_TABLE_SIZE; i++)
+    {
+        if (table[i].used && bucket - table[i].bucket < OD_TTL_BUCKETS)
+            live[num_live++] = table[i];
+    }
+    if (num_live == num_entries)
+        return;
+
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < num_live; i++)
+        table[find_slot(live[i].track_id)] = live[i];
+    num_entries = num_live;
+}
+
+void record_od_crossing(int track_id, int line_id, int lane, bool moving_down)
+{
+    if (line_id < 0 || line_id >= MAX_COUNTING_LINES || lane < 0 || lane >= MAX_LANES)
+        return;
+
+    gint64 bucket = g_get_monotonic_time() / ((gint64)OD_BUCKET_SECONDS * G_USEC_PER_SEC);
+    sweep_table(bucket);
+
+    int position = POSITION(line_id, lane, moving_down);
+    int slot = find_slot(track_id);
+    if (slot < 0)
+    {
+        if (!full_logged)
+            syslog(LOG_WARNING, "Origin-destination table full, crossings are dropped");
+        full_logged = true;
+        return;
+    }
+
+    OdEntry *entry = &table[slot];
+    if (!entry->used)
+    {
+        entry->used = true;
+        entry->track_id = track_id;
+        entry->position = position;
+        entry->bucket = bucket;
+        num_entries++;
+        return;
+    }
+
+    // Crossing the same line again is jitter, the first crossing stands
+    if (entry->position / (MAX_LANES * 2) == line_id)
+        return;
+
+    // A movement from the previous line, which is the origin of the next one
+    od_counts[entry->position][position]++;
+    entry->position = position;
+    entry->bucket = bucket;
+}
+
+void reset_od_matrix(void)
+{
+    memset(od_counts, 0, sizeof(od_counts));
+}
+
+static void position_to_json(json_t *json, const char *prefix, int position)
+{
+    char key[32];
+
+    snprintf(key, sizeof(key), "%s_line", prefix);
+    json_object_set_new(json, key, json_integer(position / (MAX_LANES * 2) + 1));
+    snprintf(key, sizeof(key), "%s_lane", prefix);
+    json_object_set_new(json, key, json_integer(position / 2 % MAX_LANES + 1));
+    snprintf(key, sizeof(key), "%s_direction", prefix);
+    json_object_set_new(json, key, json_string(position % 2 ? "down" : "up"));
+}
+
+static int position_from_json(json_t *json, const char *prefix)
+{
+    char key[32];
+
+    snprintf(key, sizeof(key), "%s_line", prefix);
+    json_t *line_json = json_object_get(json, key);
+    snprintf(key, sizeof(key), "%s_lane", prefix);
+    json_t *lane_json = json_object_get(json, key);
+    snprintf(key, sizeof(key), "%s_direction", prefix);
+    json_t *direction_json = json_object_get(json, key);
+
+    if (!json_is_integer(line_json) || !json_is_integer(lane_json) || !json_is_string(direction_json))
+        return -1;
+
+    int line_id = json_integer_value(line_json) - 1;
+    int lane = json_integer_value(lane_json) - 1;
+    if (line_id < 0 || line_id >= MAX_COUNTING_LINES || lane < 0 || lane >= MAX_LANES)
+        return -1;
+
+    return POSITION(line_id, lane, strcmp(json_string_value(direction_json), "down") == 0);
+}
+
+// Non-zero cells only, most of the matrix is movements that cannot happen
+json_t *od_matrix_to_json(void)
+{
+    json_t *cells = json_array();
+    for (int from = 0; from < OD_POSITIONS; from++)
+    {
+        for (int to = 0; to < OD_POSITIONS; to++)
+        {
+            if (od_counts[from][to] == 0)
+                continue;
+
+            json_t *cell = json_object();
+            position_to_json(cell, "from", from);
+            position_to_json(cell, "to", to);
+            json_object_set_new(cell, "count", json_integer(od_counts[from][to]));
+            json_array_append_new(cells, cell);
+        }
+    }
+    return cells;
+}
+
+void load_od_matrix(json_t *json)
+{
+    if (!json_is_array(json))
+        return;
+
+    reset_od_matrix();
+    for (size_t i = 0; i < json_array_size(json); i++)
+    {
+        json_t *cell = json_array_get(json, i);
+        int from = position_from_json(cell, "from");
+        int to = position_from_json(cell, "to");
+        json_t *count_json = json_object_get(cell, "count");
+        if (from >= 0 && to >= 0 && json_is_integer(count_json))
+            od_counts[from][to] = json_integer_value(count_json);
+    }
+}
+
+// Raw copies of the matrix for the binary state snapshot
+void get_od_counts(int counts[OD_POSITIONS][OD_POSITIONS])
+{
+    memcpy(counts, od_counts, sizeof(od_counts));
+}
+
+void set_od_counts(const int counts[OD_POSITIONS][OD_POSITIONS])
+{
+    memcpy(od_counts, counts, sizeof(od_counts));
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "counting.h"
+
+#define OD_TABLE_SIZE 1024        // Tracks remembered at once, a power of two
+#define OD_BUCKET_SECONDS 10      // Tick of the expiry clock
+#define OD_TTL_BUCKETS 6          // Ticks a crossing waits for the next line, one minute
+#define OD_POSITIONS (MAX_COUNTING_LINES * MAX_LANES * 2)  // Every line, lane and direction
+
+// Origin-destination counts between counting lines. The last crossing of each track is
+// kept for OD_TTL_BUCKETS ticks, a crossing of another line in that time is one movement.
+void record_od_crossing(int track_id, int line_id, int lane, bool moving_down);
+void reset_od_matrix(void);
+json_t* od_matrix_to_json(void);
+void load_od_matrix(json_t* json);
+void get_od_counts(int counts[OD_POSITIONS][OD_POSITIONS]);
+void set_od_counts(const int counts[OD_POSITIONS][OD_POSITIONS]);
@@ -262,41 +262,16 @@ void draw_count(cairo_t *rendering_context, gint width, gint height, gint line_w
     double divide = width / num_vehicles;
     double pre_divide = 0;
 
-    // Get counts from both lines for all classes
+    // Get counts from every line for all classes
     double counts[num_vehicles];
     for (int i = 0; i < num_vehicles; i++)
     {
         counts[i] = 0;
 
-        // Sum up counts from all lanes in LINE_1
-        for (int lane_id = 0; lane_id < counting_system->line1.num_lanes; lane_id++)
+        // Totals over all lanes of every line, only for valid classes
+        if (i < counting_system->num_classes)
         {
-            int up_count = 0, down_count = 0;
-
-            // Only get counts if class_id is valid (less than num_classes)
-            if (i < counting_system->num_classes)
-            {
-                get_lane_counts(counting_system, LINE_1, i, lane_id, &up_count, &down_count);
-            }
-
-            counts[i] += up_count + down_count;
-        }
-
-        // Sum up counts from all lanes in LINE_2 (if active)
-        if (counting_system->use_second_line)
-        {
-            for (int lane_id = 0; lane_id < counting_system->line2.num_lanes; lane_id++)
-            {
-                int up_count = 0, down_count = 0;
-
-                // Only get counts if class_id is valid (less than num_classes)
-                if (i < counting_system->num_classes)
-                {
-                    get_lane_counts(counting_system, LINE_2, i, lane_id, &up_count, &down_count);
-                }
-
-                counts[i] += up_count + down_count;
-            }
+            counts[i] = get_class_count(counting_system, i);
         }
     }
 
@@ -483,23 +458,19 @@ void draw_label(cairo_t *rendering_context, gint width, gint height)
         if (tracker->objects[i].hits < tracker->min_hits)
             continue;
 
-        for (int j = 0; j < tracker->objects[i].trajectory_count; j++)
+        // Trail from where the track appeared, the float trajectory only holds its newest points
+        float xy[2 * PATH_MAX_POINTS];
+        int points = decode_compact_path(&tracker->objects[i].path, xy, PATH_MAX_POINTS);
+        if (points > 1)
         {
-            double old_cx = tracker->objects[i].trajectory[j - 1].x * width;
-            double old_cy = tracker->objects[i].trajectory[j - 1].y * newHeight + (height - newHeight) / 2;
-
-            double new_cx = tracker->objects[i].trajectory[j].x * width;
-            double new_cy = tracker->objects[i].trajectory[j].y * newHeight + (height - newHeight) / 2;
-
-            // Check if the old center is effectively non-zero
-            if (fabs(old_cx) > EPSILON && fabs(old_cy) > EPSILON)
+            cairo_set_source_rgba(rendering_context, r, g, b, 0.5); // Line color
+            cairo_set_line_width(rendering_context, 2.0);
+            cairo_move_to(rendering_context, xy[0] * width, xy[1] * newHeight + (height - newHeight) / 2);
+            for (int j = 1; j < points; j++)
             {
-                cairo_set_source_rgba(rendering_context, r, g, b, 0.5); // Line color
-                cairo_set_line_width(rendering_context, 2.0);
-                cairo_move_to(rendering_context, old_cx, old_cy); // Start of the line (old center)
-                cairo_line_to(rendering_context, new_cx, new_cy); // End of the line (new center)
-                cairo_stroke(rendering_context);
+                cairo_line_to(rendering_context, xy[2 * j] * width, xy[2 * j + 1] * newHeight + (height - newHeight) / 2);
             }
+            cairo_stroke(rendering_context);
         }
 
         // float score  = tracker->objects[i].score;
@@ -607,149 +578,12 @@ void draw_counting_line(cairo_t *rendering_context,
     cairo_set_operator(rendering_context, CAIRO_OPERATOR_SOURCE);
     cairo_set_line_width(rendering_context, line_width); // Make line thicker
 
-    // Draw first line with multiple segments
-    for (int i = 0; i < system->line1.num_lanes; i++)
+    // Draw every configured line with multiple segments
+    for (int line_id = 0; line_id < system->num_lines; line_id++)
     {
-        cairo_set_source_rgb(rendering_context, normal_color[0], normal_color[1], normal_color[2]);
-
-        // Draw circles at each point
-        for (int j = i; j <= i + 1; j++)
-        {
-            // Skip drawing if BOTH x AND y are close to 0
-            if (fabs(system->line1.points[j].x) < EPSILON && fabs(system->line1.points[j].y) < EPSILON)
-                continue;
-
-            cairo_arc(rendering_context,
-                      system->line1.points[j].x * width,
-                      system->line1.points[j].y * height,
-                      5.0, 0, 2 * G_PI);
-            cairo_fill(rendering_context);
-        }
-
-        // Check if any counting occurred in this lane recently
-        bool lane_counting = system->line1.timestamps[i] > 0 &&
-                             (g_get_monotonic_time() - system->line1.timestamps[i]) < 250000; // 250ms blink
-
-        // Set color based on counting state
-        if (lane_counting)
-        {
-            cairo_set_source_rgb(rendering_context, active_color[0], active_color[1], active_color[2]);
-        }
-
-        // Skip drawing line segment if both end points have x and y close to 0
-        if ((fabs(system->line1.points[i].x) < EPSILON && fabs(system->line1.points[i].y) < EPSILON) ||
-            (fabs(system->line1.points[i + 1].x) < EPSILON && fabs(system->line1.points[i + 1].y) < EPSILON))
-        {
-            continue;
-        }
-
-        // Draw line segment
-        cairo_move_to(rendering_context,
-                      system->line1.points[i].x * width,
-                      system->line1.points[i].y * height);
-        cairo_line_to(rendering_context,
-                      system->line1.points[i + 1].x * width,
-                      system->line1.points[i + 1].y * height);
-        cairo_stroke(rendering_context);
-
-        // Draw arrow below the line
-        float mid_x = (system->line1.points[i].x + system->line1.points[i + 1].x) * width / 2;
-        float mid_y = (system->line1.points[i].y + system->line1.points[i + 1].y) * height / 2;
-        float arrow_size = line_width * 5;
-
-        // Calculate the angle of the line segment
-        float dx = system->line1.points[i + 1].x - system->line1.points[i].x;
-        float dy = system->line1.points[i + 1].y - system->line1.points[i].y;
-
-        // Reverse the direction if needed
-        if (!system->line1_direction)
-        {
-            dx = -dx;
-            dy = -dy;
-        }
-
-        float angle = atan2(dy, dx);
-
-        // Rotate the original V-shaped arrow to match line direction
-        // Original V points were at (-arrow_size, +arrow_size), (0, +arrow_size*2), and (+arrow_size, +arrow_size)
-        // relative to mid_x, mid_y
-
-        // Calculate rotated points
-        float left_x = mid_x + (-arrow_size * cos(angle) - arrow_size * sin(angle));
-        float left_y = mid_y + (-arrow_size * sin(angle) + arrow_size * cos(angle));
-
-        float center_x = mid_x + (0 * cos(angle) - arrow_size * 2 * sin(angle));
-        float center_y = mid_y + (0 * sin(angle) + arrow_size * 2 * cos(angle));
-
-        float right_x = mid_x + (arrow_size * cos(angle) - arrow_size * sin(angle));
-        float right_y = mid_y + (arrow_size * sin(angle) + arrow_size * cos(angle));
-
-        // Draw V-shaped arrow with same shape but rotated to match line
-        cairo_move_to(rendering_context, left_x, left_y);
-        cairo_line_to(rendering_context, center_x, center_y);
-        cairo_line_to(rendering_context, right_x, right_y);
-        cairo_stroke(rendering_context);
-
-        // Get total count for this lane (sum all classes)
-        int lane_total = 0;
-        for (int class_id = 0; class_id < system->num_classes; class_id++)
-        {
-            int up_count = 0, down_count = 0;
-            get_lane_counts(system, LINE_1, class_id, i, &up_count, &down_count);
-            lane_total += up_count + down_count;
-        }
-
-        // Display count based on line2_direction
-        cairo_set_source_rgb(rendering_context, 1, 1, 1); // White text
-        cairo_select_font_face(rendering_context, "serif", CAIRO_FONT_SLANT_NORMAL,
-                               CAIRO_FONT_WEIGHT_BOLD);
-        cairo_set_font_size(rendering_context, height * 7 / 200); // Slightly larger text
-
-        char *count_lane = NULL;
-        int lane_result = asprintf(&count_lane, "%d", lane_total);
-        if (lane_result != -1)
-        {
-            cairo_text_extents_t count_lane_te;
-            cairo_text_extents(rendering_context, count_lane, &count_lane_te);
-
-            float text_y_pos;
-            float rect_y_pos;
+        MultiLaneLine *line = &system->lines[line_id];
 
-            if (!system->line1_direction)
-            {
-                // Below the lane
-                rect_y_pos = mid_y + arrow_size;
-                text_y_pos = mid_y + arrow_size + count_lane_te.height + 5;
-            }
-            else
-            {
-                // Above the lane
-                rect_y_pos = mid_y - arrow_size - count_lane_te.height - 10;
-                text_y_pos = mid_y - arrow_size - 5;
-            }
-
-            // Draw text with semi-transparent background
-            cairo_set_source_rgba(rendering_context, 0.0, 0.0, 0.0, 0.5); // Semi-transparent black background
-            cairo_rectangle(rendering_context,
-                            mid_x - count_lane_te.width / 2 - 5,
-                            rect_y_pos,
-                            count_lane_te.width + 10,
-                            count_lane_te.height + 10);
-            cairo_fill(rendering_context);
-
-            cairo_set_source_rgb(rendering_context, 1, 1, 1); // White text
-            cairo_move_to(rendering_context,
-                          mid_x - count_lane_te.width / 2,
-                          text_y_pos);
-            cairo_show_text(rendering_context, count_lane);
-            free(count_lane);
-        }
-    }
-
-    // Draw second line if enabled - same approach as above
-    if (system->use_second_line)
-    {
-        for (int i = 0; i < system->line2.num_lanes; i++)
+        for (int i = 0; i < line->num_lanes; i++)
         {
             cairo_set_source_rgb(rendering_context, normal_color[0], normal_color[1], normal_color[2]);
 
@@ -757,52 +591,53 @@ void draw_counting_line(cairo_t *rendering_context,
             for (int j = i; j <= i + 1; j++)
             {
                 // Skip drawing if BOTH x AND y are close to 0
-                if (fabs(system->line2.points[j].x) < EPSILON && fabs(system->line2.points[j].y) < EPSILON)
+                if (fabs(line->points[j].x) < EPSILON && fabs(line->points[j].y) < EPSILON)
                     continue;
 
                 cairo_arc(rendering_context,
-                          system->line2.points[j].x * width,
-                          system->line2.points[j].y * height,
+                          line->points[j].x * width,
+                          line->points[j].y * height,
                           5.0, 0, 2 * G_PI);
                 cairo_fill(rendering_context);
             }
 
             // Check if any counting occurred in this lane recently
-            bool lane_counting = system->line2.timestamps[i] > 0 &&
-                                 (g_get_monotonic_time() - system->line2.timestamps[i]) < 250000;
+            bool lane_counting = line->timestamps[i] > 0 &&
+                                 (g_get_monotonic_time() - line->timestamps[i]) < 250000; // 250ms blink
 
+            // Set color based on counting state
             if (lane_counting)
             {
                 cairo_set_source_rgb(rendering_context, active_color[0], active_color[1], active_color[2]);
             }
 
             // Skip drawing line segment if both end points have x and y close to 0
-            if ((fabs(system->line2.points[i].x) < EPSILON && fabs(system->line2.points[i].y) < EPSILON) ||
-                (fabs(system->line2.points[i + 1].x) < EPSILON && fabs(system->line2.points[i + 1].y) < EPSILON))
+            if ((fabs(line->points[i].x) < EPSILON && fabs(line->points[i].y) < EPSILON) ||
+                (fabs(line->points[i + 1].x) < EPSILON && fabs(line->points[i + 1].y) < EPSILON))
             {
                 continue;
             }
 
             // Draw line segment
             cairo_move_to(rendering_context,
-                          system->line2.points[i].x * width,
-                          system->line2.points[i].y * height);
+                          line->points[i].x * width,
+                          line->points[i].y * height);
             cairo_line_to(rendering_context,
-                          system->line2.points[i + 1].x * width,
-                          system->line2.points[i + 1].y * height);
+                          line->points[i + 1].x * width,
+                          line->points[i + 1].y * height);
             cairo_stroke(rendering_context);
 
             // Draw arrow below the line
-            float mid_x = (system->line2.points[i].x + system->line2.points[i + 1].x) * width / 2;
-            float mid_y = (system->line2.points[i].y + system->line2.points[i + 1].y) * height / 2;
+            float mid_x = (line->points[i].x + line->points[i + 1].x) * width / 2;
+            float mid_y = (line->points[i].y + line->points[i + 1].y) * height / 2;
             float arrow_size = line_width * 5;
 
             // Calculate the angle of the line segment
-            float dx = system->line2.points[i + 1].x - system->line2.points[i].x;
-            float dy = system->line2.points[i + 1].y - system->line2.points[i].y;
+            float dx = line->points[i + 1].x - line->points[i].x;
+            float dy = line->points[i + 1].y - line->points[i].y;
 
             // Reverse the direction if needed
-            if (!system->line2_direction)
+            if (!line->direction)
             {
                 dx = -dx;
                 dy = -dy;
@@ -830,20 +665,14 @@ void draw_counting_line(cairo_t *rendering_context,
             cairo_line_to(rendering_context, right_x, right_y);
             cairo_stroke(rendering_context);
 
-            // Get total count for this lane
-            int lane_total = 0;
-            for (int class_id = 0; class_id < system->num_classes; class_id++)
-            {
-                int up_count = 0, down_count = 0;
-                get_lane_counts(system, LINE_2, class_id, i, &up_count, &down_count);
-                lane_total += up_count + down_count;
-            }
+            // Get total count for this lane (sum all classes)
+            int lane_total = get_lane_total(system, line_id, i);
 
-            // Display count based on line2_direction
-            cairo_set_source_rgb(rendering_context, 1, 1, 1);
+            // Display count based on the line direction
+            cairo_set_source_rgb(rendering_context, 1, 1, 1); // White text
             cairo_select_font_face(rendering_context, "serif", CAIRO_FONT_SLANT_NORMAL,
                                    CAIRO_FONT_WEIGHT_BOLD);
-            cairo_set_font_size(rendering_context, height * 7 / 200);
+            cairo_set_font_size(rendering_context, height * 7 / 200); // Slightly larger text
 
             char *count_lane = NULL;
             int lane_result = asprintf(&count_lane, "%d", lane_total);
@@ -852,11 +681,10 @@ void draw_counting_line(cairo_t *rendering_context,
                 cairo_text_extents_t count_lane_te;
                 cairo_text_extents(rendering_context, count_lane, &count_lane_te);
 
-                // Position based on line2_direction
                 float text_y_pos;
                 float rect_y_pos;
 
-                if (!system->line2_direction)
+                if (!line->direction)
                 {
                     // Below the lane
                     rect_y_pos = mid_y + arrow_size;
@@ -870,7 +698,7 @@ void draw_counting_line(cairo_t *rendering_context,
                 }
 
                 // Draw text with semi-transparent background
-                cairo_set_source_rgba(rendering_context, 0.0, 0.0, 0.0, 0.5);
+                cairo_set_source_rgba(rendering_context, 0.0, 0.0, 0.0, 0.5); // Semi-transparent black background
                 cairo_rectangle(rendering_context,
                                 mid_x - count_lane_te.width / 2 - 5,
                                 rect_y_pos,
@@ -878,7 +706,7 @@ void draw_counting_line(cairo_t *rendering_context,
                                 count_lane_te.height + 10);
                 cairo_fill(rendering_context);
 
-                cairo_set_source_rgb(rendering_context, 1, 1, 1);
+                cairo_set_source_rgb(rendering_context, 1, 1, 1); // White text
                 cairo_move_to(rendering_context,
                               mid_x - count_lane_te.width / 2,
                               text_y_pos);
@@ -0,0 +1,64 @@
+#include <pthread.h>
+
+#include "pathlog.h"
+
+typedef struct
+{
+    int track_id;
+    int class_id;
+    CompactPath path;
+} FinishedPath;
+
+// Ring of ended tracks, written by the tracker and read from the FastCGI thread
+static FinishedPath finished_paths[FINISHED_PATHS];
+static int next_finished = 0;   // Slot the next path goes to
+static int num_finished = 0;    // Slots in use
+static pthread_mutex_t finished_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void record_finished_path(int track_id, int class_id, const CompactPath *path)
+{
+    if (!path)
+        return;
+
+    pthread_mutex_lock(&finished_mutex);
+    FinishedPath *entry = &finished_paths[next_finished];
+    entry->track_id = track_id;
+    entry->class_id = class_id;
+    entry->path = *path;
+    next_finished = (next_finished + 1) % FINISHED_PATHS;
+    if (num_finished < FINISHED_PATHS)
+        num_finished++;
+    pthread_mutex_unlock(&finished_mutex);
+}
+
+// Oldest first, each path as its id, class and [x, y] points in normalized coordinates
+json_t *finished_paths_to_json(void)
+{
+    json_t *paths = json_array();
+    float xy[2 * PATH_MAX_POINTS];
+
+    pthread_mutex_lock(&finished_mutex);
+    for (int k = 0; k < num_finished; k++)
+    {
+        const FinishedPath *entry = &finished_paths[(next_finished - num_finished + k + FINISHED_PATHS) % FINISHED_PATHS];
+        int count = decode_compact_path(&entry->path, xy, PATH_MAX_POINTS);
+
+        json_t *points = json_array();
+        for (int i = 0; i < count; i++)
+        {
+            json_t *point = json_array();
+            json_array_append_new(point, json_real(xy[2 * i]));
+            json_array_append_new(point, json_real(xy[2 * i + 1]));
+            json_array_append_new(points, point);
+        }
+
+        json_t *path = json_object();
+        json_object_set_new(path, "id", json_integer(entry->track_id));
+        json_object_set_new(path, "class", json_integer(entry->class_id));
+        json_object_set_new(path, "points", points);
+        json_array_append_new(paths, path);
+    }
+    pthread_mutex_unlock(&finished_mutex);
+
+    return paths;
+}
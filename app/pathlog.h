@@ -0,0 +1,12 @@
+#pragma once
+
+#include <jansson.h>
+
+#include "trajectory.h"
+
+#define FINISHED_PATHS 64          // Paths of ended tracks kept for the API
+
+// Paths of the last FINISHED_PATHS confirmed tracks that ended, recorded when the tracker
+// deletes them and served decoded by the API as track_paths
+void record_finished_path(int track_id, int class_id, const CompactPath* path);
+json_t* finished_paths_to_json(void);
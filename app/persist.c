@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "persist.h"
+
+#define APPEND_OFFSET -1     // Write job adds to the end of the file
+#define REPLACE_OFFSET -2    // Write job replaces the whole file atomically
+
+// One file known to the writer
+typedef struct
+{
+    char filename[PERSIST_PATH_LENGTH];
+    json_t *pending;     // Newest snapshot not written yet, NULL when up to date
+    guint64 hash;        // Hash of the content on disk
+    bool hash_known;     // False until the file was written or read back once
+} PersistFile;
+
+// Bytes to add to the end of a file or to put at an offset, kept in the order they were queued
+typedef struct WriteJob
+{
+    char filename[PERSIST_PATH_LENGTH];
+    off_t offset;        // Position to write at, APPEND_OFFSET or REPLACE_OFFSET
+    bool truncate;       // Start the file over before appending
+    size_t length;
+    struct WriteJob *next;
+    unsigned char data[];
+} WriteJob;
+
+static PersistFile files[PERSIST_MAX_FILES];
+static int num_files = 0;
+static int num_pending = 0;
+
+static WriteJob *write_head = NULL;
+static WriteJob *write_tail = NULL;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static bool writer_running = false;
+
+// 64-bit FNV-1a, only used to tell whether content changed
+static guint64 hash_content(const char *data, size_t length)
+{
+    guint64 hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t persist_crc32(const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+// Make the rename itself durable
+static void sync_parent_directory(const char *filename)
+{
+    char *dir = g_path_get_dirname(filename);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    g_free(dir);
+}
+
+bool write_file_atomic(const char *filename, const char *data, size_t length)
+{
+    if (!filename || !data)
+        return false;
+
+    char tmp_filename[PERSIST_PATH_LENGTH + 8];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s: %s", tmp_filename, strerror(errno));
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(fd, data + written, length - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to write %s: %s", tmp_filename, strerror(errno));
+            close(fd);
+            unlink(tmp_filename);
+            return false;
+        }
+        written += (size_t)result;
+    }
+
+    if (fsync(fd) != 0 || close(fd) != 0)
+    {
+        syslog(LOG_ERR, "Failed to flush %s: %s", tmp_filename, strerror(errno));
+        unlink(tmp_filename);
+        return false;
+    }
+
+    if (rename(tmp_filename, filename) != 0)
+    {
+        syslog(LOG_ERR, "Failed to replace %s: %s", filename, strerror(errno));
+        unlink(tmp_filename);
+        return false;
+    }
+
+    sync_parent_directory(filename);
+    return true;
+}
+
+// Serialize a snapshot and write it unless the file already holds the same bytes
+static void write_snapshot(PersistFile *file, json_t *json)
+{
+    char *data = json_dumps(json, JSON_COMPACT | JSON_ENSURE_ASCII);
+    json_decref(json);
+    if (!data)
+    {
+        syslog(LOG_ERR, "Failed to serialize %s", file->filename);
+        return;
+    }
+
+    size_t length = strlen(data);
+    guint64 hash = hash_content(data, length);
+
+    if (!file->hash_known)
+    {
+        // First snapshot since start, compare against what survived the restart
+        gchar *existing = NULL;
+        gsize existing_length = 0;
+        if (g_file_get_contents(file->filename, &existing, &existing_length, NULL))
+        {
+            file->hash = hash_content(existing, existing_length);
+            file->hash_known = true;
+            g_free(existing);
+        }
+    }
+
+    if (!file->hash_known || file->hash != hash)
+    {
+        if (write_file_atomic(file->filename, data, length))
+        {
+            file->hash = hash;
+            file->hash_known = true;
+        }
+    }
+
+    free(data);
+}
+
+static bool append_file(const char *filename, const void *data, size_t length, bool truncate)
+{
+    int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_APPEND);
+    int fd = open(filename, flags, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s: %s", filename, strerror(errno));
+        return false;
+    }
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(fd, bytes + written, length - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to append to %s: %s", filename, strerror(errno));
+            close(fd);
+            return false;
+        }
+        written += (size_t)result;
+    }
+
+    bool result = (fdatasync(fd) == 0);
+    close(fd);
+    return result;
+}
+
+static bool write_file_at(const char *filename, off_t offset, const void *data, size_t length)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s: %s", filename, strerror(errno));
+        return false;
+    }
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = pwrite(fd, bytes + written, length - written, offset + (off_t)written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to write %s: %s", filename, strerror(errno));
+            close(fd);
+            return false;
+        }
+        written += (size_t)result;
+    }
+
+    bool result = (fdatasync(fd) == 0);
+    close(fd);
+    return result;
+}
+
+static void *writer_thread_func(void *arg)
+{
+    (void)arg;
+    json_t *batch[PERSIST_MAX_FILES];
+
+    pthread_mutex_lock(&writer_mutex);
+    while (writer_running || num_pending > 0 || write_head)
+    {
+        if (num_pending == 0 && !write_head)
+        {
+            pthread_cond_wait(&writer_cond, &writer_mutex);
+            continue;
+        }
+
+        WriteJob *jobs = write_head;
+        write_head = write_tail = NULL;
+
+        // Take every pending snapshot, later ones for the same file replace it meanwhile
+        int count = num_files;
+        for (int i = 0; i < count; i++)
+        {
+            batch[i] = files[i].pending;
+            files[i].pending = NULL;
+        }
+        num_pending = 0;
+        pthread_mutex_unlock(&writer_mutex);
+
+        // Only the writer thread touches hashes, so the lock is not needed here
+        for (int i = 0; i < count; i++)
+        {
+            if (batch[i])
+                write_snapshot(&files[i], batch[i]);
+        }
+
+        while (jobs)
+        {
+            WriteJob *next = jobs->next;
+            if (jobs->offset >= 0)
+                write_file_at(jobs->filename, jobs->offset, jobs->data, jobs->length);
+            else if (jobs->offset == REPLACE_OFFSET)
+                write_file_atomic(jobs->filename, (const char *)jobs->data, jobs->length);
+            else
+                append_file(jobs->filename, jobs->data, jobs->length, jobs->truncate);
+            free(jobs);
+            jobs = next;
+        }
+
+        pthread_mutex_lock(&writer_mutex);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    return NULL;
+}
+
+bool init_persist(void)
+{
+    pthread_mutex_lock(&writer_mutex);
+    if (writer_running)
+    {
+        pthread_mutex_unlock(&writer_mutex);
+        return true;
+    }
+    writer_running = true;
+    pthread_mutex_unlock(&writer_mutex);
+
+    if (pthread_create(&writer_thread, NULL, writer_thread_func, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create persistence thread, writing in place");
+        pthread_mutex_lock(&writer_mutex);
+        writer_running = false;
+        pthread_mutex_unlock(&writer_mutex);
+        return false;
+    }
+    return true;
+}
+
+static PersistFile *find_file(const char *filename)
+{
+    for (int i = 0; i < num_files; i++)
+    {
+        if (strcmp(files[i].filename, filename) == 0)
+            return &files[i];
+    }
+
+    if (num_files == PERSIST_MAX_FILES || strlen(filename) >= PERSIST_PATH_LENGTH)
+        return NULL;
+
+    PersistFile *file = &files[num_files++];
+    memset(file, 0, sizeof(PersistFile));
+    strcpy(file->filename, filename);
+    return file;
+}
+
+// Queue a snapshot for writing, takes over the reference to json. A snapshot
+// still waiting for the same file is dropped in favour of the new one.
+bool persist_json(const char *filename, json_t *json)
+{
+    if (!filename || !json)
+    {
+        json_decref(json);
+        return false;
+    }
+
+    pthread_mutex_lock(&writer_mutex);
+    PersistFile *file = writer_running ? find_file(filename) : NULL;
+    if (file)
+    {
+        if (file->pending)
+            json_decref(file->pending);
+        else
+            num_pending++;
+        file->pending = json;
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_mutex);
+        return true;
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    // No writer thread or no free slot, write from the caller
+    char *data = json_dumps(json, JSON_COMPACT | JSON_ENSURE_ASCII);
+    json_decref(json);
+    if (!data)
+        return false;
+
+    bool result = write_file_atomic(filename, data, strlen(data));
+    free(data);
+    return result;
+}
+
+static bool queue_write(const char *filename, off_t offset, const void *data, size_t length, bool truncate)
+{
+    if (!filename || !data || strlen(filename) >= PERSIST_PATH_LENGTH)
+        return false;
+
+    WriteJob *job = (WriteJob *)malloc(sizeof(WriteJob) + length);
+    if (!job)
+        return false;
+
+    strcpy(job->filename, filename);
+    job->offset = offset;
+    job->truncate = truncate;
+    job->length = length;
+    job->next = NULL;
+    memcpy(job->data, data, length);
+
+    pthread_mutex_lock(&writer_mutex);
+    if (!writer_running)
+    {
+        // No writer thread, write from the caller
+        pthread_mutex_unlock(&writer_mutex);
+        bool result;
+        if (offset >= 0)
+            result = write_file_at(filename, offset, data, length);
+        else if (offset == REPLACE_OFFSET)
+            result = write_file_atomic(filename, (const char *)data, length);
+        else
+            result = append_file(filename, data, length, truncate);
+        free(job);
+        return result;
+    }
+
+    if (write_tail)
+        write_tail->next = job;
+    else
+        write_head = job;
+    write_tail = job;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+    return true;
+}
+
+// Queue bytes for the end of a file, or for a fresh file when truncate is set.
+// Appends are never merged and reach the file in the order they were queued.
+bool persist_append(const char *filename, const void *data, size_t length, bool truncate)
+{
+    return queue_write(filename, APPEND_OFFSET, data, length, truncate);
+}
+
+// Queue bytes to replace a file atomically, in order with the appends and slot writes
+bool persist_replace(const char *filename, const void *data, size_t length)
+{
+    return queue_write(filename, REPLACE_OFFSET, data, length, false);
+}
+
+// Queue bytes for a fixed position in a file, for files made of fixed-size slots
+bool persist_write_at(const char *filename, off_t offset, const void *data, size_t length)
+{
+    if (offset < 0)
+        return false;
+    return queue_write(filename, offset, data, length, false);
+}
+
+// Write out everything still queued and stop the writer thread
+void stop_persist(void)
+{
+    pthread_mutex_lock(&writer_mutex);
+    if (!writer_running)
+    {
+        pthread_mutex_unlock(&writer_mutex);
+        return;
+    }
+    writer_running = false;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+
+    pthread_join(writer_thread, NULL);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <jansson.h>
+
+#define PERSIST_MAX_FILES 32        // Distinct files the writer keeps track of
+#define PERSIST_PATH_LENGTH 256
+
+// Background writer for the files under localdata. Callers hand over a finished
+// JSON snapshot and return at once, the writer thread serializes it, skips it when
+// the content matches what is already on disk and replaces the file atomically.
+// Append-only logs, fixed-slot files and binary snapshots queue raw bytes instead,
+// written in order with fdatasync.
+bool init_persist(void);
+bool persist_json(const char* filename, json_t* json);
+bool persist_append(const char* filename, const void* data, size_t length, bool truncate);
+bool persist_replace(const char* filename, const void* data, size_t length);
+bool persist_write_at(const char* filename, off_t offset, const void* data, size_t length);
+void stop_persist(void);
+
+// Replace a file with temp file, fsync and rename, usable from any thread
+bool write_file_atomic(const char* filename, const char* data, size_t length);
+
+// CRC-32 (IEEE) for checksummed records in binary files
+uint32_t persist_crc32(const void* data, size_t length);
@@ -0,0 +1,167 @@
+#include <math.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "queue.h"
+#include "event.h"
+#include "incident.h"
+#include "roi.h"
+
+// Queue of one ROI, the axis is kept as a start point and a scaled direction
+// so projecting a point is one dot product
+typedef struct
+{
+    QueueAxis axis;
+    float dir_x, dir_y;     // Axis direction divided by its squared length
+    float raw;              // Meters measured in the last frame
+    int vehicles;           // Queued vehicles in the last frame
+    double smoothed;        // Meters after smoothing
+    gint64 updated_us;      // Monotonic time of the last frame
+    float sent;             // Meters in the last event
+    gint64 sent_us;         // Monotonic time of the last event, 0 before the first
+    double vehicle_sum;     // Vehicles in the ROI summed over the frames since the density was taken
+    int frames;
+} QueueState;
+
+static QueueState queues[MAX_QUEUE_ROIS];
+
+void set_queue_axis(int roi_index, const QueueAxis *axis)
+{
+    if (roi_index < 1 || roi_index > MAX_QUEUE_ROIS || !axis)
+        return;
+
+    QueueState *queue = &queues[roi_index - 1];
+    memset(queue, 0, sizeof(QueueState));
+    queue->axis = *axis;
+
+    float dx = axis->end_x - axis->start_x;
+    float dy = axis->end_y - axis->start_y;
+    float length_sq = dx * dx + dy * dy;
+    if (length_sq < 1e-6f || axis->length <= 0)
+    {
+        queue->axis.enabled = false;
+        return;
+    }
+
+    queue->dir_x = dx / length_sq;
+    queue->dir_y = dy / length_sq;
+}
+
+// Furthest point of a box along the axis, 0 at the stop line and 1 at the far end
+static float get_box_reach(const QueueState *queue, const float *bbox)
+{
+    float reach = 0.0f;
+    for (int corner = 0; corner < 4; corner++)
+    {
+        float x = (corner & 1) ? bbox[3] : bbox[1];
+        float y = (corner & 2) ? bbox[2] : bbox[0];
+        float s = (x - queue->axis.start_x) * queue->dir_x + (y - queue->axis.start_y) * queue->dir_y;
+        reach = fmaxf(reach, s);
+    }
+    return fminf(reach, 1.0f);
+}
+
+// Send the smoothed length when it has moved far enough and the last event is old enough
+static void send_queue_event(int roi_index, QueueState *queue, gint64 now_us)
+{
+    float length = (float)queue->smoothed;
+    if (queue->sent_us > 0 &&
+        (now_us - queue->sent_us < (gint64)QUEUE_EVENT_SECONDS * G_USEC_PER_SEC ||
+         fabsf(length - queue->sent) < QUEUE_EVENT_STEP))
+        return;
+
+    send_event_queue(app_data_queue, roi_index, length, queue->vehicles);
+    queue->sent = length;
+    queue->sent_us = now_us;
+}
+
+// Called once per frame. Each track seen this frame is put in the first ROI it is in,
+// and the queue reaches to the rear of the furthest slow vehicle along the ROI axis.
+// A NULL tracker means nothing is in view.
+void update_queues(const Tracker *tracker)
+{
+    float reach[MAX_QUEUE_ROIS] = {0};
+    int vehicles[MAX_QUEUE_ROIS] = {0};
+    int in_roi[MAX_QUEUE_ROIS] = {0};
+    Polygon *rois[MAX_QUEUE_ROIS] = {roi1, roi2};
+
+    bool any = false;
+    for (int r = 0; r < MAX_QUEUE_ROIS; r++)
+        any = any || (queues[r].axis.enabled && rois[r]);
+    if (!any)
+        return;
+
+    for (int t = 0; tracker && t < tracker->count; t++)
+    {
+        const TrackedObject *obj = &tracker->objects[t];
+        if (obj->time_since_update > 0 || obj->hits < tracker->min_hits || !is_vehicle(obj->class_id))
+            continue;
+
+        for (int r = 0; r < MAX_QUEUE_ROIS; r++)
+        {
+            if (!rois[r] || !is_in_roi((float *)obj->bbox, rois[r]))
+                continue;
+
+            in_roi[r]++;
+            if (queues[r].axis.enabled && obj->speed_kmh < QUEUE_SPEED_KMH)
+            {
+                reach[r] = fmaxf(reach[r], get_box_reach(&queues[r], obj->bbox));
+                vehicles[r]++;
+            }
+            break;
+        }
+    }
+
+    gint64 now_us = g_get_monotonic_time();
+    for (int r = 0; r < MAX_QUEUE_ROIS; r++)
+    {
+        QueueState *queue = &queues[r];
+        if (!queue->axis.enabled || !rois[r])
+            continue;
+
+        queue->raw = reach[r] * queue->axis.length;
+        queue->vehicles = vehicles[r];
+        queue->vehicle_sum += in_roi[r];
+        queue->frames++;
+
+        // Exponential smoothing by elapsed time, so the response does not follow the frame rate
+        if (queue->updated_us == 0)
+        {
+            queue->smoothed = queue->raw;
+        }
+        else
+        {
+            double alpha = 1.0 - exp(-(now_us - queue->updated_us) / (QUEUE_SMOOTHING_SECONDS * G_USEC_PER_SEC));
+            queue->smoothed += alpha * (queue->raw - queue->smoothed);
+        }
+        queue->updated_us = now_us;
+
+        send_queue_event(r + 1, queue, now_us);
+    }
+}
+
+// Smoothed queue of a ROI in meters, 0 when it has no axis
+float get_queue_length(int roi_index)
+{
+    if (roi_index < 1 || roi_index > MAX_QUEUE_ROIS || !queues[roi_index - 1].axis.enabled)
+        return 0.0f;
+
+    return (float)queues[roi_index - 1].smoothed;
+}
+
+// Mean vehicles per kilometer of the ROI axis since the last call, which starts the next
+// average. False when the ROI has no axis or no frame was seen.
+bool take_roi_density(int roi_index, float *density)
+{
+    if (roi_index < 1 || roi_index > MAX_QUEUE_ROIS || !density)
+        return false;
+
+    QueueState *queue = &queues[roi_index - 1];
+    bool valid = queue->axis.enabled && queue->frames > 0;
+    if (valid)
+        *density = (float)(queue->vehicle_sum / queue->frames / (queue->axis.length / 1000.0));
+
+    queue->vehicle_sum = 0.0;
+    queue->frames = 0;
+    return valid;
+}
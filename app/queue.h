@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "deepsort.h"
+
+#define MAX_QUEUE_ROIS 2              // One queue per ROI, roi1 and roi2
+#define QUEUE_SPEED_KMH 5.0f          // Vehicles slower than this are standing in the queue
+#define QUEUE_SMOOTHING_SECONDS 3.0   // Time constant of the smoothed queue length
+#define QUEUE_EVENT_SECONDS 5         // Shortest time between two queue events of a ROI
+#define QUEUE_EVENT_STEP 1.0f         // Meters the queue has to change by to be sent again
+
+// Axis a queue is measured along, from the stop line to the far end of the ROI
+typedef struct {
+    bool enabled;
+    float start_x, start_y;  // Stop line end, normalized
+    float end_x, end_y;
+    float length;            // Real-world meters between the two ends
+} QueueAxis;
+
+void set_queue_axis(int roi_index, const QueueAxis* axis);
+void update_queues(const Tracker* tracker);
+float get_queue_length(int roi_index);
+bool take_roi_density(int roi_index, float* density);
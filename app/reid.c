@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "reid.h"
+#include "detection.h"
+#include "fastcgi.h"
+
+#define REID_MAX_BATCH 16  // Upper bound on crops per job, whatever the model batch size is
+
+static bool reid_enabled = false;
+static larodConnection *reid_conn = NULL;
+static larodModel *reid_model = NULL;
+static larodTensor **reid_inputs = NULL;
+static size_t reid_num_inputs = 0;
+static larodTensor **reid_outputs = NULL;
+static size_t reid_num_outputs = 0;
+static larodJobRequest *reid_request = NULL;
+
+static void *reid_input_addr = MAP_FAILED;
+static size_t reid_input_size = 0;
+static int reid_input_fd = -1;
+static void *reid_output_addr = MAP_FAILED;
+static size_t reid_output_size = 0;
+static int reid_output_fd = -1;
+
+static int reid_batch = 0;
+static int reid_height = 0;
+static int reid_width = 0;
+static int reid_dim = 0;
+
+// Track index behind each slot of the packed crop tensor
+static int batch_tracks[REID_MAX_BATCH];
+
+bool is_reid_enabled(void)
+{
+    return reid_enabled;
+}
+
+bool init_reid(larodConnection *conn, const char *chip_string, const char *model_file)
+{
+    larodError *error = NULL;
+
+    int model_fd = open(model_file, O_RDONLY);
+    if (model_fd < 0)
+    {
+        syslog(LOG_INFO, "No ReID model at %s, re-identification disabled", model_file);
+        return false;
+    }
+
+    const larodDevice *dev = larodGetDevice(conn, chip_string, 0, &error);
+    reid_model = larodLoadModel(conn, model_fd, dev, LAROD_ACCESS_PRIVATE, "enixma_reid", NULL, &error);
+    close(model_fd);
+    if (!reid_model)
+    {
+        syslog(LOG_ERR, "Unable to load ReID model: %s", error ? error->msg : "unknown error");
+        goto error;
+    }
+    reid_conn = conn;
+
+    reid_inputs = larodCreateModelInputs(reid_model, &reid_num_inputs, &error);
+    reid_outputs = larodCreateModelOutputs(reid_model, &reid_num_outputs, &error);
+    if (!reid_inputs || !reid_outputs || reid_num_inputs != 1 || reid_num_outputs != 1)
+    {
+        syslog(LOG_ERR, "ReID model must have exactly one input and one output tensor");
+        goto error;
+    }
+
+    // Input is a packed NHWC uint8 crop tensor, output one float embedding per crop
+    const larodTensorDims *in_dims = larodGetTensorDims(reid_inputs[0], &error);
+    const larodTensorDims *out_dims = larodGetTensorDims(reid_outputs[0], &error);
+    if (!in_dims || !out_dims || in_dims->len != 4 || in_dims->dims[3] != 3 || out_dims->len != 2 ||
+        out_dims->dims[0] != in_dims->dims[0])
+    {
+        syslog(LOG_ERR, "Unsupported ReID tensor layout");
+        goto error;
+    }
+    if (larodGetTensorDataType(reid_inputs[0], &error) != LAROD_TENSOR_DATA_TYPE_UINT8 ||
+        larodGetTensorDataType(reid_outputs[0], &error) != LAROD_TENSOR_DATA_TYPE_FLOAT32)
+    {
+        syslog(LOG_ERR, "ReID model must take uint8 crops and produce float32 embeddings");
+        goto error;
+    }
+    if (out_dims->dims[1] > REID_EMBEDDING_DIM)
+    {
+        syslog(LOG_ERR, "ReID embedding size %zu exceeds %d", out_dims->dims[1], REID_EMBEDDING_DIM);
+        goto error;
+    }
+
+    reid_batch = (int)in_dims->dims[0];
+    reid_height = (int)in_dims->dims[1];
+    reid_width = (int)in_dims->dims[2];
+    reid_dim = (int)out_dims->dims[1];
+    if (reid_batch > REID_MAX_BATCH)
+        reid_batch = REID_MAX_BATCH;
+
+    const larodTensorPitches *in_pitches = larodGetTensorPitches(reid_inputs[0], &error);
+    const larodTensorPitches *out_pitches = larodGetTensorPitches(reid_outputs[0], &error);
+    if (!in_pitches || !out_pitches)
+    {
+        syslog(LOG_ERR, "Could not get pitches of ReID tensors");
+        goto error;
+    }
+    reid_input_size = in_pitches->pitches[0];
+    reid_output_size = out_pitches->pitches[0];
+
+    char input_pattern[] = "/tmp/larod.reid.in-XXXXXX";
+    char output_pattern[] = "/tmp/larod.reid.out-XXXXXX";
+    if (!createAndMapTmpFile(input_pattern, reid_input_size, &reid_input_addr, &reid_input_fd) ||
+        !createAndMapTmpFile(output_pattern, reid_output_size, &reid_output_addr, &reid_output_fd))
+    {
+        goto error;
+    }
+
+    if (!larodSetTensorFd(reid_inputs[0], reid_input_fd, &error) ||
+        !larodSetTensorFd(reid_outputs[0], reid_output_fd, &error))
+    {
+        syslog(LOG_ERR, "Failed setting ReID tensor fd: %s", error ? error->msg : "unknown error");
+        goto error;
+    }
+
+    reid_request = larodCreateJobRequest(reid_model, reid_inputs, reid_num_inputs,
+                                         reid_outputs, reid_num_outputs, NULL, &error);
+    if (!reid_request)
+    {
+        syslog(LOG_ERR, "Failed creating ReID job request: %s", error ? error->msg : "unknown error");
+        goto error;
+    }
+
+    syslog(LOG_INFO, "ReID enabled: %d crops of %dx%d per job, %d-d embeddings",
+           reid_batch, reid_width, reid_height, reid_dim);
+    reid_enabled = true;
+    return true;
+
+error:
+    if (error)
+        larodClearError(&error);
+    free_reid();
+    return false;
+}
+
+// Nearest-neighbour resize of a bbox from the HD RGB frame into one slot of the crop tensor
+static void pack_crop(const unsigned char *frame, const float *bbox, int slot)
+{
+    int frame_width = (int)context.resolution.widthFrameHD;
+    int frame_height = (int)context.resolution.heightFrameHD;
+
+    int left = (int)(bbox[1] * frame_width);
+    int top = (int)(bbox[0] * frame_height);
+    int right = (int)(bbox[3] * frame_width);
+    int bottom = (int)(bbox[2] * frame_height);
+
+    if (left < 0)
+        left = 0;
+    if (top < 0)
+        top = 0;
+    if (right > frame_width)
+        right = frame_width;
+    if (bottom > frame_height)
+        bottom = frame_height;
+    if (right <= left)
+        right = left + 1;
+    if (bottom <= top)
+        bottom = top + 1;
+
+    int crop_width = right - left;
+    int crop_height = bottom - top;
+    unsigned char *dst = (unsigned char *)reid_input_addr + (size_t)slot * reid_width * reid_height * 3;
+
+    for (int y = 0; y < reid_height; y++)
+    {
+        int sy = top + y * crop_height / reid_height;
+        if (sy >= frame_height)
+            sy = frame_height - 1;
+        const unsigned char *src_row = frame + (size_t)sy * frame_width * 3;
+
+        for (int x = 0; x < reid_width; x++)
+        {
+            int sx = left + x * crop_width / reid_width;
+            if (sx >= frame_width)
+                sx = frame_width - 1;
+            memcpy(dst, src_row + sx * 3, 3);
+            dst += 3;
+        }
+    }
+}
+
+static void normalize_embedding(float *embedding)
+{
+    float norm = 0.0f;
+    for (int k = 0; k < reid_dim; k++)
+        norm += embedding[k] * embedding[k];
+
+    norm = sqrtf(norm);
+    if (norm < EPSILON)
+        return;
+
+    for (int k = 0; k < reid_dim; k++)
+        embedding[k] /= norm;
+}
+
+// Average a fresh embedding into the track's appearance
+static void store_embedding(TrackedObject *obj, const float *embedding)
+{
+    for (int k = 0; k < reid_dim; k++)
+    {
+        obj->embedding[k] = obj->has_embedding ? 0.5f * (obj->embedding[k] + embedding[k]) : embedding[k];
+    }
+    normalize_embedding(obj->embedding);
+    obj->has_embedding = true;
+}
+
+static float cosine_distance(const float *a, const float *b)
+{
+    float dot = 0.0f;
+    for (int k = 0; k < reid_dim; k++)
+        dot += a[k] * b[k];
+    return 1.0f - dot;
+}
+
+// Find the lost track that a freshly seen tentative track most likely belongs to
+static int find_lost_track(Tracker *tracker, TrackedObject *tentative)
+{
+    int best = -1;
+    float best_cost = REID_MAX_COST;
+
+    for (int i = 0; i < tracker->count; i++)
+    {
+        TrackedObject *lost = &tracker->objects[i];
+        if (lost->time_since_update == 0 || lost->time_since_update > tracker->max_age ||
+            lost->hits < tracker->min_hits || !lost->has_embedding)
+            continue;
+
+        // Constant-velocity prediction of where the lost track should be by now
+        float shift_x = lost->velocity[0] * lost->time_since_update;
+        float shift_y = lost->velocity[1] * lost->time_since_update;
+        float predicted[4] = {lost->bbox[0] + shift_y, lost->bbox[1] + shift_x,
+                              lost->bbox[2] + shift_y, lost->bbox[3] + shift_x};
+
+        float dx = (predicted[1] + predicted[3] - tentative->bbox[1] - tentative->bbox[3]) / 2.0f;
+        float dy = (predicted[0] + predicted[2] - tentative->bbox[0] - tentative->bbox[2]) / 2.0f;
+        if (dx * dx + dy * dy > REID_MAX_CENTER_DISTANCE * REID_MAX_CENTER_DISTANCE)
+            continue;
+
+        float appearance = cosine_distance(lost->embedding, tentative->embedding);
+        if (appearance > REID_MAX_COSINE_DISTANCE)
+            continue;
+
+        float iou = calculate_iou(tentative->bbox, predicted);
+        float cost = REID_APPEARANCE_WEIGHT * appearance + (1.0f - REID_APPEARANCE_WEIGHT) * (1.0f - iou);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Hand the tentative track's latest observation to the lost track and retire the tentative one
+static void merge_into_lost_track(Tracker *tracker, TrackedObject *lost, TrackedObject *tentative,
+                                  int64_t frame_time_us)
+{
+    memcpy(lost->bbox, tentative->bbox, 4 * sizeof(float));
+    lost->score = tentative->score;
+    lost->class_id = tentative->class_id;
+    lost->hits += tentative->hits;
+    lost->time_since_update = 0;
+    lost->counted = lost->counted || tentative->counted;
+
+    Point *last = &tentative->trajectory[tentative->trajectory_count - 1];
+    add_speed_sample(lost, last->x, last->y, frame_time_us, pixels_per_meter,
+                     context.resolution.widthFrameHD, context.resolution.heightFrameHD);
+    add_trajectory_point(lost, last->x, last->y);
+    store_embedding(lost, tentative->embedding);
+
+    tentative->time_since_update = tracker->max_age + 1;
+}
+
+// Run one batched ReID job per frame over the crops of tentative tracks seen this frame,
+// then re-attach those that look like a recently lost track. Confirmed tracks are only
+// embedded until they have an appearance, which bounds the job to a few crops per frame.
+void update_reid(Tracker *tracker, int64_t frame_time_us)
+{
+    larodError *error = NULL;
+
+    if (!reid_enabled || !tracker || context.addresses.ppOutputAddrHD == MAP_FAILED)
+        return;
+
+    const unsigned char *frame = (const unsigned char *)context.addresses.ppOutputAddrHD;
+    int batch_count = 0;
+
+    for (int i = 0; i < tracker->count && batch_count < reid_batch; i++)
+    {
+        TrackedObject *obj = &tracker->objects[i];
+        if (obj->time_since_update != 0)
+            continue;
+        if (obj->hits >= tracker->min_hits && obj->has_embedding)
+            continue;
+
+        pack_crop(frame, obj->bbox, batch_count);
+        batch_tracks[batch_count++] = i;
+    }
+
+    if (batch_count == 0)
+        return;
+
+    if (lseek(reid_input_fd, 0, SEEK_SET) == -1 || lseek(reid_output_fd, 0, SEEK_SET) == -1)
+    {
+        syslog(LOG_ERR, "Unable to rewind ReID tensor files: %s", strerror(errno));
+        return;
+    }
+
+    if (!larodRunJob(reid_conn, reid_request, &error))
+    {
+        syslog(LOG_ERR, "Unable to run ReID job: %s (%d)", error->msg, error->code);
+        larodClearError(&error);
+        return;
+    }
+
+    const float *embeddings = (const float *)reid_output_addr;
+    for (int b = 0; b < batch_count; b++)
+    {
+        float embedding[REID_EMBEDDING_DIM];
+        memcpy(embedding, embeddings + (size_t)b * reid_dim, sizeof(float) * reid_dim);
+        normalize_embedding(embedding);
+        store_embedding(&tracker->objects[batch_tracks[b]], embedding);
+    }
+
+    bool merged = false;
+    for (int b = 0; b < batch_count; b++)
+    {
+        TrackedObject *tentative = &tracker->objects[batch_tracks[b]];
+        if (tentative->hits >= tracker->min_hits)
+            continue;
+
+        int lost = find_lost_track(tracker, tentative);
+        if (lost >= 0)
+        {
+            // syslog(LOG_INFO, "ReID: track %d continues as lost track %d",
+            //        tentative->track_id, tracker->objects[lost].track_id);
+            merge_into_lost_track(tracker, &tracker->objects[lost], tentative, frame_time_us);
+            merged = true;
+        }
+    }
+
+    if (merged)
+        compact_tracker(tracker);
+}
+
+void free_reid(void)
+{
+    reid_enabled = false;
+
+    if (reid_request)
+        larodDestroyJobRequest(&reid_request);
+    if (reid_inputs)
+        larodDestroyTensors(reid_conn, &reid_inputs, reid_num_inputs, NULL);
+    if (reid_outputs)
+        larodDestroyTensors(reid_conn, &reid_outputs, reid_num_outputs, NULL);
+    if (reid_model)
+        larodDestroyModel(&reid_model);
+
+    if (reid_input_addr != MAP_FAILED)
+        munmap(reid_input_addr, reid_input_size);
+    if (reid_output_addr != MAP_FAILED)
+        munmap(reid_output_addr, reid_output_size);
+    if (reid_input_fd >= 0)
+        close(reid_input_fd);
+    if (reid_output_fd >= 0)
+        close(reid_output_fd);
+
+    reid_input_addr = MAP_FAILED;
+    reid_output_addr = MAP_FAILED;
+    reid_input_fd = -1;
+    reid_output_fd = -1;
+    reid_conn = NULL;
+}
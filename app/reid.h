@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "larod.h"
+#include "deepsort.h"
+
+// Optional appearance model, re-identification is off when the file is missing
+#define REID_MODEL_FILE "/usr/local/packages/enixma_analytic/model/reid_model.tflite"
+
+#define REID_APPEARANCE_WEIGHT 0.7f     // Share of cosine distance in the association cost
+#define REID_MAX_COSINE_DISTANCE 0.3f   // Appearance gate for re-identifying a lost track
+#define REID_MAX_COST 0.5f              // Blended cost above which no re-identification happens
+#define REID_MAX_CENTER_DISTANCE 0.25f  // Motion gate, normalized distance from the predicted box
+
+bool init_reid(larodConnection* conn, const char* chip_string, const char* model_file);
+bool is_reid_enabled(void);
+void update_reid(Tracker* tracker, int64_t frame_time_us);
+void free_reid(void);
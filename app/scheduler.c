@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+#define ALIGNED_SLACK_MS 50   // Fire this long after a boundary so time() is already past it
+
+typedef struct
+{
+    const char *name;
+    guint period_seconds;
+    bool aligned;
+    ScheduledJobFunc func;
+    gpointer user_data;
+    gint64 due_us;        // Monotonic due time of fixed-rate jobs
+    guint source_id;
+} ScheduledJob;
+
+static ScheduledJob jobs[MAX_SCHEDULED_JOBS];
+static int num_jobs = 0;
+
+// Milliseconds from now until the job is next due
+static guint get_next_delay_ms(ScheduledJob *job)
+{
+    if (job->aligned)
+    {
+        // Recomputed from the wall clock every time so clock steps and DST are followed
+        gint64 now_us = g_get_real_time();
+        time_t now = (time_t)(now_us / G_USEC_PER_SEC);
+        struct tm local_time;
+        localtime_r(&now, &local_time);
+
+        gint64 local_us = now_us + (gint64)local_time.tm_gmtoff * G_USEC_PER_SEC;
+        gint64 period_us = (gint64)job->period_seconds * G_USEC_PER_SEC;
+        gint64 next_us = (local_us / period_us + 1) * period_us;
+        return (guint)((next_us - local_us) / 1000) + ALIGNED_SLACK_MS;
+    }
+
+    // Fixed rate, skipping runs that were missed instead of bunching them up
+    gint64 now_us = g_get_monotonic_time();
+    job->due_us += (gint64)job->period_seconds * G_USEC_PER_SEC;
+    if (job->due_us <= now_us)
+        job->due_us = now_us + (gint64)job->period_seconds * G_USEC_PER_SEC;
+    return (guint)((job->due_us - now_us) / 1000);
+}
+
+static gboolean run_job(gpointer user_data)
+{
+    ScheduledJob *job = (ScheduledJob *)user_data;
+
+    job->func(job->user_data);
+
+    // One-shot source re-armed each time, so every delay is taken from the clock afresh
+    job->source_id = g_timeout_add(get_next_delay_ms(job), run_job, job);
+    return G_SOURCE_REMOVE;
+}
+
+bool schedule_job(const char *name, guint period_seconds, bool aligned, ScheduledJobFunc func, gpointer user_data)
+{
+    if (!func || period_seconds == 0)
+        return false;
+
+    if (num_jobs == MAX_SCHEDULED_JOBS)
+    {
+        syslog(LOG_ERR, "No room to schedule %s", name ? name : "job");
+        return false;
+    }
+
+    ScheduledJob *job = &jobs[num_jobs++];
+    memset(job, 0, sizeof(ScheduledJob));
+    job->name = name;
+    job->period_seconds = period_seconds;
+    job->aligned = aligned;
+    job->func = func;
+    job->user_data = user_data;
+    job->due_us = g_get_monotonic_time();
+
+    job->source_id = g_timeout_add(get_next_delay_ms(job), run_job, job);
+    return true;
+}
+
+// Remove every job, for shutdown before the data they work on is freed
+void stop_scheduler(void)
+{
+    for (int i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].source_id > 0)
+            g_source_remove(jobs[i].source_id);
+        jobs[i].source_id = 0;
+    }
+    num_jobs = 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#define MAX_SCHEDULED_JOBS 16
+
+typedef void (*ScheduledJobFunc)(gpointer user_data);
+
+// Periodic jobs run from the GLib main loop between frames, never from process_frame().
+// Aligned jobs fire just after each multiple of their period in local time (every full
+// minute, hour, midnight), the others at a fixed rate from when they were added.
+bool schedule_job(const char* name, guint period_seconds, bool aligned, ScheduledJobFunc func, gpointer user_data);
+void stop_scheduler(void);
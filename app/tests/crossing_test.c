@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "counting.h"
+
+// Checks that test_line_crossings gives the same crossed and down masks as the scalar
+// reference, and times both. Build with "make crossing_test" and run it on the camera,
+// a build without NEON compares the scalar path with itself.
+
+#define NUM_LINES 200
+#define MOVES_PER_LINE 1000
+#define BENCH_ROUNDS 20
+#define MAX_REPORTED 10
+
+static MultiLaneLine lines[NUM_LINES];
+static Point from[NUM_LINES][MOVES_PER_LINE];
+static Point to[NUM_LINES][MOVES_PER_LINE];
+
+static float random_unit(void)
+{
+    return rand() / (float)RAND_MAX;
+}
+
+static void set_point(Point *p, float x, float y)
+{
+    p->x = x;
+    p->y = y;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Line of 1 to MAX_LANES lanes, a third of them horizontal and a third vertical
+static void random_line(MultiLaneLine *line)
+{
+    memset(line, 0, sizeof(MultiLaneLine));
+    line->num_lanes = 1 + rand() % MAX_LANES;
+    line->num_points = line->num_lanes + 1;
+
+    int shape = rand() % 3;
+    for (int i = 0; i < line->num_points; i++)
+    {
+        line->points[i].x = shape == 2 && i > 0 ? line->points[0].x : random_unit();
+        line->points[i].y = shape == 1 && i > 0 ? line->points[0].y : random_unit();
+    }
+    update_line_geometry(line);
+}
+
+// Movements across, onto and along a lane, through a vertex, standing still and anywhere
+static void random_move(const MultiLaneLine *line, Point *p1, Point *p2)
+{
+    int lane = rand() % line->num_lanes;
+    const LinePoint *a = &line->points[lane];
+    const LinePoint *b = &line->points[lane + 1];
+    float f = random_unit();
+    float on_x = a->x + (b->x - a->x) * f;
+    float on_y = a->y + (b->y - a->y) * f;
+    float dx = (random_unit() - 0.5f) * 0.05f;
+    float dy = (random_unit() - 0.5f) * 0.05f;
+
+    switch (rand() % 6)
+    {
+    case 0:
+        set_point(p1, on_x - dx, on_y - dy);
+        set_point(p2, on_x + dx, on_y + dy);
+        break;
+    case 1:
+        set_point(p1, on_x - dx, on_y - dy);
+        set_point(p2, on_x, on_y);
+        break;
+    case 2:
+        set_point(p1, b->x - dx, b->y - dy);
+        set_point(p2, b->x, b->y);
+        break;
+    case 3:
+        set_point(p1, on_x, on_y);
+        set_point(p2, on_x + (b->x - a->x) * 0.1f, on_y + (b->y - a->y) * 0.1f);
+        break;
+    case 4:
+        set_point(p1, on_x, on_y);
+        set_point(p2, on_x, on_y);
+        break;
+    default:
+        set_point(p1, random_unit(), random_unit());
+        set_point(p2, p1->x + dx, p1->y + dy);
+        break;
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    for (int l = 0; l < NUM_LINES; l++)
+    {
+        random_line(&lines[l]);
+        for (int m = 0; m < MOVES_PER_LINE; m++)
+            random_move(&lines[l], &from[l][m], &to[l][m]);
+    }
+
+    long crossings = 0;
+    long mismatches = 0;
+    for (int l = 0; l < NUM_LINES; l++)
+    {
+        for (int m = 0; m < MOVES_PER_LINE; m++)
+        {
+            unsigned int down, down_scalar;
+            unsigned int crossed = test_line_crossings(&lines[l], &from[l][m], &to[l][m], &down);
+            unsigned int crossed_scalar = test_line_crossings_scalar(&lines[l], &from[l][m], &to[l][m], &down_scalar);
+
+            crossings += crossed_scalar != 0;
+            if (crossed == crossed_scalar && down == down_scalar)
+                continue;
+
+            if (mismatches++ < MAX_REPORTED)
+            {
+                printf("line %d move %d (%.9g, %.9g) -> (%.9g, %.9g): crossed %#x/%#x down %#x/%#x\n", l, m,
+                       from[l][m].x, from[l][m].y, to[l][m].x, to[l][m].y, crossed, crossed_scalar, down, down_scalar);
+            }
+        }
+    }
+
+    // Same movements again for the timing, the sink keeps the calls from being optimized out
+    volatile unsigned int sink = 0;
+    double start = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        for (int l = 0; l < NUM_LINES; l++)
+            for (int m = 0; m < MOVES_PER_LINE; m++)
+                sink ^= test_line_crossings(&lines[l], &from[l][m], &to[l][m], NULL);
+    double middle = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        for (int l = 0; l < NUM_LINES; l++)
+            for (int m = 0; m < MOVES_PER_LINE; m++)
+                sink ^= test_line_crossings_scalar(&lines[l], &from[l][m], &to[l][m], NULL);
+    double end = now_ns();
+
+    double calls = (double)BENCH_ROUNDS * NUM_LINES * MOVES_PER_LINE;
+    printf("%d movements, %ld crossing a lane, %ld mismatches\n", NUM_LINES * MOVES_PER_LINE, crossings, mismatches);
+    printf("test_line_crossings %.1f ns, scalar %.1f ns per movement\n", (middle - start) / calls, (end - middle) / calls);
+#if !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+    printf("Built without NEON, both runs used the scalar path\n");
+#endif
+
+    return mismatches == 0 ? 0 : 1;
+}
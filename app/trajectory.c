@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "trajectory.h"
+
+// Normalized coordinate to Q15, clamped to the frame
+static int32_t to_fixed(float value)
+{
+    if (value < 0.0f)
+        value = 0.0f;
+    if (value > 1.0f)
+        value = 1.0f;
+    return (int32_t)(value * PATH_SCALE + 0.5f);
+}
+
+// Halve the number of vertices by merging every pair of deltas. Consecutive
+// deltas sum to the difference of two in-frame points, so they never overflow.
+static void thin_compact_path(CompactPath *path)
+{
+    int write = 0;
+    for (int read = 0; read < path->count; read += 2)
+    {
+        int32_t dx = path->dx[read];
+        int32_t dy = path->dy[read];
+        if (read + 1 < path->count)
+        {
+            dx += path->dx[read + 1];
+            dy += path->dy[read + 1];
+        }
+        path->dx[write] = (int16_t)dx;
+        path->dy[write] = (int16_t)dy;
+        write++;
+    }
+    path->count = write;
+}
+
+void init_compact_path(CompactPath *path, float x, float y)
+{
+    memset(path, 0, sizeof(CompactPath));
+    path->anchor_x = path->tail_x = to_fixed(x);
+    path->anchor_y = path->tail_y = to_fixed(y);
+    path->start_x = (int16_t)path->anchor_x;
+    path->start_y = (int16_t)path->anchor_y;
+}
+
+// Add a point, dropping the provisional vertex while the path through it stays
+// within PATH_MAX_DEVIATION of a straight line and turns less than the angle threshold
+void append_compact_path(CompactPath *path, float x, float y)
+{
+    int32_t nx = to_fixed(x);
+    int32_t ny = to_fixed(y);
+
+    if (nx == path->tail_x && ny == path->tail_y)
+        return;
+
+    if (path->count > 0)
+    {
+        // Chord from the anchor to the new point, and the provisional vertex relative to the anchor
+        float cx = (float)(nx - path->anchor_x);
+        float cy = (float)(ny - path->anchor_y);
+        float tx = (float)(path->tail_x - path->anchor_x);
+        float ty = (float)(path->tail_y - path->anchor_y);
+        float ux = (float)(nx - path->tail_x);
+        float uy = (float)(ny - path->tail_y);
+
+        float chord = sqrtf(cx * cx + cy * cy);
+        float deviation = chord > 0.0f ? fabsf(cx * ty - cy * tx) / chord : sqrtf(tx * tx + ty * ty);
+
+        float tail_len = sqrtf(tx * tx + ty * ty);
+        float step_len = sqrtf(ux * ux + uy * uy);
+        float turn_cos = (tail_len > 0.0f && step_len > 0.0f) ? (tx * ux + ty * uy) / (tail_len * step_len) : 1.0f;
+
+        if (deviation <= PATH_MAX_DEVIATION * PATH_SCALE && turn_cos >= PATH_MAX_TURN_COS)
+        {
+            // Still straight, slide the provisional vertex forward
+            path->dx[path->count - 1] = (int16_t)(nx - path->anchor_x);
+            path->dy[path->count - 1] = (int16_t)(ny - path->anchor_y);
+            path->tail_x = nx;
+            path->tail_y = ny;
+            return;
+        }
+
+        // Provisional vertex is a real corner, fix it in place
+        path->anchor_x = path->tail_x;
+        path->anchor_y = path->tail_y;
+    }
+
+    if (path->count == PATH_CAPACITY)
+    {
+        thin_compact_path(path);
+    }
+
+    path->dx[path->count] = (int16_t)(nx - path->anchor_x);
+    path->dy[path->count] = (int16_t)(ny - path->anchor_y);
+    path->count++;
+    path->tail_x = nx;
+    path->tail_y = ny;
+}
+
+// Expand the path into interleaved normalized x,y pairs, returns the number of points written
+int decode_compact_path(const CompactPath *path, float *xy, int max_points)
+{
+    if (max_points <= 0)
+        return 0;
+
+    int32_t x = path->start_x;
+    int32_t y = path->start_y;
+    xy[0] = x / PATH_SCALE;
+    xy[1] = y / PATH_SCALE;
+
+    int written = 1;
+    for (int i = 0; i < path->count && written < max_points; i++)
+    {
+        x += path->dx[i];
+        y += path->dy[i];
+        xy[2 * written] = x / PATH_SCALE;
+        xy[2 * written + 1] = y / PATH_SCALE;
+        written++;
+    }
+    return written;
+}
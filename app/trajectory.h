@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PATH_CAPACITY 96           // Vertices a compact path can hold before it is thinned
+#define PATH_SCALE 32767.0f        // Q15 fixed point for normalized (0-1) coordinates
+#define PATH_MAX_DEVIATION 0.004f  // Simplification tolerance, normalized units
+#define PATH_MAX_TURN_COS 0.985f   // Cosine of the smallest turn (~10 degrees) kept as a vertex
+#define PATH_MAX_POINTS (PATH_CAPACITY + 1)  // Points a decoded path can have
+
+// Whole entry-to-exit path of a track as int16 deltas between simplified vertices.
+// The last vertex is provisional and moves along while the path stays straight.
+typedef struct {
+    int16_t start_x, start_y;      // First vertex, Q15
+    int16_t dx[PATH_CAPACITY];     // Delta from the previous vertex, Q15
+    int16_t dy[PATH_CAPACITY];
+    int count;                     // Deltas in use
+    int32_t anchor_x, anchor_y;    // Last fixed vertex, Q15
+    int32_t tail_x, tail_y;        // Provisional last vertex, Q15
+} CompactPath;
+
+void init_compact_path(CompactPath* path, float x, float y);
+void append_compact_path(CompactPath* path, float x, float y);
+int decode_compact_path(const CompactPath* path, float* xy, int max_points);
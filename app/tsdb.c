@@ -0,0 +1,309 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsdb.h"
+#include "persist.h"
+
+// Slot length and ring size of a resolution
+typedef struct
+{
+    const char *name;
+    const char *filename;
+    int seconds;
+    int slots;
+} TsdbTierInfo;
+
+static const TsdbTierInfo tiers[TSDB_NUM_TIERS] = {
+    {"minute", TSDB_PATH "/tsdb_minute.bin", 60, 1440},   // One day
+    {"15min", TSDB_PATH "/tsdb_15min.bin", 900, 1344},    // Two weeks
+    {"hour", TSDB_PATH "/tsdb_hour.bin", 3600, 1440},     // Sixty days
+    {"day", TSDB_PATH "/tsdb_day.bin", 86400, 730}        // Two years
+};
+
+// Slots still being filled, the minute takes the counts and is rolled up when it closes
+static TsdbSlot current[TSDB_NUM_TIERS];
+static bool current_dirty[TSDB_NUM_TIERS];
+static bool tsdb_ready = false;
+
+// Slots follow local time so hours and days line up with the clock on the wall
+static gint64 local_offset(gint64 t)
+{
+    time_t when = (time_t)t;
+    struct tm local;
+    localtime_r(&when, &local);
+    return local.tm_gmtoff;
+}
+
+static gint64 get_slot_start(int tier, gint64 t)
+{
+    gint64 offset = local_offset(t);
+    gint64 local = t + offset;
+    return local - local % tiers[tier].seconds - offset;
+}
+
+static off_t get_slot_offset(int tier, gint64 start)
+{
+    gint64 index = (start + local_offset(start)) / tiers[tier].seconds;
+    return (off_t)(index % tiers[tier].slots) * (off_t)sizeof(TsdbSlot);
+}
+
+static guint32 get_slot_crc(const TsdbSlot *slot)
+{
+    return persist_crc32(slot, offsetof(TsdbSlot, crc));
+}
+
+static void clear_slot(TsdbSlot *slot, gint64 start)
+{
+    memset(slot, 0, sizeof(TsdbSlot));
+    slot->start = start;
+}
+
+// Read a slot back, false when it is missing, damaged or belongs to another period
+static bool read_slot(int fd, int tier, gint64 start, TsdbSlot *slot)
+{
+    if (fd < 0)
+        return false;
+
+    ssize_t result = pread(fd, slot, sizeof(TsdbSlot), get_slot_offset(tier, start));
+    return result == (ssize_t)sizeof(TsdbSlot) && slot->start == start && slot->crc == get_slot_crc(slot);
+}
+
+static void write_slot(int tier)
+{
+    TsdbSlot *slot = &current[tier];
+    slot->crc = get_slot_crc(slot);
+    if (!persist_write_at(tiers[tier].filename, get_slot_offset(tier, slot->start), slot, sizeof(TsdbSlot)))
+        syslog(LOG_ERR, "Failed to queue slot for %s", tiers[tier].filename);
+    current_dirty[tier] = false;
+}
+
+// Add part to total, or take it back out with sign -1
+static void add_slot(TsdbSlot *total, const TsdbSlot *part, int sign)
+{
+    for (int c = 0; c < MAX_SPEED_CLASSES; c++)
+    {
+        total->class_counts[c] += (guint32)sign * part->class_counts[c];
+        total->class_speed_sums[c] += sign * part->class_speed_sums[c];
+    }
+    for (int l = 0; l < MAX_COUNTING_LINES; l++)
+    {
+        for (int lane = 0; lane < MAX_LANES; lane++)
+        {
+            total->lanes[l][lane].count += (guint32)sign * part->lanes[l][lane].count;
+            total->lanes[l][lane].pcu += sign * part->lanes[l][lane].pcu;
+            total->lanes[l][lane].speed_sum += sign * part->lanes[l][lane].speed_sum;
+        }
+    }
+}
+
+// Pick up the slots of the running periods so a restart does not lose them
+bool init_tsdb(void)
+{
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+    for (int tier = 0; tier < TSDB_NUM_TIERS; tier++)
+    {
+        gint64 start = get_slot_start(tier, now);
+        int fd = open(tiers[tier].filename, O_RDONLY);
+        if (!read_slot(fd, tier, start, &current[tier]))
+            clear_slot(&current[tier], start);
+        if (fd >= 0)
+            close(fd);
+        current_dirty[tier] = false;
+    }
+
+    // A minute written at shutdown is already rolled up, take it back out of the
+    // coarser slots since it is rolled up again, with the new counts, when it closes
+    TsdbSlot *minute = &current[TSDB_MINUTE];
+    for (int tier = TSDB_QUARTER; tier < TSDB_NUM_TIERS; tier++)
+    {
+        if (current[tier].start == get_slot_start(tier, minute->start))
+            add_slot(&current[tier], minute, -1);
+    }
+    current_dirty[TSDB_MINUTE] = true;
+
+    tsdb_ready = true;
+    return true;
+}
+
+// Close the minute when the clock has moved on and roll it up into the coarser slots
+static void roll_minute(gint64 now)
+{
+    gint64 minute_start = get_slot_start(TSDB_MINUTE, now);
+    if (current[TSDB_MINUTE].start == minute_start)
+        return;
+
+    TsdbSlot *minute = &current[TSDB_MINUTE];
+    bool has_data = current_dirty[TSDB_MINUTE];
+    if (has_data)
+        write_slot(TSDB_MINUTE);
+
+    for (int tier = TSDB_QUARTER; tier < TSDB_NUM_TIERS; tier++)
+    {
+        gint64 start = get_slot_start(tier, minute->start);
+        if (current[tier].start != start)
+            clear_slot(&current[tier], start);
+
+        if (has_data)
+        {
+            add_slot(&current[tier], minute, 1);
+            write_slot(tier);
+        }
+
+        // Open the next period once the minute that closed was its last one
+        gint64 next_start = get_slot_start(tier, now);
+        if (current[tier].start != next_start)
+            clear_slot(&current[tier], next_start);
+    }
+
+    clear_slot(minute, minute_start);
+}
+
+void add_tsdb_count(int class_id, int line_id, int lane, float pcu, float speed)
+{
+    if (!tsdb_ready)
+        return;
+
+    roll_minute(g_get_real_time() / G_USEC_PER_SEC);
+
+    TsdbSlot *minute = &current[TSDB_MINUTE];
+    if (class_id >= 0 && class_id < MAX_SPEED_CLASSES)
+    {
+        minute->class_counts[class_id]++;
+        minute->class_speed_sums[class_id] += speed;
+    }
+    if (line_id >= 0 && line_id < MAX_COUNTING_LINES && lane >= 0 && lane < MAX_LANES)
+    {
+        TsdbCell *cell = &minute->lanes[line_id][lane];
+        cell->count++;
+        cell->pcu += pcu;
+        cell->speed_sum += speed;
+    }
+    current_dirty[TSDB_MINUTE] = true;
+}
+
+// Called about once a second, closes the minute even when nothing is counted
+void update_tsdb(void)
+{
+    if (tsdb_ready)
+        roll_minute(g_get_real_time() / G_USEC_PER_SEC);
+}
+
+// Write the minute in progress at shutdown, the coarser slots get it rolled in
+void flush_tsdb(void)
+{
+    if (!tsdb_ready || !current_dirty[TSDB_MINUTE])
+        return;
+
+    roll_minute(current[TSDB_MINUTE].start + tiers[TSDB_MINUTE].seconds);
+}
+
+int get_tsdb_tier(const char *name)
+{
+    if (!name)
+        return -1;
+
+    for (int tier = 0; tier < TSDB_NUM_TIERS; tier++)
+    {
+        if (strcmp(name, tiers[tier].name) == 0)
+            return tier;
+    }
+    return -1;
+}
+
+// One point of a query, summed over the requested line and lane
+static json_t *slot_to_json(const TsdbSlot *slot, gint64 start, int line_id, int lane)
+{
+    guint32 count = 0;
+    double pcu = 0.0;
+    double speed_sum = 0.0;
+
+    for (int l = 0; l < MAX_COUNTING_LINES; l++)
+    {
+        if (line_id >= 0 && l != line_id)
+            continue;
+        for (int k = 0; k < MAX_LANES; k++)
+        {
+            if (lane >= 0 && k != lane)
+                continue;
+            count += slot->lanes[l][k].count;
+            pcu += slot->lanes[l][k].pcu;
+            speed_sum += slot->lanes[l][k].speed_sum;
+        }
+    }
+
+    json_t *point = json_object();
+    json_object_set_new(point, "t", json_integer(start));
+    json_object_set_new(point, "count", json_integer(count));
+    json_object_set_new(point, "pcu", json_real(pcu));
+    json_object_set_new(point, "speed", json_real(count > 0 ? speed_sum / count : 0.0));
+
+    // Classes are kept for the whole site only
+    if (line_id < 0)
+    {
+        json_t *classes = json_array();
+        for (int c = 0; c < MAX_SPEED_CLASSES; c++)
+        {
+            json_array_append_new(classes, json_integer(slot->class_counts[c]));
+        }
+        json_object_set_new(point, "classes", classes);
+    }
+    return point;
+}
+
+// Every slot of a tier between from and to (epoch seconds), empty periods as zeros.
+// Runs on the FastCGI thread and only reads the files.
+json_t *query_tsdb(int tier, gint64 from, gint64 to, int line_id, int lane)
+{
+    if (tier < 0 || tier >= TSDB_NUM_TIERS || to < from)
+        return NULL;
+
+    const TsdbTierInfo *info = &tiers[tier];
+
+    // Nothing older than the ring is left
+    gint64 oldest = to - (gint64)info->seconds * (info->slots - 1);
+    if (from < oldest)
+        from = oldest;
+
+    int fd = open(info->filename, O_RDONLY);
+
+    json_t *result = json_object();
+    json_t *points = json_array();
+    json_object_set_new(result, "tier", json_string(info->name));
+    json_object_set_new(result, "step", json_integer(info->seconds));
+
+    TsdbSlot slot;
+    TsdbSlot empty;
+    gint64 start = get_slot_start(tier, from);
+    int num_points = 0;
+
+    for (; start <= to && num_points < TSDB_MAX_POINTS; num_points++)
+    {
+        if (!read_slot(fd, tier, start, &slot))
+        {
+            clear_slot(&empty, start);
+            json_array_append_new(points, slot_to_json(&empty, start, line_id, lane));
+        }
+        else
+        {
+            json_array_append_new(points, slot_to_json(&slot, start, line_id, lane));
+        }
+
+        // Step through the middle of the next slot so days stay aligned across DST changes
+        start = get_slot_start(tier, start + info->seconds + info->seconds / 2);
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    json_object_set_new(result, "from", json_integer(get_slot_start(tier, from)));
+    json_object_set_new(result, "truncated", json_boolean(start <= to));
+    json_object_set_new(result, "points", points);
+    return result;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "counting.h"
+
+#define TSDB_PATH "/usr/local/packages/enixma_analytic/localdata"
+#define TSDB_MAX_POINTS 1500        // Most points one range query returns
+
+// Resolutions kept on flash, each a ring of fixed-size slots in its own file
+typedef enum
+{
+    TSDB_MINUTE = 0,
+    TSDB_QUARTER,
+    TSDB_HOUR,
+    TSDB_DAY,
+    TSDB_NUM_TIERS
+} TsdbTier;
+
+// Counted objects, PCU and speed sum of one lane during one slot
+typedef struct {
+    guint32 count;
+    float pcu;
+    float speed_sum;
+} TsdbCell;
+
+// One slot as stored on flash. The checksum covers everything before it.
+typedef struct {
+    gint64 start;                                   // Local-aligned epoch seconds, 0 when unused
+    guint32 class_counts[MAX_SPEED_CLASSES];
+    float class_speed_sums[MAX_SPEED_CLASSES];
+    TsdbCell lanes[MAX_COUNTING_LINES][MAX_LANES];
+    guint32 crc;
+} TsdbSlot;
+
+bool init_tsdb(void);
+void add_tsdb_count(int class_id, int line_id, int lane, float pcu, float speed);
+void update_tsdb(void);
+void flush_tsdb(void);
+
+int get_tsdb_tier(const char* name);
+json_t* query_tsdb(int tier, gint64 from, gint64 to, int line_id, int lane);
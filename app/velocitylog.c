@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "velocitylog.h"
+#include "persist.h"
+
+#define BLOCK_MAGIC 0x31424C56u      // "VLB1"
+#define BLOCK_HEADER_SIZE 20         // magic, count, payload length, base time, CRC-32
+#define BLOCK_MAX_PAYLOAD (VELOCITY_BLOCK_RECORDS * 14)
+#define POSITION_UNKNOWN 0xFF        // Line/lane byte of a record counted on no lane
+#define MS_PER_HOUR 3600000LL
+
+#if MAX_COUNTING_LINES > 8 || MAX_LANES > 32 || (MAX_COUNTING_LINES == 8 && MAX_LANES == 32)
+#error "Line and lane must fit the line/lane byte of the velocity log"
+#endif
+
+// Records not sealed into a block yet
+typedef struct
+{
+    gint64 time_ms[VELOCITY_BLOCK_RECORDS];
+    guint16 speed[VELOCITY_BLOCK_RECORDS];
+    guint8 class_id[VELOCITY_BLOCK_RECORDS];
+    guint8 position[VELOCITY_BLOCK_RECORDS];
+    int count;
+    gint64 opened_us;    // Monotonic time the first record arrived
+} OpenBlock;
+
+static OpenBlock open_block;
+
+// Hour since the epoch whose file was last written, -1 before the first block
+static gint64 log_hour = -1;
+
+static void put_u16(guint8 *p, guint16 value)
+{
+    p[0] = (guint8)value;
+    p[1] = (guint8)(value >> 8);
+}
+
+static void put_u32(guint8 *p, guint32 value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (guint8)(value >> (8 * i));
+}
+
+static void put_u64(guint8 *p, guint64 value)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (guint8)(value >> (8 * i));
+}
+
+static guint16 get_u16(const guint8 *p)
+{
+    return (guint16)(p[0] | (p[1] << 8));
+}
+
+static guint32 get_u32(const guint8 *p)
+{
+    guint32 value = 0;
+    for (int i = 3; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static guint64 get_u64(const guint8 *p)
+{
+    guint64 value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static void get_log_filename(gint64 hour, char *filename, size_t size)
+{
+    snprintf(filename, size, VELOCITY_LOG_FORMAT, (int)(hour % 24));
+}
+
+// Encode the open block into buffer, returns the number of bytes used
+static size_t encode_block(guint8 *buffer)
+{
+    const OpenBlock *block = &open_block;
+    guint8 *payload = buffer + BLOCK_HEADER_SIZE;
+    guint8 *p = payload;
+
+    // Time column, zigzag varint of the change between consecutive gaps
+    gint64 prev_time = block->time_ms[0];
+    gint64 prev_delta = 0;
+    for (int i = 1; i < block->count; i++)
+    {
+        gint64 delta = block->time_ms[i] - prev_time;
+        gint64 dod = delta - prev_delta;
+        guint64 zigzag = ((guint64)dod << 1) ^ (guint64)(dod >> 63);
+        while (zigzag >= 0x80)
+        {
+            *p++ = (guint8)(zigzag | 0x80);
+            zigzag >>= 7;
+        }
+        *p++ = (guint8)zigzag;
+        prev_time = block->time_ms[i];
+        prev_delta = delta;
+    }
+
+    for (int i = 0; i < block->count; i++)
+    {
+        put_u16(p, block->speed[i]);
+        p += 2;
+    }
+    memcpy(p, block->class_id, block->count);
+    p += block->count;
+    memcpy(p, block->position, block->count);
+    p += block->count;
+
+    size_t payload_length = (size_t)(p - payload);
+    put_u32(buffer, BLOCK_MAGIC);
+    put_u16(buffer + 4, (guint16)block->count);
+    put_u16(buffer + 6, (guint16)payload_length);
+    put_u64(buffer + 8, (guint64)block->time_ms[0]);
+    put_u32(buffer + 16, persist_crc32(payload, payload_length));
+
+    return BLOCK_HEADER_SIZE + payload_length;
+}
+
+// Seal the open block and queue it for the file of its hour
+static void seal_block(void)
+{
+    if (open_block.count == 0)
+        return;
+
+    static guint8 buffer[BLOCK_HEADER_SIZE + BLOCK_MAX_PAYLOAD];
+    size_t length = encode_block(buffer);
+
+    gint64 hour = open_block.time_ms[0] / MS_PER_HOUR;
+    char filename[PERSIST_PATH_LENGTH];
+    get_log_filename(hour, filename, sizeof(filename));
+
+    // The first block of an hour replaces what the file held a day ago
+    if (!persist_append(filename, buffer, length, hour != log_hour))
+        syslog(LOG_ERR, "Failed to queue velocity block for %s", filename);
+
+    log_hour = hour;
+    open_block.count = 0;
+}
+
+bool append_velocity_log(gint64 time_ms, float velocity, int class_id, int line_id, int lane)
+{
+    OpenBlock *block = &open_block;
+
+    // Blocks never span two hour files
+    if (block->count == VELOCITY_BLOCK_RECORDS ||
+        (block->count > 0 && time_ms / MS_PER_HOUR != block->time_ms[0] / MS_PER_HOUR))
+        seal_block();
+
+    if (block->count == 0)
+        block->opened_us = g_get_monotonic_time();
+
+    float scaled = velocity * VELOCITY_SPEED_SCALE + 0.5f;
+    if (scaled < 0.0f)
+        scaled = 0.0f;
+    if (scaled > 65535.0f)
+        scaled = 65535.0f;
+
+    int i = block->count++;
+    block->time_ms[i] = time_ms;
+    block->speed[i] = (guint16)scaled;
+    block->class_id[i] = (class_id >= 0 && class_id < 255) ? (guint8)class_id : 255;
+    block->position[i] = (line_id >= 0 && line_id < MAX_COUNTING_LINES && lane >= 0 && lane < MAX_LANES)
+                             ? (guint8)((line_id << 5) | lane)
+                             : POSITION_UNKNOWN;
+    return true;
+}
+
+// Seal the open block when it has waited long enough, or right away when forced
+void flush_velocity_log(bool force)
+{
+    if (open_block.count == 0)
+        return;
+
+    if (force || g_get_monotonic_time() - open_block.opened_us >= (gint64)VELOCITY_BLOCK_SECONDS * G_USEC_PER_SEC)
+        seal_block();
+}
+
+// Decode one block payload and replay its records, false when the columns do not add up
+static bool replay_block(CountingSystem *system, const guint8 *payload, size_t payload_length,
+                         int count, gint64 base_ms, gint64 now_ms, int *restored)
+{
+    const guint8 *p = payload;
+    const guint8 *end = payload + payload_length;
+
+    gint64 time_ms[VELOCITY_BLOCK_RECORDS];
+    time_ms[0] = base_ms;
+    gint64 prev_delta = 0;
+    for (int i = 1; i < count; i++)
+    {
+        guint64 zigzag = 0;
+        int shift = 0;
+        while (true)
+        {
+            if (p == end || shift > 63)
+                return false;
+            guint8 byte = *p++;
+            zigzag |= (guint64)(byte & 0x7F) << shift;
+            shift += 7;
+            if (!(byte & 0x80))
+                break;
+        }
+        gint64 dod = (gint64)(zigzag >> 1) ^ -(gint64)(zigzag & 1);
+        prev_delta += dod;
+        time_ms[i] = time_ms[i - 1] + prev_delta;
+    }
+
+    if ((size_t)(end - p) != (size_t)count * 4)
+        return false;
+
+    const guint8 *speeds = p;
+    const guint8 *classes = speeds + 2 * count;
+    const guint8 *positions = classes + count;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (time_ms[i] > now_ms)
+            continue;
+
+        float velocity = get_u16(speeds + 2 * i) / VELOCITY_SPEED_SCALE;
+        int class_id = classes[i] == 255 ? -1 : classes[i];
+        int line_id = positions[i] == POSITION_UNKNOWN ? -1 : positions[i] >> 5;
+        int lane = positions[i] == POSITION_UNKNOWN ? -1 : positions[i] & 0x1F;
+
+        restore_velocity_record(system, time_ms[i], velocity, class_id, line_id, lane);
+        (*restored)++;
+    }
+    return true;
+}
+
+// Stream the blocks of one hour file, skipping damaged bytes up to the next valid block.
+// Returns true when the file holds blocks of that hour.
+static bool replay_log_file(CountingSystem *system, gint64 hour, gint64 now_ms, int *restored)
+{
+    char filename[PERSIST_PATH_LENGTH];
+    get_log_filename(hour, filename, sizeof(filename));
+
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return false;
+
+    static guint8 payload[BLOCK_MAX_PAYLOAD];
+    guint8 header[BLOCK_HEADER_SIZE];
+    bool found = false;
+
+    while (true)
+    {
+        long position = ftell(file);
+        if (fread(header, 1, BLOCK_HEADER_SIZE, file) != BLOCK_HEADER_SIZE)
+            break;
+
+        int count = get_u16(header + 4);
+        size_t payload_length = get_u16(header + 6);
+        gint64 base_ms = (gint64)get_u64(header + 8);
+
+        bool valid = get_u32(header) == BLOCK_MAGIC && count > 0 && count <= VELOCITY_BLOCK_RECORDS &&
+                     payload_length <= BLOCK_MAX_PAYLOAD &&
+                     fread(payload, 1, payload_length, file) == payload_length &&
+                     persist_crc32(payload, payload_length) == get_u32(header + 16);
+
+        if (!valid)
+        {
+            // Torn or damaged block, look for the next header one byte further on
+            if (fseek(file, position + 1, SEEK_SET) != 0)
+                break;
+            continue;
+        }
+
+        // Blocks left over from the same hour a day earlier are stale
+        if (base_ms / MS_PER_HOUR != hour)
+            continue;
+
+        if (replay_block(system, payload, payload_length, count, base_ms, now_ms, restored))
+            found = true;
+    }
+
+    fclose(file);
+    return found;
+}
+
+// Rebuild the speed buckets from the files of the current and the previous hour
+int restore_velocity_log(CountingSystem *system)
+{
+    if (!system)
+        return 0;
+
+    gint64 now_ms = g_get_real_time() / 1000;
+    gint64 hour = now_ms / MS_PER_HOUR;
+    int restored = 0;
+
+    replay_log_file(system, hour - 1, now_ms, &restored);
+    if (replay_log_file(system, hour, now_ms, &restored))
+        log_hour = hour;
+
+    if (restored > 0)
+        syslog(LOG_INFO, "Restored %d velocity records", restored);
+    return restored;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "counting.h"
+
+// One log file per hour of the day, started over when the hour comes round again
+#define VELOCITY_LOG_FORMAT "/usr/local/packages/enixma_analytic/localdata/velocity_%02d.vlog"
+
+#define VELOCITY_BLOCK_RECORDS 256   // Records sealed into one block at most
+#define VELOCITY_BLOCK_SECONDS 10    // Age after which a partly filled block is sealed
+#define VELOCITY_SPEED_SCALE 10.0f   // Stored speed resolution, 0.1 km/h
+
+// Columnar per-vehicle speed log. Every block starts with a header holding its
+// base time, record count, payload length and CRC-32, followed by the columns:
+// zigzag varint delta-of-delta milliseconds, uint16 speed, class byte and a
+// line/lane byte.
+bool append_velocity_log(gint64 time_ms, float velocity, int class_id, int line_id, int lane);
+void flush_velocity_log(bool force);
+int restore_velocity_log(CountingSystem* system);
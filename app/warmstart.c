@@ -0,0 +1,293 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "warmstart.h"
+#include "persist.h"
+#include "incident.h"
+#include "detection.h"
+#include "fastcgi.h"
+
+#define WARM_START_MAGIC 0x4B525457u   // "WTRK"
+#define WARM_START_VERSION 3           // Raise whenever TrackSlot changes
+
+typedef struct
+{
+    guint32 magic;
+    guint32 version;
+    gint32 slots;
+    gint32 next_track_id;
+    gint64 saved_us;             // Wall-clock time of the save
+    gint64 saved_monotonic_us;   // Monotonic time of the save, goes back after a reboot
+    guint32 crc;
+    guint32 reserved;
+} WarmStartHeader;
+
+// One track, all zero while the slot is free
+typedef struct
+{
+    gint32 live;
+    gint32 track_id;
+    gint32 class_id;
+    gint32 age;
+    gint32 hits;
+    gint32 time_since_update;
+    float bbox[4];
+    float score;
+    float velocity[2];
+    float speed_kmh;
+    gint32 counted;
+    gint32 section_line;
+    gint64 section_start_us;
+    gint32 count_pending;
+    gint32 pending_line;
+    gint32 pending_lane;
+    gint32 pending_class;
+    gint32 pending_down;
+    float spot_speed_kmh;
+    gint64 point_time_us[2];
+    gint64 start_time;
+    gint64 event_check_start;
+    gint32 timer_active;
+    gint32 event_check_initialized;
+    gint32 event_detected;
+    gint32 trajectory_count;     // Points of the tail in use, oldest first
+    Point trajectory[WARM_START_POINTS];
+    CompactPath path;            // Whole path since the track appeared
+    guint32 crc;                 // CRC-32 of everything before it
+    guint32 reserved;
+} TrackSlot;
+
+// Slots as the file holds them, a save only queues the ones that differ
+static TrackSlot written[WARM_START_SLOTS];
+
+static off_t get_slot_offset(int slot)
+{
+    return (off_t)sizeof(WarmStartHeader) + (off_t)slot * (off_t)sizeof(TrackSlot);
+}
+
+static int find_slot(int track_id)
+{
+    for (int slot = 0; slot < WARM_START_SLOTS; slot++)
+    {
+        if (written[slot].live && written[slot].track_id == track_id)
+            return slot;
+    }
+    return -1;
+}
+
+static void fill_slot(TrackSlot *slot, const TrackedObject *obj)
+{
+    slot->live = 1;
+    slot->track_id = obj->track_id;
+    slot->class_id = obj->class_id;
+    slot->age = obj->age;
+    slot->hits = obj->hits;
+    slot->time_since_update = obj->time_since_update;
+    memcpy(slot->bbox, obj->bbox, sizeof(slot->bbox));
+    slot->score = obj->score;
+    slot->velocity[0] = obj->velocity[0];
+    slot->velocity[1] = obj->velocity[1];
+    slot->speed_kmh = obj->speed_kmh;
+    slot->counted = obj->counted;
+    slot->section_line = obj->section_line;
+    slot->section_start_us = obj->section_start_us;
+    slot->count_pending = obj->count_pending;
+    slot->pending_line = obj->pending_line;
+    slot->pending_lane = obj->pending_lane;
+    slot->pending_class = obj->pending_class;
+    slot->pending_down = obj->pending_down;
+    slot->spot_speed_kmh = obj->spot_speed_kmh;
+    slot->point_time_us[0] = obj->point_time_us[0];
+    slot->point_time_us[1] = obj->point_time_us[1];
+    slot->start_time = obj->start_time;
+    slot->event_check_start = obj->event_check_start;
+    slot->timer_active = obj->timer_active;
+    slot->event_check_initialized = obj->event_check_initialized;
+    slot->event_detected = obj->event_detected;
+
+    int first = obj->trajectory_count > WARM_START_POINTS ? obj->trajectory_count - WARM_START_POINTS : 0;
+    slot->trajectory_count = obj->trajectory_count - first;
+    memcpy(slot->trajectory, &obj->trajectory[first], sizeof(Point) * slot->trajectory_count);
+    slot->path = obj->path;
+
+    slot->crc = persist_crc32(slot, offsetof(TrackSlot, crc));
+}
+
+// Called about once a second between frames, the writes happen on the writer thread
+void save_warm_start(const Tracker *tracker)
+{
+    if (!tracker)
+        return;
+
+    static TrackSlot next[WARM_START_SLOTS];
+    int waiting[WARM_START_SLOTS];
+    int num_waiting = 0;
+    memset(next, 0, sizeof(next));
+
+    // Tracks stay in the slot they had, tentative ones are not worth keeping
+    for (int i = 0; i < tracker->count; i++)
+    {
+        const TrackedObject *obj = &tracker->objects[i];
+        if (obj->hits < tracker->min_hits && !obj->counted)
+            continue;
+
+        int slot = find_slot(obj->track_id);
+        if (slot >= 0)
+            fill_slot(&next[slot], obj);
+        else if (num_waiting < WARM_START_SLOTS)
+            waiting[num_waiting++] = i;
+    }
+
+    // New tracks take the free slots, including those of tracks that ended
+    int slot = 0;
+    for (int k = 0; k < num_waiting; k++)
+    {
+        while (slot < WARM_START_SLOTS && next[slot].live)
+            slot++;
+        if (slot == WARM_START_SLOTS)
+            break;
+        fill_slot(&next[slot], &tracker->objects[waiting[k]]);
+    }
+
+    // One write per run of changed slots
+    for (int first = 0; first < WARM_START_SLOTS;)
+    {
+        if (memcmp(&next[first], &written[first], sizeof(TrackSlot)) == 0)
+        {
+            first++;
+            continue;
+        }
+
+        int end = first + 1;
+        while (end < WARM_START_SLOTS && memcmp(&next[end], &written[end], sizeof(TrackSlot)) != 0)
+            end++;
+
+        if (!persist_write_at(WARM_START_FILE, get_slot_offset(first), &next[first], sizeof(TrackSlot) * (size_t)(end - first)))
+            syslog(LOG_ERR, "Failed to queue tracks for %s", WARM_START_FILE);
+        first = end;
+    }
+    memcpy(written, next, sizeof(written));
+
+    // The header goes last and dates the slots written before it
+    WarmStartHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = WARM_START_MAGIC;
+    header.version = WARM_START_VERSION;
+    header.slots = WARM_START_SLOTS;
+    header.next_track_id = tracker->next_track_id;
+    header.saved_us = g_get_real_time();
+    header.saved_monotonic_us = g_get_monotonic_time();
+    header.crc = persist_crc32(&header, offsetof(WarmStartHeader, crc));
+    persist_write_at(WARM_START_FILE, 0, &header, sizeof(header));
+}
+
+// Rebuild a track from its slot, moved on by the time the restart took
+static void restore_slot(TrackedObject *obj, const TrackSlot *slot, gint64 age_us)
+{
+    memset(obj, 0, sizeof(TrackedObject));
+    obj->track_id = slot->track_id;
+    obj->class_id = slot->class_id;
+    obj->age = slot->age;
+    obj->hits = slot->hits;
+    obj->time_since_update = slot->time_since_update;
+    obj->score = slot->score;
+    obj->counted = slot->counted != 0;
+    obj->section_line = slot->section_line;
+    obj->section_start_us = slot->section_start_us;
+    obj->count_pending = slot->count_pending != 0;
+    obj->pending_line = slot->pending_line;
+    obj->pending_lane = slot->pending_lane;
+    obj->pending_class = slot->pending_class;
+    obj->pending_down = slot->pending_down != 0;
+    obj->spot_speed_kmh = slot->spot_speed_kmh;
+    obj->point_time_us[0] = slot->point_time_us[0];
+    obj->point_time_us[1] = slot->point_time_us[1];
+    obj->start_time = (time_t)slot->start_time;
+    obj->event_check_start = (time_t)slot->event_check_start;
+    obj->timer_active = slot->timer_active != 0;
+    obj->event_check_initialized = slot->event_check_initialized != 0;
+    obj->event_detected = slot->event_detected != 0;
+
+    int count = slot->trajectory_count;
+    if (count < 0 || count > WARM_START_POINTS)
+        count = 0;
+    memcpy(obj->trajectory, slot->trajectory, sizeof(Point) * count);
+    obj->trajectory_count = count;
+
+    // The whole path comes back with its entry point, a count out of range starts it over
+    obj->path = slot->path;
+    if (obj->path.count < 0 || obj->path.count > PATH_CAPACITY)
+        init_compact_path(&obj->path, count > 0 ? obj->trajectory[0].x : 0.0f, count > 0 ? obj->trajectory[0].y : 0.0f);
+
+    // Velocity is per frame, so the box moves on as far as the vehicle did meanwhile
+    float frames = frame_time > 0 ? (float)age_us / 1000000.0f / frame_time : 0.0f;
+    obj->bbox[0] = slot->bbox[0] + slot->velocity[1] * frames;
+    obj->bbox[1] = slot->bbox[1] + slot->velocity[0] * frames;
+    obj->bbox[2] = slot->bbox[2] + slot->velocity[1] * frames;
+    obj->bbox[3] = slot->bbox[3] + slot->velocity[0] * frames;
+
+    // The speed window starts over, the last speed holds until it has two samples
+    if (count > 0)
+    {
+        add_speed_sample(obj, obj->trajectory[count - 1].x, obj->trajectory[count - 1].y, g_get_monotonic_time(),
+                         pixels_per_meter, context.resolution.widthFrameHD, context.resolution.heightFrameHD);
+    }
+    obj->velocity[0] = slot->velocity[0];
+    obj->velocity[1] = slot->velocity[1];
+    obj->speed_kmh = slot->speed_kmh;
+
+    restore_object_timer(obj);
+}
+
+// Put the tracks of a save from the last few seconds back into the empty tracker
+int restore_warm_start(Tracker *tracker)
+{
+    if (!tracker)
+        return 0;
+
+    int fd = open(WARM_START_FILE, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    WarmStartHeader header;
+    bool valid = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 header.magic == WARM_START_MAGIC && header.version == WARM_START_VERSION &&
+                 header.slots == WARM_START_SLOTS &&
+                 header.crc == persist_crc32(&header, offsetof(WarmStartHeader, crc));
+
+    // Slots as they are on disk, whatever they hold, so the next save writes what differs
+    if (pread(fd, written, sizeof(written), (off_t)sizeof(WarmStartHeader)) < 0)
+        memset(written, 0, sizeof(written));
+    close(fd);
+
+    if (!valid)
+        return 0;
+
+    // A reboot restarts the monotonic clock, the wall clock catches what that misses
+    gint64 age_us = g_get_monotonic_time() - header.saved_monotonic_us;
+    gint64 real_age_us = g_get_real_time() - header.saved_us;
+    gint64 max_age_us = (gint64)WARM_START_MAX_AGE_SECONDS * G_USEC_PER_SEC;
+    if (age_us < 0 || age_us > max_age_us || real_age_us < -max_age_us || real_age_us > max_age_us)
+        return 0;
+
+    int restored = 0;
+    TrackedObject obj;
+    for (int slot = 0; slot < WARM_START_SLOTS; slot++)
+    {
+        const TrackSlot *saved = &written[slot];
+        if (!saved->live || saved->crc != persist_crc32(saved, offsetof(TrackSlot, crc)))
+            continue;
+
+        restore_slot(&obj, saved, age_us);
+        if (restore_track(tracker, &obj))
+            restored++;
+    }
+    tracker->next_track_id = header.next_track_id;
+
+    syslog(LOG_INFO, "Restored %d tracks saved %lld ms before the restart", restored, (long long)(age_us / 1000));
+    return restored;
+}
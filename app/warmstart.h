@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "deepsort.h"
+
+#define WARM_START_FILE "/usr/local/packages/enixma_analytic/localdata/tracks.bin"
+
+#define WARM_START_SLOTS 128          // Live tracks kept, one fixed slot each
+#define WARM_START_POINTS 8           // Newest trajectory points kept per track
+#define WARM_START_MAX_AGE_SECONDS 5  // Older snapshots are ignored at startup
+
+// Live tracks saved about once a second, so a restart within a few seconds picks the
+// vehicles in the scene up again with their ids, paths, counted flags, timers and
+// section state, counts still waiting for a section speed included, instead of counting
+// them a second time. A track keeps its slot while it lives and only slots that changed are
+// queued to the writer thread, after them the header with the time of the save.
+void save_warm_start(const Tracker* tracker);
+int restore_warm_start(Tracker* tracker);